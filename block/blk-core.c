@@ -1763,6 +1763,34 @@ end_io:
 	return false;
 }
 
+/*
+ * Passes the bio to the dedup, after it was remapped to the device it lands
+ * on: partitions by blk_partition_remap(), stacked devices (dm) by their
+ * make_request_fn, which resubmits the remapped bios to this loop.
+ * return 1 if the bio was taken care of and must not be submitted
+ */
+static int dedup_make_request(struct bio *bio)
+{
+	if (dedup_wait_for_init() || !dedup_map_bio(bio))
+		return 0;
+
+	if (bio->bi_rw & WRITE) {
+		// A rewrite of the content already on the device isn't sent
+		if (dedup_suppress_same_write(bio))
+			return 1;
+
+		dedup_track_head(bio);
+		// Written blocks are hashed when the write completes
+		dedup_make_write_request(bio);
+	}
+	// Check if the read can be served without going to the block device
+	else if (dedup_make_read_request(bio))
+		return 1;
+
+	dedup_unmap_bio(bio);
+	return 0;
+}
+
 /**
  * generic_make_request - hand a buffer to its device driver for I/O
  * @bio:  The bio describing the location in memory and on the device.
@@ -1809,40 +1837,6 @@ void generic_make_request(struct bio *bio)
 		return;
 	}
 
-	if (!dedup_wait_for_init() && (bio->bi_rw & WRITE)) {
-
-		// Check if the page is accosiated with our block device
-		if (dedup_is_our_bdev(bio->bi_bdev)) {
-
-			sector_t changed_block = (unsigned long long)bio->bi_sector >> 3;
-
-			// Check if the block is in our dedup range
-			if (dedup_is_in_range(changed_block)) {
-				int i=0;
-				struct bio_vec *bvec;
-				char *p = (char*)kmalloc(dedup_get_block_size(), GFP_KERNEL);
-
-				printk("[%ld] [%llu] [%d] [%d] [%ld]\n",
-					bio->bi_sector,
-					(unsigned long long)bio->bi_sector >> 3,
-					bio_sectors(bio),
-					bio->bi_size,
-					bio_sector_offset(bio, bio_sectors(bio), 0));
-
-				// Go over each bio and update its block new data hash and crc
-				bio_for_each_segment_all(bvec, bio, i) {
-					char *addr = page_address(bvec->bv_page);
-					int len = bvec->bv_len;
-					memcpy(p, addr + bvec->bv_offset, len);
-					// TODO: use page_address instead of copying it - low priority
-					dedup_update_page_changed(changed_block + i, p);
-				}
-
-				kfree(p);
-			}
-		}
-	}
-
 	/* following loop may be a bit non-obvious, and so deserves some
 	 * explanation.
 	 * Before entering the loop, bio->bi_next is NULL (as all callers
@@ -1861,9 +1855,13 @@ void generic_make_request(struct bio *bio)
 	bio_list_init(&bio_list_on_stack);
 	current->bio_list = &bio_list_on_stack;
 	do {
-		struct request_queue *q = bdev_get_queue(bio->bi_bdev);
+		struct request_queue *q;
 
-		q->make_request_fn(q, bio);
+		if (!dedup_make_request(bio)) {
+			// The dedup may have moved the bio to another device
+			q = bdev_get_queue(bio->bi_bdev);
+			q->make_request_fn(q, bio);
+		}
 
 		bio = bio_list_pop(current->bio_list);
 	} while (bio);
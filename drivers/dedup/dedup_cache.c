@@ -0,0 +1,328 @@
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/hashtable.h>
+#include <linux/list.h>
+#include <linux/math64.h>
+#include <linux/dedup.h>
+
+/*
+ * Content addressed cache of duplicated blocks.
+ *
+ * Holds one copy of the data of hot duplicated content, keyed by its hash, so
+ * reads of any block with this content can be served after all the page cache
+ * pages holding it were evicted. Entries are added when a read of a block with
+ * equal blocks completes, and the cache is looked up before a read bio is sent
+ * to the block device.
+ *
+ * Eviction is a weighted CLOCK: each entry gets as many chances as the number
+ * of blocks sharing its content (capped), a hit gives them back, and the clock
+ * hand takes one on every pass. The hand moves over a bounded number of entries
+ * per eviction, taking the one with the fewest chances left if none ran out,
+ * so an insert never walks the whole cache with interrupts off.
+ *
+ * Pinned entries (boot prewarm) are not in the clock, they stay until the
+ * cache is dropped and don't count in its size.
+ */
+
+#define DEDUP_CACHE_HASH_BITS 10
+// Max number of chances an entry gets, no matter how many blocks share it
+#define DEDUP_CACHE_MAX_WEIGHT 64
+// Max entries the clock hand passes on one eviction
+#define DEDUP_CACHE_EVICT_SCAN 32
+// Max entries removed under one hold of cache_lock when shrinking the cache
+#define DEDUP_CACHE_EVICT_BATCH 64
+
+struct dedup_cache_entry {
+	struct hlist_node node;		// hashed by content crc
+	struct list_head clock;		// position in the clock
+	u32 crc;
+	u8 hash[SHA256_DIGEST_SIZE];
+	struct page *page;			// block data, at offset 0
+	int weight;					// number of blocks with this content
+	int credit;					// chances left before eviction
+	int pinned;					// never evicted
+};
+
+static DEFINE_HASHTABLE(cache_entries, DEDUP_CACHE_HASH_BITS);
+// Clock hand is at the list head
+static LIST_HEAD(cache_clock);
+static DEFINE_SPINLOCK(cache_lock);
+
+// Max cached blocks, 0 means the cache is off
+static long cache_max_blocks = 0;
+static long cache_blocks = 0;
+static long cache_pinned_blocks = 0;
+
+// Statistics, protected by cache_lock
+static long cache_hits = 0, cache_misses = 0;
+static long cache_inserts = 0, cache_evictions = 0;
+
+/*
+ * Look for a cached entry with the given content.
+ * Must be called with cache_lock held.
+ */
+static struct dedup_cache_entry *dedup_cache_find(u32 crc, const u8 *hash)
+{
+	struct dedup_cache_entry *entry;
+
+	hash_for_each_possible(cache_entries, entry, node, crc) {
+		if (entry->crc == crc && memcmp(entry->hash, hash, SHA256_DIGEST_SIZE) == 0)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/*
+ * Removes the entry from the cache and returns its page to be freed.
+ * Must be called with cache_lock held.
+ */
+static struct page *dedup_cache_remove(struct dedup_cache_entry *entry)
+{
+	struct page *page = entry->page;
+
+	hash_del(&entry->node);
+	list_del(&entry->clock);
+	if (entry->pinned)
+		--cache_pinned_blocks;
+	else
+		--cache_blocks;
+	kfree(entry);
+
+	return page;
+}
+
+/*
+ * Moves the clock hand until an entry runs out of chances, and evicts it.
+ * After DEDUP_CACHE_EVICT_SCAN entries the passed entry with the fewest
+ * chances left is evicted.
+ * Must be called with cache_lock held.
+ */
+static struct page *dedup_cache_evict(void)
+{
+	struct dedup_cache_entry *entry, *victim = NULL;
+	int scanned;
+
+	for (scanned = 0; scanned < DEDUP_CACHE_EVICT_SCAN && !list_empty(&cache_clock); ++scanned) {
+		entry = list_first_entry(&cache_clock, struct dedup_cache_entry, clock);
+		if (--entry->credit <= 0) {
+			victim = entry;
+			break;
+		}
+
+		if (!victim || entry->credit < victim->credit)
+			victim = entry;
+		list_move_tail(&entry->clock, &cache_clock);
+	}
+
+	if (!victim)
+		return NULL;
+
+	++cache_evictions;
+	return dedup_cache_remove(victim);
+}
+
+/*
+ * return 1 if the cache is on
+ */
+int dedup_cache_enabled(void)
+{
+	return (cache_max_blocks != 0);
+}
+
+/*
+ * return 1 if the cache has entries to look up
+ */
+static int dedup_cache_has_entries(void)
+{
+	return (cache_max_blocks != 0 || cache_pinned_blocks != 0);
+}
+
+/*
+ * Returns the cached page holding the content, with an elevated reference
+ * count, or NULL if it's not cached. Block data is at the start of the page.
+ */
+struct page *dedup_cache_get_page(u32 crc, const u8 *hash)
+{
+	struct dedup_cache_entry *entry;
+	struct page *page = NULL;
+	unsigned long flags;
+
+	if (!dedup_cache_has_entries())
+		return NULL;
+
+	spin_lock_irqsave(&cache_lock, flags);
+	entry = dedup_cache_find(crc, hash);
+	if (entry) {
+		entry->credit = entry->weight;
+		page = entry->page;
+		get_page(page);
+		++cache_hits;
+	}
+	else
+		++cache_misses;
+	spin_unlock_irqrestore(&cache_lock, flags);
+
+	return page;
+}
+
+/*
+ * Adds a copy of the block's data to the cache.
+ * weight is the number of blocks sharing this content.
+ * A pinned entry is added even when the cache is off, and an existing entry
+ * with this content gets pinned.
+ * May be called from bio completion.
+ */
+static void __dedup_cache_insert(u32 crc, const u8 *hash, struct page *page,
+								 unsigned int offset, int weight, int pinned)
+{
+	struct dedup_cache_entry *entry;
+	struct page *old_page = NULL;
+	char *src, *dst;
+	unsigned long flags;
+
+	if (!cache_max_blocks && !pinned)
+		return;
+
+	// Quick check, we check again before adding
+	spin_lock_irqsave(&cache_lock, flags);
+	entry = dedup_cache_find(crc, hash);
+	if (entry && pinned && !entry->pinned) {
+		list_del_init(&entry->clock);
+		entry->pinned = 1;
+		--cache_blocks;
+		++cache_pinned_blocks;
+	}
+	spin_unlock_irqrestore(&cache_lock, flags);
+	if (entry)
+		return;
+
+	entry = kmalloc(sizeof(*entry), GFP_ATOMIC | __GFP_NOWARN);
+	if (!entry)
+		return;
+
+	entry->page = alloc_page(GFP_ATOMIC | __GFP_NOWARN);
+	if (!entry->page) {
+		kfree(entry);
+		return;
+	}
+
+	src = kmap_atomic(page);
+	dst = kmap_atomic(entry->page);
+	memcpy(dst, src + offset, dedup_get_block_size());
+	kunmap_atomic(dst);
+	kunmap_atomic(src);
+
+	entry->crc = crc;
+	memcpy(entry->hash, hash, SHA256_DIGEST_SIZE);
+	entry->weight = (weight > DEDUP_CACHE_MAX_WEIGHT) ? DEDUP_CACHE_MAX_WEIGHT : weight;
+	entry->credit = entry->weight;
+	entry->pinned = pinned;
+
+	spin_lock_irqsave(&cache_lock, flags);
+	if (dedup_cache_find(crc, hash)) {
+		// Someone cached it while we were copying
+		old_page = entry->page;
+		kfree(entry);
+	}
+	else if (pinned) {
+		hash_add(cache_entries, &entry->node, crc);
+		INIT_LIST_HEAD(&entry->clock);
+		++cache_pinned_blocks;
+		++cache_inserts;
+	}
+	else {
+		if (cache_blocks >= cache_max_blocks)
+			old_page = dedup_cache_evict();
+
+		hash_add(cache_entries, &entry->node, crc);
+		list_add_tail(&entry->clock, &cache_clock);
+		++cache_blocks;
+		++cache_inserts;
+	}
+	spin_unlock_irqrestore(&cache_lock, flags);
+
+	if (old_page)
+		put_page(old_page);
+}
+
+void dedup_cache_insert(u32 crc, const u8 *hash, struct page *page,
+						unsigned int offset, int weight)
+{
+	__dedup_cache_insert(crc, hash, page, offset, weight, 0);
+}
+
+/*
+ * Adds the block's data to the cache as a pinned entry
+ */
+void dedup_cache_pin(u32 crc, const u8 *hash, struct page *page, unsigned int offset)
+{
+	__dedup_cache_insert(crc, hash, page, offset, DEDUP_CACHE_MAX_WEIGHT, 1);
+}
+
+/*
+ * Sets max number of cached blocks, 0 turns the cache off and empties it,
+ * pinned entries included.
+ * Entries are removed in batches, cache_lock is dropped between them.
+ */
+void dedup_cache_set_size(long max_blocks)
+{
+	struct dedup_cache_entry *entry;
+	struct hlist_node *tmp_node;
+	LIST_HEAD(evicted);
+	struct page *page, *tmp;
+	unsigned long flags;
+	int bkt, nr, more;
+
+	do {
+		nr = 0;
+		spin_lock_irqsave(&cache_lock, flags);
+		cache_max_blocks = max_blocks;
+		while (nr < DEDUP_CACHE_EVICT_BATCH && cache_blocks > cache_max_blocks) {
+			page = dedup_cache_evict();
+			if (!page)
+				break;
+			list_add(&page->lru, &evicted);
+			++nr;
+		}
+
+		if (!max_blocks) {
+			hash_for_each_safe(cache_entries, bkt, tmp_node, entry, node) {
+				if (nr >= DEDUP_CACHE_EVICT_BATCH)
+					break;
+				page = dedup_cache_remove(entry);
+				list_add(&page->lru, &evicted);
+				++nr;
+			}
+		}
+		more = (cache_blocks > cache_max_blocks ||
+				(!max_blocks && cache_pinned_blocks));
+		spin_unlock_irqrestore(&cache_lock, flags);
+
+		list_for_each_entry_safe(page, tmp, &evicted, lru) {
+			list_del(&page->lru);
+			put_page(page);
+		}
+		cond_resched();
+	} while (more && nr);
+}
+
+/*
+ * Prints cache statistics, used by stats_show()
+ */
+void dedup_print_cache_stats(void)
+{
+	long lookups = cache_hits + cache_misses;
+
+	printk(KERN_ERR "cache blocks = %ld (max = %ld), pinned = %ld, %ld KB\n",
+		   cache_blocks, cache_max_blocks, cache_pinned_blocks,
+		   (cache_blocks + cache_pinned_blocks) * (PAGE_SIZE >> 10));
+	printk(KERN_ERR "cache hits = %ld, misses = %ld, hit rate = %ld%%\n",
+		   cache_hits, cache_misses, (lookups) ? cache_hits * 100 / lookups : 0);
+	printk(KERN_ERR "cache inserts = %ld, evictions = %ld\n",
+		   cache_inserts, cache_evictions);
+}
@@ -0,0 +1,337 @@
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/hashtable.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/dedup.h>
+
+/*
+ * Resident representatives of duplicated content.
+ *
+ * Finding a cached page of an equal block used to walk the whole equal blocks
+ * ring and probe each block's page, which is O(class size) on every miss (the
+ * zero block class can have hundreds of thousands of blocks).
+ * Instead each content with resident pages keeps up to DEDUP_CLASS_REPS
+ * blocks whose page is in the page cache. A block is added when its page is
+ * read or written, and removed when the block is written again or when the
+ * page leaves the page cache (cleancache put, while the compressed pool is
+ * registered). A page that left without us knowing is found stale and removed
+ * on lookup.
+ * A lookup only checks these blocks.
+ */
+
+#define DEDUP_CLASS_HASH_BITS 12
+// Max resident blocks kept for each content
+#define DEDUP_CLASS_REPS 4
+
+struct dedup_class_reps {
+	struct hlist_node node;		// hashed by content crc
+	u32 crc;
+	u8 hash[SHA256_DIGEST_SIZE];
+	int nr_blocks;
+	sector_t blocks[DEDUP_CLASS_REPS];
+};
+
+static DEFINE_HASHTABLE(class_reps, DEDUP_CLASS_HASH_BITS);
+static DEFINE_SPINLOCK(class_lock);
+
+// Statistics, protected by class_lock
+static long class_lookups = 0, class_hits = 0, class_stale = 0;
+
+/*
+ * Look for the content's representatives.
+ * Must be called with class_lock held.
+ */
+static struct dedup_class_reps *dedup_class_find(u32 crc, const u8 *hash)
+{
+	struct dedup_class_reps *reps;
+
+	hash_for_each_possible(class_reps, reps, node, crc) {
+		if (reps->crc == crc && memcmp(reps->hash, hash, SHA256_DIGEST_SIZE) == 0)
+			return reps;
+	}
+
+	return NULL;
+}
+
+/*
+ * Removes the block from the representatives, freeing them when empty.
+ * Must be called with class_lock held.
+ */
+static void dedup_class_del(struct dedup_class_reps *reps, sector_t block)
+{
+	int i;
+
+	for (i = 0; i < reps->nr_blocks; ++i) {
+		if (reps->blocks[i] == block) {
+			reps->blocks[i] = reps->blocks[--reps->nr_blocks];
+			break;
+		}
+	}
+
+	if (!reps->nr_blocks) {
+		hash_del(&reps->node);
+		kfree(reps);
+	}
+}
+
+/*
+ * return 1 if the block is known and has the given content
+ */
+static int dedup_block_has_hash(sector_t block, u32 crc, const u8 *hash)
+{
+	u8 block_hash[SHA256_DIGEST_SIZE];
+	u32 block_crc;
+
+	return (dedup_get_block_hash(block, block_hash, &block_crc) && block_crc == crc &&
+			memcmp(block_hash, hash, SHA256_DIGEST_SIZE) == 0);
+}
+
+/*
+ * The block's page was added to the page cache, or was just written
+ */
+void dedup_class_add_block(sector_t block)
+{
+	struct dedup_class_reps *reps, *new_reps = NULL;
+	u8 hash[SHA256_DIGEST_SIZE];
+	unsigned long flags;
+	u32 crc;
+	int i;
+
+	if (!dedup_block_has_duplicates(block) || !dedup_get_block_hash(block, hash, &crc))
+		return;
+
+	spin_lock_irqsave(&class_lock, flags);
+	reps = dedup_class_find(crc, hash);
+	spin_unlock_irqrestore(&class_lock, flags);
+
+	if (!reps) {
+		new_reps = kmalloc(sizeof(*new_reps), GFP_NOIO);
+		if (!new_reps)
+			return;
+
+		new_reps->crc = crc;
+		memcpy(new_reps->hash, hash, SHA256_DIGEST_SIZE);
+		new_reps->nr_blocks = 0;
+	}
+
+	spin_lock_irqsave(&class_lock, flags);
+	reps = dedup_class_find(crc, hash);
+	if (!reps) {
+		reps = new_reps;
+		new_reps = NULL;
+		hash_add(class_reps, &reps->node, crc);
+	}
+
+	for (i = 0; i < reps->nr_blocks; ++i) {
+		if (reps->blocks[i] == block)
+			break;
+	}
+
+	// When full the newest page replaces the oldest one
+	if (i == reps->nr_blocks) {
+		if (reps->nr_blocks == DEDUP_CLASS_REPS)
+			memmove(&reps->blocks[0], &reps->blocks[1],
+					(DEDUP_CLASS_REPS - 1) * sizeof(sector_t));
+		else
+			++reps->nr_blocks;
+		reps->blocks[reps->nr_blocks - 1] = block;
+	}
+	spin_unlock_irqrestore(&class_lock, flags);
+
+	kfree(new_reps);
+
+	// A write of the block may have started meanwhile, and removed it
+	// before we added it
+	if (!dedup_block_has_hash(block, crc, hash))
+		dedup_class_remove_block_hash(block, crc, hash);
+}
+
+/*
+ * Removes the block from the representatives of the given content.
+ * Safe to call with interrupts off.
+ */
+void dedup_class_remove_block_hash(sector_t block, u32 crc, const u8 *hash)
+{
+	struct dedup_class_reps *reps;
+	unsigned long flags;
+
+	spin_lock_irqsave(&class_lock, flags);
+	reps = dedup_class_find(crc, hash);
+	if (reps)
+		dedup_class_del(reps, block);
+	spin_unlock_irqrestore(&class_lock, flags);
+}
+
+/*
+ * The block's page left the page cache, or the block's content is about to
+ * change. Must be called before the block's hash is updated.
+ * Safe to call with interrupts off.
+ */
+void dedup_class_remove_block(sector_t block)
+{
+	u8 hash[SHA256_DIGEST_SIZE];
+	u32 crc;
+
+	if (dedup_get_block_hash(block, hash, &crc))
+		dedup_class_remove_block_hash(block, crc, hash);
+}
+
+/*
+ * Lookup that doesn't sleep: tries a snapshot of the representatives, those
+ * of file pages aren't looked up. A representative not found may just be one
+ * we can't look up here, so none is removed, stale ones are removed by
+ * lookups that may sleep or when their block is written.
+ */
+static struct page *dedup_class_get_page_nowait(u32 crc, const u8 *hash,
+												sector_t *rep_block, unsigned int *offset)
+{
+	sector_t blocks[DEDUP_CLASS_REPS];
+	struct dedup_class_reps *reps;
+	struct page *page = NULL;
+	unsigned long flags;
+	int i, nr = 0;
+
+	spin_lock_irqsave(&class_lock, flags);
+	++class_lookups;
+	reps = dedup_class_find(crc, hash);
+	if (reps) {
+		nr = reps->nr_blocks;
+		memcpy(blocks, reps->blocks, nr * sizeof(sector_t));
+	}
+	spin_unlock_irqrestore(&class_lock, flags);
+
+	for (i = nr - 1; i >= 0 && !page; --i) {
+		page = dedup_get_block_data(blocks[i], offset, 0);
+		*rep_block = blocks[i];
+	}
+
+	if (page) {
+		spin_lock_irqsave(&class_lock, flags);
+		++class_hits;
+		spin_unlock_irqrestore(&class_lock, flags);
+	}
+
+	return page;
+}
+
+/*
+ * Returns a resident page holding the block's content, with an elevated
+ * reference count, and the content's offset inside it, or NULL if there is
+ * none. Only the content's representatives are checked, whatever its size is.
+ * Without may_sleep only pages found without sleeping are returned.
+ */
+struct page *dedup_class_get_page(sector_t block, unsigned int *offset, int may_sleep)
+{
+	struct dedup_class_reps *reps;
+	u8 hash[SHA256_DIGEST_SIZE];
+	struct page *page = NULL;
+	sector_t rep_block;
+	unsigned long flags;
+	u32 crc;
+
+	if (!dedup_get_block_hash(block, hash, &crc))
+		return NULL;
+
+	if (!may_sleep) {
+		page = dedup_class_get_page_nowait(crc, hash, &rep_block, offset);
+		goto out;
+	}
+
+	spin_lock_irqsave(&class_lock, flags);
+	++class_lookups;
+	while ((reps = dedup_class_find(crc, hash)) != NULL) {
+		rep_block = reps->blocks[reps->nr_blocks - 1];
+		spin_unlock_irqrestore(&class_lock, flags);
+
+		page = dedup_get_block_data(rep_block, offset, 1);
+
+		spin_lock_irqsave(&class_lock, flags);
+		if (page) {
+			++class_hits;
+			break;
+		}
+
+		// Page is gone, forget it and try the next one
+		++class_stale;
+		reps = dedup_class_find(crc, hash);
+		if (reps)
+			dedup_class_del(reps, rep_block);
+	}
+	spin_unlock_irqrestore(&class_lock, flags);
+
+out:
+	if (page && DEDUP_BLOCK_DEV(rep_block) != DEDUP_BLOCK_DEV(block))
+		dedup_dev_add_remote_block(block);
+
+	return page;
+}
+
+/*
+ * The way cached pages of equal blocks were found before: walk the ring
+ * and probe each block. Kept for the benchmark.
+ */
+static struct page *dedup_class_walk_page(sector_t block)
+{
+	sector_t equal_block = dedup_get_next_equal_block(block);
+	struct page *page;
+
+	while (equal_block != block) {
+		page = dedup_get_block_page(equal_block);
+		if (page)
+			return page;
+
+		equal_block = dedup_get_next_equal_block(equal_block);
+	}
+
+	return NULL;
+}
+
+/*
+ * Times iterations lookups of a cached page of the block's equal blocks,
+ * walking the ring vs. using the representatives.
+ */
+void dedup_class_bench(sector_t block, long iterations)
+{
+	struct page *page;
+	unsigned int offset;
+	ktime_t start;
+	u64 walk_ns, reps_ns;
+	long i;
+
+	if (!dedup_is_in_range(block) || iterations <= 0)
+		return;
+
+	start = ktime_get();
+	for (i = 0; i < iterations; ++i) {
+		page = dedup_class_walk_page(block);
+		if (page)
+			page_cache_release(page);
+	}
+	walk_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	start = ktime_get();
+	for (i = 0; i < iterations; ++i) {
+		page = dedup_class_get_page(block, &offset, 1);
+		if (page)
+			page_cache_release(page);
+	}
+	reps_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	printk(KERN_ERR "class of block %llu: %d blocks, cached page %s\n",
+		   (unsigned long long)block, dedup_get_class_size(block, INT_MAX),
+		   (page) ? "found" : "not found");
+	printk(KERN_ERR "ring walk = %llu ns/lookup, representatives = %llu ns/lookup\n",
+		   div64_u64(walk_ns, iterations), div64_u64(reps_ns, iterations));
+}
+
+/*
+ * Prints representatives statistics, used by stats_show()
+ */
+void dedup_print_class_stats(void)
+{
+	printk(KERN_ERR "class lookups = %ld, hits = %ld, stale representatives = %ld\n",
+		   class_lookups, class_hits, class_stale);
+}
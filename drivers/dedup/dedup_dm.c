@@ -0,0 +1,1132 @@
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/bitmap.h>
+#include <linux/log2.h>
+#include <linux/crc32.h>
+#include <linux/device-mapper.h>
+#include <linux/dm-io.h>
+#include <crypto/hash.h>
+#include <linux/scatterlist.h>
+#include <linux/dedup.h>
+
+#define DM_MSG_PREFIX "dedup"
+
+/*
+ * Write deduplication target.
+ *
+ * The read path only avoids redundant reads, duplicate writes still take disk
+ * space. This target stores each content once: logical blocks are mapped to
+ * physical blocks of the data device, and a physical block is referenced by
+ * all the logical blocks with its content.
+ *
+ * 	dmsetup create <name> --table "0 <sectors> dedup <metadata dev> <data dev> <block sectors>"
+ *
+ * Blocks are the target's logical block size, so each bio is one block.
+ * A written block is fingerprinted with sha256 like the dedup index does,
+ * and looked up in a hash table of the fingerprints of stored blocks:
+ * 	- known content: the logical block is mapped to the existing physical
+ * 	  block, nothing is written.
+ * 	- zeros: the logical block is unmapped, reads of unmapped blocks are
+ * 	  filled with zeros.
+ * 	- new content: written to a free physical block, which is mapped and
+ * 	  fingerprinted once the write completed.
+ * A block with a known fingerprint is read back and compared with the written
+ * data before it's shared, so a fingerprint collision stores the data in a
+ * block of its own instead of mapping it to other content.
+ *
+ * Metadata device layout (4K blocks):
+ * 	superblock | map: le64 physical block + 1 per logical block, 0 if unmapped |
+ * 	hashes: sha256 of each physical block
+ * All of it is kept in memory as it's on disk, up to 1/DEDUP_DM_MAX_META_RAM
+ * of RAM with the in-memory tables of the physical blocks, and dirty blocks are written
+ * back on flush/FUA and every DEDUP_DM_COMMIT_PERIOD: data is flushed, then
+ * the hashes, then the map, then the superblock with FLUSH/FUA. Reference
+ * counts are not stored, they are counted from the map on load, so a crash
+ * never leaks blocks.
+ * Garbage collection: a physical block whose last reference is dropped leaves
+ * the fingerprint table right away, but is reused only after the next commit,
+ * when the map on disk no longer points at it. 'dmsetup message <name> 0 gc'
+ * commits and releases them at once.
+ */
+
+#define DEDUP_DM_MAGIC		0x64647570	// "ddup"
+#define DEDUP_DM_VERSION	1
+#define DEDUP_DM_META_SHIFT	12
+#define DEDUP_DM_META_SIZE	(1 << DEDUP_DM_META_SHIFT)
+// No physical block
+#define DEDUP_DM_NO_BLOCK	U32_MAX
+// Metadata is committed at least this often while it's dirty
+#define DEDUP_DM_COMMIT_PERIOD	HZ
+// Max blocks of a discard bio, so the lock is not held for long
+#define DEDUP_DM_DISCARD_BLOCKS	1024
+// Metadata and block tables kept in memory may take up to 1/8 of RAM
+#define DEDUP_DM_MAX_META_RAM	8
+// Max metadata blocks read by one I/O on load
+#define DEDUP_DM_LOAD_BLOCKS	256
+
+struct dedup_dm_super {
+	__le32 magic;
+	__le32 version;
+	__le32 block_size;			// bytes
+	__le32 padding;
+	__le64 nr_logical;
+	__le64 nr_physical;
+	__le64 generation;			// commits so far
+	__le32 csum;				// crc32 of the fields above
+} __packed;
+
+struct dedup_dm {
+	struct dm_target *ti;
+	struct dm_dev *meta_dev;
+	struct dm_dev *data_dev;
+	sector_t block_sectors;
+	int block_shift;			// sectors to blocks
+	sector_t nr_logical;
+	u32 nr_physical;
+
+	// Protects everything below up to the statistics
+	spinlock_t lock;
+	void *meta;					// metadata as on disk
+	struct dedup_dm_super *sb;
+	__le64 *map;
+	u8 (*hashes)[SHA256_DIGEST_SIZE];
+	unsigned long map_block, hash_block, nr_meta_blocks;
+	unsigned long *dirty;		// metadata blocks to write back
+	u32 *refcount;				// map references and I/O in flight
+	unsigned long *pending;		// freed since the last commit started
+	unsigned long *committing;	// freed before the running commit started
+	u32 alloc_cursor;
+	// Fingerprints of stored blocks, chained by physical block
+	u32 *fp_heads;
+	u32 *fp_next;
+	u32 fp_mask;
+	unsigned long *indexed;
+	struct bio_list deferred;	// writes to fingerprint
+	struct bio_list completed;	// writes done on the data device
+	struct bio_list flushes;
+	int gc;						// commit asked by a gc message
+
+	// Statistics, protected by lock
+	u64 mapped, used, reads, zero_reads, writes, dedup_hits, zero_writes;
+	u64 discarded, freed, commits, collisions;
+
+	struct mutex commit_mutex;
+	int gc_err;					// result of the last gc commit
+	unsigned long *commit_dirty;
+	unsigned long last_commit;
+	struct workqueue_struct *wq;
+	struct work_struct worker;
+	struct delayed_work waker;
+	struct crypto_hash *tfm;	// used by the worker only
+	void *cmp_buf;				// stored block compared, used by the worker only
+	struct dm_io_client *io_client;
+};
+
+// Per bio data
+struct dedup_dm_bio {
+	struct dedup_dm *dd;
+	sector_t lbn;
+	u32 pbn;					// physical block read or written
+	int ref;					// the bio holds a reference of pbn
+	int err;
+	bio_end_io_t *bi_end_io;
+	void *bi_private;
+};
+
+static unsigned long *dedup_dm_bitmap_alloc(unsigned long nr)
+{
+	return vzalloc(BITS_TO_LONGS(nr) * sizeof(unsigned long));
+}
+
+/*
+ * Marks the metadata block holding p dirty.
+ * Must be called with dd->lock held.
+ */
+static void dedup_dm_dirty(struct dedup_dm *dd, void *p)
+{
+	__set_bit(((char *)p - (char *)dd->meta) >> DEDUP_DM_META_SHIFT, dd->dirty);
+}
+
+static u32 dedup_dm_get_map(struct dedup_dm *dd, sector_t lbn)
+{
+	u64 v = le64_to_cpu(dd->map[lbn]);
+
+	return (v) ? (u32)(v - 1) : DEDUP_DM_NO_BLOCK;
+}
+
+static u32 dedup_dm_fp_bucket(struct dedup_dm *dd, const u8 *hash)
+{
+	u32 v;
+
+	// sha256 bits are as good as any hash of them
+	memcpy(&v, hash, sizeof(v));
+	return v & dd->fp_mask;
+}
+
+/*
+ * Look for a stored block with the given fingerprint.
+ * Must be called with dd->lock held.
+ */
+static u32 dedup_dm_fp_lookup(struct dedup_dm *dd, const u8 *hash)
+{
+	u32 pbn;
+
+	for (pbn = dd->fp_heads[dedup_dm_fp_bucket(dd, hash)]; pbn != DEDUP_DM_NO_BLOCK;
+		 pbn = dd->fp_next[pbn]) {
+		if (memcmp(dd->hashes[pbn], hash, SHA256_DIGEST_SIZE) == 0)
+			return pbn;
+	}
+
+	return DEDUP_DM_NO_BLOCK;
+}
+
+/*
+ * Adds a stored block's fingerprint, unless another block already has it.
+ * Must be called with dd->lock held.
+ */
+static void dedup_dm_fp_insert(struct dedup_dm *dd, u32 pbn)
+{
+	u32 bucket;
+
+	if (test_bit(pbn, dd->indexed) || dedup_dm_fp_lookup(dd, dd->hashes[pbn]) != DEDUP_DM_NO_BLOCK)
+		return;
+
+	bucket = dedup_dm_fp_bucket(dd, dd->hashes[pbn]);
+	dd->fp_next[pbn] = dd->fp_heads[bucket];
+	dd->fp_heads[bucket] = pbn;
+	__set_bit(pbn, dd->indexed);
+}
+
+/*
+ * Must be called with dd->lock held
+ */
+static void dedup_dm_fp_remove(struct dedup_dm *dd, u32 pbn)
+{
+	u32 *p;
+
+	if (!test_bit(pbn, dd->indexed))
+		return;
+
+	p = &dd->fp_heads[dedup_dm_fp_bucket(dd, dd->hashes[pbn])];
+	while (*p != pbn)
+		p = &dd->fp_next[*p];
+	*p = dd->fp_next[pbn];
+	__clear_bit(pbn, dd->indexed);
+}
+
+/*
+ * Drops a reference of the physical block. An unreferenced block can't be
+ * deduplicated to anymore, and is reused after the next commit.
+ * Must be called with dd->lock held.
+ */
+static void dedup_dm_put(struct dedup_dm *dd, u32 pbn)
+{
+	if (--dd->refcount[pbn])
+		return;
+
+	dedup_dm_fp_remove(dd, pbn);
+	__set_bit(pbn, dd->pending);
+	--dd->used;
+	++dd->freed;
+}
+
+/*
+ * Takes a free physical block, with one reference.
+ * Must be called with dd->lock held.
+ */
+static u32 dedup_dm_alloc(struct dedup_dm *dd)
+{
+	u32 pbn = dd->alloc_cursor, i;
+
+	for (i = 0; i < dd->nr_physical; ++i, ++pbn) {
+		if (pbn >= dd->nr_physical)
+			pbn = 0;
+
+		if (!dd->refcount[pbn] && !test_bit(pbn, dd->pending) &&
+			!test_bit(pbn, dd->committing)) {
+			dd->refcount[pbn] = 1;
+			++dd->used;
+			dd->alloc_cursor = pbn + 1;
+			return pbn;
+		}
+	}
+
+	return DEDUP_DM_NO_BLOCK;
+}
+
+/*
+ * Points the logical block at pbn (or unmaps it), taking over a reference
+ * of pbn the caller holds.
+ * Must be called with dd->lock held.
+ */
+static void dedup_dm_set_map(struct dedup_dm *dd, sector_t lbn, u32 pbn)
+{
+	u32 old = dedup_dm_get_map(dd, lbn);
+
+	dd->map[lbn] = cpu_to_le64((pbn == DEDUP_DM_NO_BLOCK) ? 0 : (u64)pbn + 1);
+	dedup_dm_dirty(dd, &dd->map[lbn]);
+
+	if (old != DEDUP_DM_NO_BLOCK) {
+		dedup_dm_put(dd, old);
+		--dd->mapped;
+	}
+	if (pbn != DEDUP_DM_NO_BLOCK)
+		++dd->mapped;
+}
+
+/*
+ * Reads or writes nr metadata blocks from block, to/from the in-memory copy
+ */
+static int dedup_dm_meta_io(struct dedup_dm *dd, int rw, unsigned long block, unsigned long nr)
+{
+	struct dm_io_request io_req = {
+		.bi_rw = rw,
+		.mem.type = DM_IO_VMA,
+		.mem.ptr.vma = (char *)dd->meta + (block << DEDUP_DM_META_SHIFT),
+		.notify.fn = NULL,
+		.client = dd->io_client,
+	};
+	struct dm_io_region region = {
+		.bdev = dd->meta_dev->bdev,
+		.sector = (sector_t)block << (DEDUP_DM_META_SHIFT - 9),
+		.count = (sector_t)nr << (DEDUP_DM_META_SHIFT - 9),
+	};
+
+	return dm_io(&io_req, 1, &region, NULL);
+}
+
+/*
+ * Writes the dirty metadata blocks in [from, to), a run of blocks at a time
+ */
+static int dedup_dm_write_dirty(struct dedup_dm *dd, unsigned long from, unsigned long to)
+{
+	unsigned long block, end;
+	int r;
+
+	for (block = find_next_bit(dd->commit_dirty, to, from); block < to;
+		 block = find_next_bit(dd->commit_dirty, to, end)) {
+		end = find_next_zero_bit(dd->commit_dirty, to, block);
+		r = dedup_dm_meta_io(dd, WRITE, block, end - block);
+		if (r)
+			return r;
+	}
+
+	return 0;
+}
+
+static u32 dedup_dm_super_csum(struct dedup_dm_super *sb)
+{
+	return crc32_le(0, (u8 *)sb, offsetof(struct dedup_dm_super, csum));
+}
+
+/*
+ * Writes the dirty metadata back, and releases the blocks freed before it
+ * started. A failed commit is retried by the next one.
+ */
+static int dedup_dm_commit(struct dedup_dm *dd)
+{
+	unsigned long flags;
+	int r = 0, written = 0;
+
+	mutex_lock(&dd->commit_mutex);
+	spin_lock_irqsave(&dd->lock, flags);
+	bitmap_or(dd->commit_dirty, dd->commit_dirty, dd->dirty, dd->nr_meta_blocks);
+	bitmap_zero(dd->dirty, dd->nr_meta_blocks);
+	bitmap_or(dd->committing, dd->committing, dd->pending, dd->nr_physical);
+	bitmap_zero(dd->pending, dd->nr_physical);
+	spin_unlock_irqrestore(&dd->lock, flags);
+
+	if (bitmap_empty(dd->commit_dirty, dd->nr_meta_blocks))
+		goto done;
+
+	// Written data must be stable before the map points at it, and hashes
+	// before the map, so a mapped block never has a stale hash
+	r = blkdev_issue_flush(dd->data_dev->bdev, GFP_NOIO, NULL);
+	if (!r)
+		r = dedup_dm_write_dirty(dd, dd->hash_block, dd->nr_meta_blocks);
+	if (!r)
+		r = blkdev_issue_flush(dd->meta_dev->bdev, GFP_NOIO, NULL);
+	if (!r)
+		r = dedup_dm_write_dirty(dd, dd->map_block, dd->hash_block);
+	if (!r) {
+		dd->sb->generation = cpu_to_le64(le64_to_cpu(dd->sb->generation) + 1);
+		dd->sb->csum = cpu_to_le32(dedup_dm_super_csum(dd->sb));
+		r = dedup_dm_meta_io(dd, WRITE_FLUSH_FUA, 0, 1);
+	}
+	if (r) {
+		DMERR("metadata commit failed: %d", r);
+		goto out;
+	}
+
+	bitmap_zero(dd->commit_dirty, dd->nr_meta_blocks);
+	written = 1;
+done:
+	spin_lock_irqsave(&dd->lock, flags);
+	bitmap_zero(dd->committing, dd->nr_physical);
+	dd->commits += written;
+	spin_unlock_irqrestore(&dd->lock, flags);
+	dd->last_commit = jiffies;
+out:
+	mutex_unlock(&dd->commit_mutex);
+	return r;
+}
+
+/*
+ * return 1 if the bio's data is all zeros
+ */
+static int dedup_dm_bio_zero(struct bio *bio)
+{
+	struct bio_vec *bvec;
+	unsigned long word;
+	char *addr;
+	int i, zero = 1;
+
+	bio_for_each_segment(bvec, bio, i) {
+		addr = kmap_atomic(bvec->bv_page);
+		zero = (dedup_data_pattern(addr + bvec->bv_offset, bvec->bv_len, &word) && !word);
+		kunmap_atomic(addr);
+		if (!zero)
+			break;
+	}
+
+	return zero;
+}
+
+/*
+ * Fingerprints the bio's data straight from its pages
+ */
+static void dedup_dm_hash_bio(struct dedup_dm *dd, struct bio *bio, u8 *hash)
+{
+	struct hash_desc desc;
+	struct scatterlist sg;
+	struct bio_vec *bvec;
+	int i;
+
+	desc.tfm = dd->tfm;
+	desc.flags = 0;
+	crypto_hash_init(&desc);
+	bio_for_each_segment(bvec, bio, i) {
+		sg_init_table(&sg, 1);
+		sg_set_page(&sg, bvec->bv_page, bvec->bv_len, bvec->bv_offset);
+		crypto_hash_update(&desc, &sg, bvec->bv_len);
+	}
+	crypto_hash_final(&desc, hash);
+}
+
+/*
+ * Reads the stored block and compares it with the bio's data
+ * return 1 if they're equal
+ */
+static int dedup_dm_same_data(struct dedup_dm *dd, struct bio *bio, u32 pbn)
+{
+	struct dm_io_request io_req = {
+		.bi_rw = READ,
+		.mem.type = DM_IO_VMA,
+		.mem.ptr.vma = dd->cmp_buf,
+		.notify.fn = NULL,
+		.client = dd->io_client,
+	};
+	struct dm_io_region region = {
+		.bdev = dd->data_dev->bdev,
+		.sector = (sector_t)pbn << dd->block_shift,
+		.count = dd->block_sectors,
+	};
+	struct bio_vec *bvec;
+	char *addr, *data = dd->cmp_buf;
+	int i, same = 1;
+
+	if (dm_io(&io_req, 1, &region, NULL))
+		return 0;
+
+	bio_for_each_segment(bvec, bio, i) {
+		addr = kmap_atomic(bvec->bv_page);
+		same = !memcmp(addr + bvec->bv_offset, data, bvec->bv_len);
+		kunmap_atomic(addr);
+		if (!same)
+			break;
+		data += bvec->bv_len;
+	}
+
+	return same;
+}
+
+/*
+ * Takes a free physical block for the content
+ */
+static u32 dedup_dm_alloc_hash(struct dedup_dm *dd, const u8 *hash)
+{
+	unsigned long flags;
+	u32 pbn;
+
+	spin_lock_irqsave(&dd->lock, flags);
+	pbn = dedup_dm_alloc(dd);
+	if (pbn != DEDUP_DM_NO_BLOCK) {
+		memcpy(dd->hashes[pbn], hash, SHA256_DIGEST_SIZE);
+		dedup_dm_dirty(dd, dd->hashes[pbn]);
+	}
+	spin_unlock_irqrestore(&dd->lock, flags);
+
+	return pbn;
+}
+
+/*
+ * Completion of a write to the data device, may be called in interrupt context
+ */
+static void dedup_dm_write_end_io(struct bio *bio, int err)
+{
+	struct dedup_dm_bio *db = bio->bi_private;
+	struct dedup_dm *dd = db->dd;
+	unsigned long flags;
+
+	if (!err && !test_bit(BIO_UPTODATE, &bio->bi_flags))
+		err = -EIO;
+	db->err = err;
+
+	spin_lock_irqsave(&dd->lock, flags);
+	bio_list_add(&dd->completed, bio);
+	spin_unlock_irqrestore(&dd->lock, flags);
+
+	queue_work(dd->wq, &dd->worker);
+}
+
+/*
+ * Ends the write, or queues it to end after the next commit if it's FUA
+ */
+static void dedup_dm_end_write(struct bio *bio, int err, struct bio_list *commit_bios)
+{
+	if (!err && (bio->bi_rw & REQ_FUA))
+		bio_list_add(commit_bios, bio);
+	else
+		bio_endio(bio, err);
+}
+
+/*
+ * Maps a write to a stored block with its content, or sends it to a free one
+ */
+static void dedup_dm_write(struct dedup_dm *dd, struct bio *bio, struct bio_list *commit_bios)
+{
+	struct dedup_dm_bio *db = dm_per_bio_data(bio, sizeof(struct dedup_dm_bio));
+	u8 hash[SHA256_DIGEST_SIZE];
+	unsigned long flags;
+	u32 pbn = DEDUP_DM_NO_BLOCK;
+	int zero;
+
+	zero = dedup_dm_bio_zero(bio);
+	if (!zero)
+		dedup_dm_hash_bio(dd, bio, hash);
+
+	spin_lock_irqsave(&dd->lock, flags);
+	++dd->writes;
+	if (zero) {
+		dedup_dm_set_map(dd, db->lbn, DEDUP_DM_NO_BLOCK);
+		++dd->zero_writes;
+		spin_unlock_irqrestore(&dd->lock, flags);
+		dedup_dm_end_write(bio, 0, commit_bios);
+		return;
+	}
+
+	pbn = dedup_dm_fp_lookup(dd, hash);
+	if (pbn != DEDUP_DM_NO_BLOCK) {
+		// The reference keeps the block from being reused while it's compared
+		++dd->refcount[pbn];
+		spin_unlock_irqrestore(&dd->lock, flags);
+
+		if (dedup_dm_same_data(dd, bio, pbn)) {
+			spin_lock_irqsave(&dd->lock, flags);
+			dedup_dm_set_map(dd, db->lbn, pbn);
+			++dd->dedup_hits;
+			spin_unlock_irqrestore(&dd->lock, flags);
+			dedup_dm_end_write(bio, 0, commit_bios);
+			return;
+		}
+
+		spin_lock_irqsave(&dd->lock, flags);
+		dedup_dm_put(dd, pbn);
+		++dd->collisions;
+	}
+	spin_unlock_irqrestore(&dd->lock, flags);
+
+	// Blocks freed since the last commit are free once it's done
+	pbn = dedup_dm_alloc_hash(dd, hash);
+	if (pbn == DEDUP_DM_NO_BLOCK && !dedup_dm_commit(dd))
+		pbn = dedup_dm_alloc_hash(dd, hash);
+	if (pbn == DEDUP_DM_NO_BLOCK) {
+		DMERR_LIMIT("no free blocks on the data device");
+		bio_endio(bio, -ENOSPC);
+		return;
+	}
+
+	// Mapped and fingerprinted when the data is on the device
+	db->pbn = pbn;
+	db->bi_end_io = bio->bi_end_io;
+	db->bi_private = bio->bi_private;
+	bio->bi_end_io = dedup_dm_write_end_io;
+	bio->bi_private = db;
+	bio->bi_bdev = dd->data_dev->bdev;
+	bio->bi_sector = (sector_t)pbn << dd->block_shift;
+	generic_make_request(bio);
+}
+
+/*
+ * A write of new content completed
+ */
+static void dedup_dm_write_done(struct dedup_dm *dd, struct bio *bio, struct bio_list *commit_bios)
+{
+	struct dedup_dm_bio *db = bio->bi_private;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dd->lock, flags);
+	if (!db->err) {
+		dedup_dm_fp_insert(dd, db->pbn);
+		dedup_dm_set_map(dd, db->lbn, db->pbn);
+	}
+	else
+		dedup_dm_put(dd, db->pbn);
+	spin_unlock_irqrestore(&dd->lock, flags);
+
+	bio->bi_end_io = db->bi_end_io;
+	bio->bi_private = db->bi_private;
+	dedup_dm_end_write(bio, db->err, commit_bios);
+}
+
+static void dedup_dm_worker(struct work_struct *work)
+{
+	struct dedup_dm *dd = container_of(work, struct dedup_dm, worker);
+	struct bio_list deferred, completed, commit_bios;
+	unsigned long flags;
+	struct bio *bio;
+	int r = 0, gc;
+
+	bio_list_init(&deferred);
+	bio_list_init(&completed);
+	bio_list_init(&commit_bios);
+
+	spin_lock_irqsave(&dd->lock, flags);
+	bio_list_merge(&completed, &dd->completed);
+	bio_list_init(&dd->completed);
+	bio_list_merge(&deferred, &dd->deferred);
+	bio_list_init(&dd->deferred);
+	bio_list_merge(&commit_bios, &dd->flushes);
+	bio_list_init(&dd->flushes);
+	gc = dd->gc;
+	dd->gc = 0;
+	spin_unlock_irqrestore(&dd->lock, flags);
+
+	while ((bio = bio_list_pop(&completed)))
+		dedup_dm_write_done(dd, bio, &commit_bios);
+
+	while ((bio = bio_list_pop(&deferred)))
+		dedup_dm_write(dd, bio, &commit_bios);
+
+	// Flushes and FUA writes end once the metadata is stable
+	if (gc || !bio_list_empty(&commit_bios) ||
+		time_after_eq(jiffies, dd->last_commit + DEDUP_DM_COMMIT_PERIOD))
+		r = dedup_dm_commit(dd);
+	if (gc)
+		dd->gc_err = r;
+
+	while ((bio = bio_list_pop(&commit_bios)))
+		bio_endio(bio, r);
+}
+
+static void dedup_dm_wake(struct work_struct *work)
+{
+	struct dedup_dm *dd = container_of(to_delayed_work(work), struct dedup_dm, waker);
+
+	queue_work(dd->wq, &dd->worker);
+	queue_delayed_work(dd->wq, &dd->waker, DEDUP_DM_COMMIT_PERIOD);
+}
+
+/*
+ * Unmaps the whole blocks of a discarded range
+ */
+static void dedup_dm_discard(struct dedup_dm *dd, sector_t offset, sector_t sectors)
+{
+	sector_t lbn = (offset + dd->block_sectors - 1) >> dd->block_shift;
+	sector_t end = (offset + sectors) >> dd->block_shift;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dd->lock, flags);
+	for (; lbn < end; ++lbn) {
+		if (dedup_dm_get_map(dd, lbn) != DEDUP_DM_NO_BLOCK) {
+			dedup_dm_set_map(dd, lbn, DEDUP_DM_NO_BLOCK);
+			++dd->discarded;
+		}
+	}
+	spin_unlock_irqrestore(&dd->lock, flags);
+}
+
+static int dedup_dm_map(struct dm_target *ti, struct bio *bio)
+{
+	struct dedup_dm *dd = ti->private;
+	struct dedup_dm_bio *db = dm_per_bio_data(bio, sizeof(struct dedup_dm_bio));
+	sector_t offset = dm_target_offset(ti, bio->bi_sector);
+	unsigned long flags;
+	u32 pbn;
+
+	db->dd = dd;
+	db->lbn = offset >> dd->block_shift;
+	db->ref = 0;
+
+	if (bio->bi_rw & REQ_FLUSH) {
+		spin_lock_irqsave(&dd->lock, flags);
+		bio_list_add(&dd->flushes, bio);
+		spin_unlock_irqrestore(&dd->lock, flags);
+		queue_work(dd->wq, &dd->worker);
+		return DM_MAPIO_SUBMITTED;
+	}
+
+	if (bio->bi_rw & REQ_DISCARD) {
+		dedup_dm_discard(dd, offset, bio_sectors(bio));
+		bio_endio(bio, 0);
+		return DM_MAPIO_SUBMITTED;
+	}
+
+	// Bios are split at block boundaries, and the block is the logical
+	// block size
+	if ((offset & (dd->block_sectors - 1)) || bio_sectors(bio) != dd->block_sectors) {
+		DMERR_LIMIT("bio of %u sectors at %llu is not one block", bio_sectors(bio),
+					(unsigned long long)offset);
+		return -EIO;
+	}
+
+	if (bio_data_dir(bio) == WRITE) {
+		spin_lock_irqsave(&dd->lock, flags);
+		bio_list_add(&dd->deferred, bio);
+		spin_unlock_irqrestore(&dd->lock, flags);
+		queue_work(dd->wq, &dd->worker);
+		return DM_MAPIO_SUBMITTED;
+	}
+
+	// The read holds a reference, so the block isn't reused under it
+	spin_lock_irqsave(&dd->lock, flags);
+	++dd->reads;
+	pbn = dedup_dm_get_map(dd, db->lbn);
+	if (pbn != DEDUP_DM_NO_BLOCK) {
+		++dd->refcount[pbn];
+		db->pbn = pbn;
+		db->ref = 1;
+	}
+	else
+		++dd->zero_reads;
+	spin_unlock_irqrestore(&dd->lock, flags);
+
+	if (pbn == DEDUP_DM_NO_BLOCK) {
+		zero_fill_bio(bio);
+		bio_endio(bio, 0);
+		return DM_MAPIO_SUBMITTED;
+	}
+
+	bio->bi_bdev = dd->data_dev->bdev;
+	bio->bi_sector = (sector_t)pbn << dd->block_shift;
+	return DM_MAPIO_REMAPPED;
+}
+
+static int dedup_dm_end_io(struct dm_target *ti, struct bio *bio, int error)
+{
+	struct dedup_dm *dd = ti->private;
+	struct dedup_dm_bio *db = dm_per_bio_data(bio, sizeof(struct dedup_dm_bio));
+	unsigned long flags;
+
+	if (db->ref) {
+		spin_lock_irqsave(&dd->lock, flags);
+		dedup_dm_put(dd, db->pbn);
+		spin_unlock_irqrestore(&dd->lock, flags);
+		db->ref = 0;
+	}
+
+	return error;
+}
+
+/*
+ * Reads the metadata, or formats it if the metadata device is zeroed, and
+ * counts the references of the physical blocks
+ */
+static int dedup_dm_load(struct dedup_dm *dd)
+{
+	struct dedup_dm_super *sb = dd->sb;
+	unsigned long block;
+	sector_t lbn;
+	u32 pbn;
+	int r;
+
+	for (block = 0; block < dd->nr_meta_blocks; block += DEDUP_DM_LOAD_BLOCKS) {
+		r = dedup_dm_meta_io(dd, READ, block,
+							 min_t(unsigned long, DEDUP_DM_LOAD_BLOCKS, dd->nr_meta_blocks - block));
+		if (r) {
+			dd->ti->error = "Error reading metadata";
+			return r;
+		}
+	}
+
+	if (!memchr_inv(sb, 0, DEDUP_DM_META_SIZE)) {
+		sb->magic = cpu_to_le32(DEDUP_DM_MAGIC);
+		sb->version = cpu_to_le32(DEDUP_DM_VERSION);
+		sb->block_size = cpu_to_le32(dd->block_sectors << 9);
+		sb->nr_logical = cpu_to_le64(dd->nr_logical);
+		sb->nr_physical = cpu_to_le64(dd->nr_physical);
+		sb->generation = 0;
+		// The whole map and hashes are written by the first commit
+		bitmap_fill(dd->dirty, dd->nr_meta_blocks);
+		return 0;
+	}
+
+	if (le32_to_cpu(sb->magic) != DEDUP_DM_MAGIC ||
+		le32_to_cpu(sb->csum) != dedup_dm_super_csum(sb)) {
+		dd->ti->error = "Not a dedup metadata device";
+		return -EINVAL;
+	}
+
+	if (le32_to_cpu(sb->version) != DEDUP_DM_VERSION ||
+		le32_to_cpu(sb->block_size) != dd->block_sectors << 9 ||
+		le64_to_cpu(sb->nr_logical) != dd->nr_logical ||
+		le64_to_cpu(sb->nr_physical) != dd->nr_physical) {
+		dd->ti->error = "Metadata is of another version, block size or device size";
+		return -EINVAL;
+	}
+
+	for (lbn = 0; lbn < dd->nr_logical; ++lbn) {
+		pbn = dedup_dm_get_map(dd, lbn);
+		if (pbn == DEDUP_DM_NO_BLOCK)
+			continue;
+
+		if (pbn >= dd->nr_physical) {
+			dd->ti->error = "Metadata maps a block outside the data device";
+			return -EINVAL;
+		}
+
+		if (!dd->refcount[pbn]++)
+			++dd->used;
+		++dd->mapped;
+	}
+
+	for (pbn = 0; pbn < dd->nr_physical; ++pbn) {
+		if (dd->refcount[pbn])
+			dedup_dm_fp_insert(dd, pbn);
+	}
+
+	return 0;
+}
+
+static void dedup_dm_free(struct dedup_dm *dd)
+{
+	if (dd->wq)
+		destroy_workqueue(dd->wq);
+	if (dd->tfm)
+		crypto_free_hash(dd->tfm);
+	if (dd->io_client)
+		dm_io_client_destroy(dd->io_client);
+	vfree(dd->meta);
+	vfree(dd->dirty);
+	vfree(dd->commit_dirty);
+	vfree(dd->refcount);
+	vfree(dd->pending);
+	vfree(dd->committing);
+	vfree(dd->indexed);
+	vfree(dd->fp_heads);
+	vfree(dd->fp_next);
+	vfree(dd->cmp_buf);
+	if (dd->meta_dev)
+		dm_put_device(dd->ti, dd->meta_dev);
+	if (dd->data_dev)
+		dm_put_device(dd->ti, dd->data_dev);
+	kfree(dd);
+}
+
+/*
+ * Construct a dedup mapping:
+ * <metadata dev> <data dev> <block size in sectors>
+ */
+static int dedup_dm_ctr(struct dm_target *ti, unsigned int argc, char **argv)
+{
+	struct dedup_dm *dd;
+	unsigned int block_sectors;
+	sector_t data_sectors, meta_sectors;
+	unsigned long nr_buckets;
+	int r = -EINVAL;
+
+	if (argc != 3) {
+		ti->error = "Invalid argument count";
+		return -EINVAL;
+	}
+
+	if (kstrtouint(argv[2], 10, &block_sectors) || !is_power_of_2(block_sectors) ||
+		block_sectors > (PAGE_SIZE >> 9) || (ti->len & (block_sectors - 1))) {
+		ti->error = "Invalid block size";
+		return -EINVAL;
+	}
+
+	dd = kzalloc(sizeof(*dd), GFP_KERNEL);
+	if (!dd) {
+		ti->error = "Cannot allocate context";
+		return -ENOMEM;
+	}
+
+	dd->ti = ti;
+	dd->block_sectors = block_sectors;
+	dd->block_shift = ilog2(block_sectors);
+	spin_lock_init(&dd->lock);
+	mutex_init(&dd->commit_mutex);
+	bio_list_init(&dd->deferred);
+	bio_list_init(&dd->completed);
+	bio_list_init(&dd->flushes);
+	INIT_WORK(&dd->worker, dedup_dm_worker);
+	INIT_DELAYED_WORK(&dd->waker, dedup_dm_wake);
+
+	if (dm_get_device(ti, argv[0], dm_table_get_mode(ti->table), &dd->meta_dev)) {
+		ti->error = "Error opening metadata device";
+		goto bad;
+	}
+
+	if (dm_get_device(ti, argv[1], dm_table_get_mode(ti->table), &dd->data_dev)) {
+		ti->error = "Error opening data device";
+		goto bad;
+	}
+
+	if (bdev_logical_block_size(dd->data_dev->bdev) > block_sectors << 9) {
+		ti->error = "Block size is smaller than the data device's logical block size";
+		goto bad;
+	}
+
+	data_sectors = i_size_read(dd->data_dev->bdev->bd_inode) >> 9;
+	if ((data_sectors >> dd->block_shift) >= DEDUP_DM_NO_BLOCK) {
+		ti->error = "Data device is too big";
+		goto bad;
+	}
+	dd->nr_logical = ti->len >> dd->block_shift;
+	dd->nr_physical = data_sectors >> dd->block_shift;
+
+	dd->map_block = 1;
+	dd->hash_block = dd->map_block +
+		DIV_ROUND_UP(dd->nr_logical * sizeof(__le64), DEDUP_DM_META_SIZE);
+	dd->nr_meta_blocks = dd->hash_block +
+		DIV_ROUND_UP((u64)dd->nr_physical * SHA256_DIGEST_SIZE, DEDUP_DM_META_SIZE);
+	meta_sectors = i_size_read(dd->meta_dev->bdev->bd_inode) >> 9;
+	if (meta_sectors < (sector_t)dd->nr_meta_blocks << (DEDUP_DM_META_SHIFT - 9)) {
+		ti->error = "Metadata device is too small";
+		goto bad;
+	}
+
+	// All of it is kept in memory
+	if ((u64)dd->nr_meta_blocks * DEDUP_DM_META_SIZE + (u64)dd->nr_physical * 3 * sizeof(u32) >
+		((u64)totalram_pages << PAGE_SHIFT) / DEDUP_DM_MAX_META_RAM) {
+		ti->error = "Metadata is too big to keep in memory";
+		goto bad;
+	}
+
+	r = -ENOMEM;
+	nr_buckets = roundup_pow_of_two(max_t(u32, dd->nr_physical / 2, 1));
+	dd->fp_mask = nr_buckets - 1;
+	dd->meta = vzalloc(dd->nr_meta_blocks << DEDUP_DM_META_SHIFT);
+	dd->dirty = dedup_dm_bitmap_alloc(dd->nr_meta_blocks);
+	dd->commit_dirty = dedup_dm_bitmap_alloc(dd->nr_meta_blocks);
+	dd->refcount = vzalloc(dd->nr_physical * sizeof(u32));
+	dd->pending = dedup_dm_bitmap_alloc(dd->nr_physical);
+	dd->committing = dedup_dm_bitmap_alloc(dd->nr_physical);
+	dd->indexed = dedup_dm_bitmap_alloc(dd->nr_physical);
+	dd->fp_heads = vmalloc(nr_buckets * sizeof(u32));
+	dd->fp_next = vmalloc(dd->nr_physical * sizeof(u32));
+	dd->cmp_buf = vmalloc(block_sectors << 9);
+	if (!dd->meta || !dd->dirty || !dd->commit_dirty || !dd->refcount || !dd->pending ||
+		!dd->committing || !dd->indexed || !dd->fp_heads || !dd->fp_next || !dd->cmp_buf) {
+		ti->error = "Cannot allocate metadata";
+		goto bad;
+	}
+	memset(dd->fp_heads, 0xff, nr_buckets * sizeof(u32));
+	dd->sb = dd->meta;
+	dd->map = (__le64 *)((char *)dd->meta + (dd->map_block << DEDUP_DM_META_SHIFT));
+	dd->hashes = (void *)((char *)dd->meta + (dd->hash_block << DEDUP_DM_META_SHIFT));
+
+	dd->io_client = dm_io_client_create();
+	if (IS_ERR(dd->io_client)) {
+		r = PTR_ERR(dd->io_client);
+		dd->io_client = NULL;
+		ti->error = "Cannot create io client";
+		goto bad;
+	}
+
+	dd->tfm = crypto_alloc_hash("sha256", 0, CRYPTO_ALG_ASYNC);
+	if (IS_ERR(dd->tfm)) {
+		r = PTR_ERR(dd->tfm);
+		dd->tfm = NULL;
+		ti->error = "Cannot allocate sha256";
+		goto bad;
+	}
+
+	// Writes go through it, it must make progress under memory pressure
+	dd->wq = alloc_workqueue("dedup_dm", WQ_MEM_RECLAIM, 1);
+	if (!dd->wq) {
+		ti->error = "Cannot create workqueue";
+		goto bad;
+	}
+
+	r = dedup_dm_load(dd);
+	if (r)
+		goto bad;
+
+	r = dedup_dm_commit(dd);
+	if (r) {
+		ti->error = "Error writing metadata";
+		goto bad;
+	}
+
+	ti->private = dd;
+	ti->num_flush_bios = 1;
+	ti->num_discard_bios = 1;
+	ti->discards_supported = true;
+	ti->per_bio_data_size = sizeof(struct dedup_dm_bio);
+	r = dm_set_target_max_io_len(ti, block_sectors);
+	if (r)
+		goto bad;
+
+	DMINFO("%llu logical blocks, %u physical blocks, %llu mapped, %llu stored",
+		   (unsigned long long)dd->nr_logical, dd->nr_physical, dd->mapped, dd->used);
+	return 0;
+
+bad:
+	dedup_dm_free(dd);
+	return r;
+}
+
+static void dedup_dm_dtr(struct dm_target *ti)
+{
+	struct dedup_dm *dd = ti->private;
+
+	cancel_delayed_work_sync(&dd->waker);
+	flush_workqueue(dd->wq);
+	dedup_dm_commit(dd);
+	dedup_dm_free(dd);
+}
+
+static void dedup_dm_postsuspend(struct dm_target *ti)
+{
+	struct dedup_dm *dd = ti->private;
+
+	cancel_delayed_work_sync(&dd->waker);
+	flush_workqueue(dd->wq);
+	dedup_dm_commit(dd);
+}
+
+static void dedup_dm_resume(struct dm_target *ti)
+{
+	struct dedup_dm *dd = ti->private;
+
+	queue_delayed_work(dd->wq, &dd->waker, DEDUP_DM_COMMIT_PERIOD);
+}
+
+/*
+ * Status: <mapped logical blocks> <stored blocks>/<physical blocks> <reads>
+ * <zero reads> <writes> <deduplicated writes> <zero writes> <discarded blocks>
+ * <freed blocks> <commits> <fingerprint collisions>
+ */
+static void dedup_dm_status(struct dm_target *ti, status_type_t type,
+							unsigned status_flags, char *result, unsigned maxlen)
+{
+	struct dedup_dm *dd = ti->private;
+	unsigned long flags;
+	unsigned sz = 0;
+
+	switch (type) {
+	case STATUSTYPE_INFO:
+		spin_lock_irqsave(&dd->lock, flags);
+		DMEMIT("%llu %llu/%u %llu %llu %llu %llu %llu %llu %llu %llu %llu",
+			   dd->mapped, dd->used, dd->nr_physical, dd->reads, dd->zero_reads,
+			   dd->writes, dd->dedup_hits, dd->zero_writes, dd->discarded,
+			   dd->freed, dd->commits, dd->collisions);
+		spin_unlock_irqrestore(&dd->lock, flags);
+		break;
+
+	case STATUSTYPE_TABLE:
+		DMEMIT("%s %s %llu", dd->meta_dev->name, dd->data_dev->name,
+			   (unsigned long long)dd->block_sectors);
+		break;
+	}
+}
+
+/*
+ * Messages:
+ * 	gc - commits now, so unreferenced blocks can be reused. The commit is
+ * 	     done by the worker, the only one mapping blocks to data meanwhile, so the
+ * 	     map it writes never points at data that wasn't flushed.
+ */
+static int dedup_dm_message(struct dm_target *ti, unsigned argc, char **argv)
+{
+	struct dedup_dm *dd = ti->private;
+	unsigned long flags;
+
+	if (argc == 1 && !strcasecmp(argv[0], "gc")) {
+		spin_lock_irqsave(&dd->lock, flags);
+		dd->gc = 1;
+		spin_unlock_irqrestore(&dd->lock, flags);
+		queue_work(dd->wq, &dd->worker);
+		flush_work(&dd->worker);
+		return dd->gc_err;
+	}
+
+	DMWARN("unrecognised message received.");
+	return -EINVAL;
+}
+
+static int dedup_dm_iterate_devices(struct dm_target *ti, iterate_devices_callout_fn fn,
+									void *data)
+{
+	struct dedup_dm *dd = ti->private;
+
+	return fn(ti, dd->data_dev, 0, (sector_t)dd->nr_physical << dd->block_shift, data);
+}
+
+static void dedup_dm_io_hints(struct dm_target *ti, struct queue_limits *limits)
+{
+	struct dedup_dm *dd = ti->private;
+	unsigned int block_size = dd->block_sectors << 9;
+
+	limits->logical_block_size = block_size;
+	limits->physical_block_size = block_size;
+	blk_limits_io_min(limits, block_size);
+	blk_limits_io_opt(limits, block_size);
+	limits->max_discard_sectors = dd->block_sectors * DEDUP_DM_DISCARD_BLOCKS;
+	limits->discard_granularity = block_size;
+}
+
+static struct target_type dedup_dm_target = {
+	.name = "dedup",
+	.version = {1, 1, 0},
+	.module = THIS_MODULE,
+	.ctr = dedup_dm_ctr,
+	.dtr = dedup_dm_dtr,
+	.map = dedup_dm_map,
+	.end_io = dedup_dm_end_io,
+	.postsuspend = dedup_dm_postsuspend,
+	.resume = dedup_dm_resume,
+	.status = dedup_dm_status,
+	.message = dedup_dm_message,
+	.iterate_devices = dedup_dm_iterate_devices,
+	.io_hints = dedup_dm_io_hints,
+};
+
+static int __init dedup_dm_init(void)
+{
+	int r = dm_register_target(&dedup_dm_target);
+
+	if (r < 0)
+		DMERR("register failed %d", r);
+
+	return r;
+}
+
+static void __exit dedup_dm_exit(void)
+{
+	dm_unregister_target(&dedup_dm_target);
+}
+
+module_init(dedup_dm_init);
+module_exit(dedup_dm_exit);
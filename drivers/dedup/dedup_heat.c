@@ -0,0 +1,295 @@
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/hashtable.h>
+#include <linux/workqueue.h>
+#include <linux/sort.h>
+#include <linux/jiffies.h>
+#include <linux/dedup.h>
+
+/*
+ * Read heat of duplicated content and boot prewarm.
+ *
+ * Reads of blocks that have equal blocks are counted by content, with the
+ * Space-Saving algorithm: a fixed table of counters, and content that is not
+ * in a full table takes over the coldest counter. Reads are counted from bio
+ * completion, so the coldest counter is looked for among DEDUP_HEAT_SAMPLES
+ * counters after a rotating hand, not the whole table.
+ * The hottest content is shown in /sys/kernel/dedup/hot as one block per line,
+ * to be saved before shutdown. Writing the saved list back after the dedup
+ * structure is ready prefetches the blocks into the content cache in the
+ * background, within the budget set by 'warm <KB> [pin]'.
+ */
+
+#define DEDUP_HEAT_HASH_BITS 8
+// Number of counters, more than we show to keep the top accurate
+#define DEDUP_HEAT_SLOTS 1024
+// Number of hottest blocks shown in the hot file
+#define DEDUP_HOT_MAX 200
+// Counters sampled for the coldest one when the table is full
+#define DEDUP_HEAT_SAMPLES 8
+
+struct dedup_heat_slot {
+	struct hlist_node node;		// hashed by content crc
+	u32 crc;
+	u8 hash[SHA256_DIGEST_SIZE];
+	sector_t block;				// last block read with this content
+	u32 heat;
+};
+
+static struct dedup_heat_slot heat_slots[DEDUP_HEAT_SLOTS];
+static int nr_heat_slots = 0;
+static int heat_hand = 0;		// first counter sampled on the next takeover
+static DEFINE_HASHTABLE(heat_table, DEDUP_HEAT_HASH_BITS);
+static DEFINE_SPINLOCK(heat_lock);
+
+// Prewarm settings and job
+static long warm_budget_kb = 0;
+static int warm_pin = 0;
+static sector_t *warm_blocks = NULL;
+static int nr_warm_blocks = 0;
+static void dedup_prewarm(struct work_struct *work);
+static DECLARE_WORK(warm_work, dedup_prewarm);
+
+// Prewarm statistics
+static long warm_read_blocks = 0, warm_cached_blocks = 0;
+static unsigned long warm_start = 0, warm_msecs = 0;
+
+/*
+ * Look for the content's counter.
+ * Must be called with heat_lock held.
+ */
+static struct dedup_heat_slot *dedup_heat_find(u32 crc, const u8 *hash)
+{
+	struct dedup_heat_slot *slot;
+
+	hash_for_each_possible(heat_table, slot, node, crc) {
+		if (slot->crc == crc && memcmp(slot->hash, hash, SHA256_DIGEST_SIZE) == 0)
+			return slot;
+	}
+
+	return NULL;
+}
+
+/*
+ * Counts a read of a block with equal blocks
+ */
+void dedup_heat_add_read(sector_t block)
+{
+	struct dedup_heat_slot *slot;
+	u8 hash[SHA256_DIGEST_SIZE];
+	unsigned long flags;
+	u32 crc;
+	int i, idx;
+
+	if (!dedup_get_block_hash(block, hash, &crc))
+		return;
+
+	spin_lock_irqsave(&heat_lock, flags);
+	slot = dedup_heat_find(crc, hash);
+	if (!slot) {
+		if (nr_heat_slots < DEDUP_HEAT_SLOTS) {
+			slot = &heat_slots[nr_heat_slots++];
+			slot->heat = 0;
+		}
+		else {
+			// Take over the coldest sampled counter, keeping its count
+			slot = &heat_slots[heat_hand];
+			for (i = 1; i < DEDUP_HEAT_SAMPLES; ++i) {
+				idx = (heat_hand + i) % DEDUP_HEAT_SLOTS;
+				if (heat_slots[idx].heat < slot->heat)
+					slot = &heat_slots[idx];
+			}
+			heat_hand = (heat_hand + DEDUP_HEAT_SAMPLES) % DEDUP_HEAT_SLOTS;
+			hash_del(&slot->node);
+		}
+
+		slot->crc = crc;
+		memcpy(slot->hash, hash, SHA256_DIGEST_SIZE);
+		hash_add(heat_table, &slot->node, crc);
+	}
+
+	slot->block = block;
+	++slot->heat;
+	spin_unlock_irqrestore(&heat_lock, flags);
+}
+
+struct dedup_hot_block {
+	sector_t block;
+	u32 heat;
+};
+
+static int dedup_hot_cmp(const void *a, const void *b)
+{
+	const struct dedup_hot_block *hot_a = a, *hot_b = b;
+
+	if (hot_a->heat == hot_b->heat)
+		return 0;
+
+	return (hot_a->heat > hot_b->heat) ? -1 : 1;
+}
+
+/*
+ * Fills buf with the hottest blocks, one "block heat" per line
+ */
+ssize_t dedup_heat_show(char *buf)
+{
+	struct dedup_hot_block *hot;
+	unsigned long flags;
+	ssize_t len = 0;
+	int i, nr;
+
+	hot = kmalloc(DEDUP_HEAT_SLOTS * sizeof(*hot), GFP_KERNEL);
+	if (!hot)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&heat_lock, flags);
+	nr = nr_heat_slots;
+	for (i = 0; i < nr; ++i) {
+		hot[i].block = heat_slots[i].block;
+		hot[i].heat = heat_slots[i].heat;
+	}
+	spin_unlock_irqrestore(&heat_lock, flags);
+
+	sort(hot, nr, sizeof(*hot), dedup_hot_cmp, NULL);
+
+	for (i = 0; i < nr && i < DEDUP_HOT_MAX; ++i) {
+		// Content may have no equal blocks anymore
+		if (!dedup_block_has_duplicates(hot[i].block))
+			continue;
+
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%llu %u\n",
+						 (unsigned long long)hot[i].block, hot[i].heat);
+	}
+
+	kfree(hot);
+	return len;
+}
+
+/*
+ * Reads a saved list of hot blocks and starts prefetching them
+ */
+ssize_t dedup_heat_store(const char *buf, size_t count)
+{
+	const char *p = buf, *end = buf + count;
+	unsigned long long block;
+	sector_t *blocks;
+	int nr = 0;
+
+	if (dedup_wait_for_init()) {
+		printk(KERN_ERR "dedup is not ready, can't prewarm.\n");
+		return -EBUSY;
+	}
+
+	if (!warm_budget_kb) {
+		printk(KERN_ERR "no prewarm budget, use 'warm <KB>'.\n");
+		return -EINVAL;
+	}
+
+	if (work_pending(&warm_work) || warm_blocks)
+		return -EBUSY;
+
+	blocks = kmalloc(DEDUP_HOT_MAX * sizeof(sector_t), GFP_KERNEL);
+	if (!blocks)
+		return -ENOMEM;
+
+	// One block per line, the heat after it is ignored
+	while (p < end && nr < DEDUP_HOT_MAX) {
+		if (sscanf(p, "%llu", &block) == 1)
+			blocks[nr++] = block;
+
+		p = memchr(p, '\n', end - p);
+		if (!p)
+			break;
+		++p;
+	}
+
+	warm_blocks = blocks;
+	nr_warm_blocks = nr;
+	schedule_work(&warm_work);
+
+	return count;
+}
+
+/*
+ * Prefetches one block of each listed content into the content cache,
+ * as long as it's within the budget
+ */
+static void dedup_prewarm(struct work_struct *work)
+{
+	long max_blocks = (warm_budget_kb << 10) / dedup_get_block_size();
+	struct page *page = NULL;
+	u8 hash[SHA256_DIGEST_SIZE], read_hash[SHA256_DIGEST_SIZE];
+	u32 crc, read_crc;
+	int i;
+
+	warm_start = jiffies;
+	warm_read_blocks = warm_cached_blocks = 0;
+
+	if (!warm_pin && !dedup_cache_enabled()) {
+		printk(KERN_ERR "content cache is off, prewarm must pin.\n");
+		goto out;
+	}
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page) {
+		printk(KERN_ERR "prewarm failed to get page.\n");
+		goto out;
+	}
+
+	for (i = 0; i < nr_warm_blocks && warm_cached_blocks < max_blocks; ++i) {
+		sector_t block = warm_blocks[i];
+
+		// Content of the block may have changed since the list was saved
+		if (!dedup_block_has_duplicates(block) ||
+			!dedup_get_block_hash(block, hash, &crc))
+			continue;
+
+		// Content that is already cached is served by the read hook
+		++warm_read_blocks;
+		if (dedup_read_block(block, page))
+			continue;
+
+		// A write of the block while it was read leaves data of another
+		// content in the page
+		if (!dedup_get_block_hash(block, read_hash, &read_crc) || read_crc != crc ||
+			memcmp(read_hash, hash, SHA256_DIGEST_SIZE) != 0)
+			continue;
+
+		if (warm_pin)
+			dedup_cache_pin(crc, hash, page, 0);
+		else
+			dedup_cache_insert(crc, hash, page, 0, DEDUP_CLASS_SIZE_MAX_WALK);
+		++warm_cached_blocks;
+	}
+
+out:
+	if (page)
+		put_page(page);
+
+	kfree(warm_blocks);
+	warm_blocks = NULL;
+	warm_msecs = jiffies_to_msecs(jiffies - warm_start);
+	printk("prewarm done: %ld blocks cached in %lu ms.\n", warm_cached_blocks, warm_msecs);
+}
+
+/*
+ * Sets the memory budget of the boot prewarm and whether blocks are pinned
+ */
+void dedup_set_prewarm(long budget_kb, int pin)
+{
+	warm_budget_kb = budget_kb;
+	warm_pin = pin;
+}
+
+/*
+ * Prints heat and prewarm statistics, used by stats_show()
+ */
+void dedup_print_heat_stats(void)
+{
+	printk(KERN_ERR "heat counters = %d\n", nr_heat_slots);
+	printk(KERN_ERR "prewarm: read %ld blocks, cached %ld (%s) in %lu ms\n",
+		   warm_read_blocks, warm_cached_blocks, (warm_pin) ? "pinned" : "not pinned",
+		   warm_msecs);
+}
@@ -0,0 +1,1393 @@
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/hashtable.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/log2.h>
+#include <linux/kdev_t.h>
+#include <linux/dedup.h>
+
+/*
+ * Read path of the dedup, called from generic_make_request() block/blk-core.c
+ *
+ * In-flight reads collapsing:
+ * When several reads of equal content are issued at the same time (VMs booting
+ * together from different images) only the first one goes to the block device.
+ * The bio's blocks are hashed by their content until it completes, and any
+ * single block read of equal content that arrives meanwhile waits for it and
+ * is completed with a copy of its data. A block written while it was being
+ * read may hold either data, so its waiters read their own blocks instead and
+ * it's not cached.
+ *
+ * Read redirection:
+ * On rotational devices a read of a duplicated block can be sent to any
+ * member of its equal blocks ring. In seek mode the bio is moved to the member
+ * that is right after a recently submitted request (so the elevator can merge
+ * them) or otherwise closest to the last submitted sector.
+ *
+ * Pattern reads:
+ * Blocks of one repeated word (zeros, mostly) are pattern blocks, they have no
+ * equal blocks ring. A read of pattern blocks is filled with their word, with
+ * no I/O and no lookup, whatever its size is.
+ *
+ * Reads from memory:
+ * A read whose blocks all have their content in memory - a resident page of
+ * an equal block (dedup_class.c), the content cache (dedup_cache.c) or the
+ * compressed pool (dedup_zpool.c) - is completed without going to the device.
+ * Being at the bio level, this serves every buffered read: mpage, buffer heads
+ * (block_read_full_page, metadata through __bread/ll_rw_block) and the block
+ * device's own page cache. Blocks smaller than a page are found as buffers of
+ * the buffer cache.
+ * We're inside generic_make_request() here and must not sleep on I/O, so only
+ * resident pages found with find_get_page() are used: the block device's own
+ * page cache and the swap cache. File pages are used by the mpage hook
+ * (fs/mpage.c), before the bio is built, where the lookup may sleep.
+ * Page cache pages of reads that do go to the device are recorded as the
+ * resident pages of their blocks.
+ *
+ * Direct reads:
+ * O_DIRECT reads land in user pages, not in the page cache. They are served
+ * from memory only when turned on ('odir on'), and never while a write to one
+ * of their blocks is in flight. Their pages are never used as a source of data
+ * for other reads, the user may change them at any time.
+ *
+ * Swap-in:
+ * When the domain covers a swap device (or the device of a swap file), slots
+ * with identical guest memory are equal blocks. With 'swap on', swap-in reads
+ * are served from memory like page cache reads, and swap cache pages are
+ * recorded as resident pages of their slots' blocks. Swap writes update the
+ * index through the write hook like any write.
+ *
+ * Read load balancing:
+ * While reads are redirected, they're accounted per block device (in-flight
+ * count and latency histogram). In load mode a read of a duplicated block is sent to the equal
+ * block whose device has the least reads in flight, like RAID1 read balancing.
+ * A redirected read is checked when it completes, before anyone sees its
+ * data: if the blocks it was moved to aren't equal to its own anymore (a write
+ * started on them) or the read failed, it's read again from its own blocks.
+ *
+ * Cross-device domains:
+ * Blocks of the devices enrolled with ours ('enrol') are in the same equal
+ * blocks rings, so reads of any of them are served from memory, collapsed
+ * and load balanced across the devices. Seek mode only moves a read within
+ * its device, seek distances between devices mean nothing.
+ */
+
+#define DEDUP_INFLIGHT_HASH_BITS 8
+// Max equal blocks checked when looking for a better block to read
+#define DEDUP_REDIRECT_MAX_CANDIDATES 32
+// Number of last submitted requests considered as merge targets
+#define DEDUP_RECENT_REQUESTS 8
+// Max block devices accounted for read load
+#define DEDUP_MAX_LOAD_DEVS 8
+// Read latency histogram buckets, bucket i holds reads of less than 2^i us
+#define DEDUP_LAT_BUCKETS 24
+// Max blocks in a bio served from memory
+#define DEDUP_MEMORY_MAX_BIO_BLOCKS 16
+
+// A block inside an in-flight read bio
+struct dedup_inflight_block {
+	struct hlist_node node;		// hashed by content crc
+	u32 crc;
+	u8 hash[SHA256_DIGEST_SIZE];
+	sector_t block;
+	struct page *page;			// where the block's data will land
+	unsigned int offset;		// block's offset inside page
+	int weight;					// number of blocks with this content
+	struct bio_list waiters;	// reads waiting for this block's data, chained
+								// by bi_next, they're not submitted
+	int nr_waiters;
+	ktime_t first_wait;			// when the first waiter came
+	u64 wait_start_ns;			// sum of the waiters' arrival times
+};
+
+// In-flight blocks of one read bio and its original completion
+struct dedup_inflight_bio {
+	bio_end_io_t *bi_end_io;
+	void *bi_private;
+	int nr_blocks;
+	struct dedup_inflight_block blocks[0];
+};
+
+// Read load of a block device
+struct dedup_dev_load {
+	dev_t dev;
+	atomic_t in_flight;
+	long reads;
+	long lat_hist[DEDUP_LAT_BUCKETS];
+};
+
+// A read bio accounted in its device load
+struct dedup_load_bio {
+	bio_end_io_t *bi_end_io;
+	void *bi_private;
+	struct dedup_dev_load *load;
+	ktime_t start;
+};
+
+// A read bio moved to equal blocks, checked when it completes. Its segments
+// from idx are saved, a completion may have advanced into them.
+struct dedup_redirect_bio {
+	struct list_head list;
+	struct bio *bio;
+	bio_end_io_t *bi_end_io;
+	void *bi_private;
+	sector_t sector;			// bio's own sector, in the domain
+	sector_t block;				// bio's own first block
+	sector_t target;			// first block it was moved to
+	int nr_blocks;
+	unsigned int size;
+	unsigned short idx;
+	unsigned short nr_vecs;
+	int rereading;				// sent again to its own blocks
+	struct bio_vec vecs[0];
+};
+
+static DEFINE_HASHTABLE(inflight_blocks, DEDUP_INFLIGHT_HASH_BITS);
+static DEFINE_SPINLOCK(inflight_lock);
+
+// Waiters of failed reads, resubmitted to the block device by retry_work
+static struct bio_list retry_bios = BIO_EMPTY_LIST;
+static void dedup_retry_reads(struct work_struct *work);
+static DECLARE_WORK(retry_work, dedup_retry_reads);
+
+// Statistics, protected by inflight_lock
+static long collapsed_read_count = 0, stale_inflight_count = 0;
+static u64 collapsed_wait_ns = 0, collapsed_max_wait_ns = 0;
+
+static int redirect_mode = DEDUP_REDIRECT_OFF;
+// End sectors of the last submitted requests, the last one is the disk head
+static sector_t recent_ends[DEDUP_RECENT_REQUESTS];
+static int recent_idx = 0;
+static DEFINE_SPINLOCK(head_lock);
+
+// Statistics, protected by head_lock
+static long redirected_read_count = 0, seek_read_count = 0;
+static u64 seek_distance_before = 0, seek_distance_after = 0;
+
+static struct dedup_dev_load dev_loads[DEDUP_MAX_LOAD_DEVS];
+static int nr_dev_loads = 0;
+// Protects dev_loads entries and statistics, in_flight is atomic
+static DEFINE_SPINLOCK(load_lock);
+static long balanced_read_count = 0;
+
+// Redirected reads to read again from their own blocks
+static LIST_HEAD(reread_bios);
+static DEFINE_SPINLOCK(reread_lock);
+static void dedup_reread(struct work_struct *work);
+static DECLARE_WORK(reread_work, dedup_reread);
+// Statistics, protected by reread_lock
+static long reread_count = 0;
+
+static int direct_reads_on = 0;
+// Protects direct reads statistics
+static DEFINE_SPINLOCK(write_lock);
+static long direct_read_count = 0, direct_memory_count = 0, direct_write_conflicts = 0;
+
+static int swap_reads_on = 0;
+// Swap-in statistics, protected by write_lock
+static long swap_read_count = 0, swap_memory_count = 0;
+
+// Reads from memory statistics, protected by memory_lock
+static DEFINE_SPINLOCK(memory_lock);
+static long memory_lookup_count = 0, memory_read_count = 0;
+static long resident_block_count = 0, bdev_block_count = 0, meta_block_count = 0;
+// Pattern reads statistics, protected by memory_lock
+static long pattern_lookup_count = 0, pattern_read_count = 0;
+static long pattern_block_count = 0, zero_block_count = 0;
+
+/*
+ * Copies len bytes of data into a read bio that was not submitted,
+ * starting bio_offset bytes into the bio
+ */
+static void dedup_copy_to_bio(struct bio *bio, unsigned int bio_offset,
+							  const char *src, unsigned int len)
+{
+	struct bio_vec *bvec;
+	int i;
+
+	bio_for_each_segment(bvec, bio, i) {
+		unsigned int bv_len = bvec->bv_len;
+		unsigned int bv_offset = bvec->bv_offset;
+		char *dst;
+
+		if (!len)
+			break;
+
+		if (bio_offset >= bv_len) {
+			bio_offset -= bv_len;
+			continue;
+		}
+
+		bv_offset += bio_offset;
+		bv_len -= bio_offset;
+		bio_offset = 0;
+		if (bv_len > len)
+			bv_len = len;
+
+		dst = kmap_atomic(bvec->bv_page);
+		memcpy(dst + bv_offset, src, bv_len);
+		flush_dcache_page(bvec->bv_page);
+		kunmap_atomic(dst);
+		src += bv_len;
+		len -= bv_len;
+	}
+}
+
+/*
+ * Fills len bytes of a read bio that was not submitted with the word
+ * repeated, starting bio_offset bytes into the bio
+ */
+static void dedup_fill_bio(struct bio *bio, unsigned int bio_offset,
+						   unsigned long word, unsigned int len)
+{
+	struct bio_vec *bvec;
+	int i;
+
+	bio_for_each_segment(bvec, bio, i) {
+		unsigned int bv_len = bvec->bv_len;
+		unsigned int bv_offset = bvec->bv_offset;
+		unsigned long *p, *end;
+		char *dst;
+
+		if (!len)
+			break;
+
+		if (bio_offset >= bv_len) {
+			bio_offset -= bv_len;
+			continue;
+		}
+
+		bv_offset += bio_offset;
+		bv_len -= bio_offset;
+		bio_offset = 0;
+		if (bv_len > len)
+			bv_len = len;
+
+		// Segments are split on sector boundaries, the word stays in phase
+		dst = kmap_atomic(bvec->bv_page);
+		if (!word)
+			memset(dst + bv_offset, 0, bv_len);
+		else {
+			p = (unsigned long *)(dst + bv_offset);
+			for (end = p + bv_len / sizeof(*p); p < end; ++p)
+				*p = word;
+		}
+		flush_dcache_page(bvec->bv_page);
+		kunmap_atomic(dst);
+		len -= bv_len;
+	}
+}
+
+/*
+ * Returns the block read by the bio if it reads exactly one aligned block,
+ * otherwise returns -1
+ */
+static sector_t dedup_bio_single_block(struct bio *bio)
+{
+	size_t block_size = dedup_get_block_size();
+
+	if (bio->bi_size != block_size ||
+		(bio->bi_sector & ((block_size >> 9) - 1)))
+		return (sector_t)-1;
+
+	return dedup_sector_to_block(bio->bi_sector);
+}
+
+/*
+ * Look for an in-flight block with the given content.
+ * Must be called with inflight_lock held.
+ */
+static struct dedup_inflight_block *dedup_find_inflight(u32 crc, u8 *hash)
+{
+	struct dedup_inflight_block *ib;
+
+	hash_for_each_possible(inflight_blocks, ib, node, crc) {
+		if (ib->crc == crc && memcmp(ib->hash, hash, SHA256_DIGEST_SIZE) == 0)
+			return ib;
+	}
+
+	return NULL;
+}
+
+/*
+ * If an equal block is being read right now, queue the bio to be completed
+ * with its data. Nothing is allocated, the bio is chained to the block's
+ * waiters by its bi_next.
+ * return 1 if the bio was queued
+ */
+static int dedup_wait_inflight_read(struct bio *bio, sector_t block)
+{
+	struct dedup_inflight_block *ib;
+	u8 hash[SHA256_DIGEST_SIZE];
+	u32 crc;
+	unsigned long flags;
+	ktime_t now;
+
+	if (!dedup_get_block_hash(block, hash, &crc))
+		return 0;
+
+	spin_lock_irqsave(&inflight_lock, flags);
+	ib = dedup_find_inflight(crc, hash);
+	if (ib) {
+		// Counted now, the bio may complete as soon as we unlock
+		dedup_dev_add_memory_read(block);
+		if (DEDUP_BLOCK_DEV(ib->block) != DEDUP_BLOCK_DEV(block))
+			dedup_dev_add_remote_block(block);
+		now = ktime_get();
+		if (!ib->nr_waiters++)
+			ib->first_wait = now;
+		ib->wait_start_ns += ktime_to_ns(now);
+		bio_list_add(&ib->waiters, bio);
+	}
+	spin_unlock_irqrestore(&inflight_lock, flags);
+
+	return (ib != NULL);
+}
+
+/*
+ * Completes all waiters of an in-flight block. The block was already
+ * removed from the hash, so no one else can touch its waiters list.
+ */
+static void dedup_complete_waiters(struct dedup_inflight_block *ib, int uptodate)
+{
+	struct bio *bio;
+	unsigned long flags;
+	ktime_t now;
+	u64 max_ns;
+	char *src;
+
+	if (!ib->nr_waiters)
+		return;
+
+	if (!uptodate) {
+		// Our read failed or its block was written, the waiters must
+		// try their own blocks
+		spin_lock_irqsave(&inflight_lock, flags);
+		bio_list_merge(&retry_bios, &ib->waiters);
+		spin_unlock_irqrestore(&inflight_lock, flags);
+		schedule_work(&retry_work);
+		return;
+	}
+
+	// Waits of all the waiters, from their arrival times
+	now = ktime_get();
+	max_ns = ktime_to_ns(ktime_sub(now, ib->first_wait));
+	spin_lock_irqsave(&inflight_lock, flags);
+	collapsed_read_count += ib->nr_waiters;
+	collapsed_wait_ns += ib->nr_waiters * ktime_to_ns(now) - ib->wait_start_ns;
+	if (max_ns > collapsed_max_wait_ns)
+		collapsed_max_wait_ns = max_ns;
+	spin_unlock_irqrestore(&inflight_lock, flags);
+
+	while ((bio = bio_list_pop(&ib->waiters)) != NULL) {
+		src = kmap_atomic(ib->page);
+		dedup_copy_to_bio(bio, 0, src + ib->offset, dedup_get_block_size());
+		kunmap_atomic(src);
+
+		bio_endio(bio, 0);
+	}
+}
+
+/*
+ * Checks that the in-flight block was not written since its read was sent
+ */
+static int dedup_inflight_block_valid(struct dedup_inflight_block *ib)
+{
+	u8 hash[SHA256_DIGEST_SIZE];
+	u32 crc;
+
+	return (dedup_get_block_hash(ib->block, hash, &crc) && crc == ib->crc &&
+			memcmp(hash, ib->hash, SHA256_DIGEST_SIZE) == 0);
+}
+
+/*
+ * Completion of a read bio that had in-flight blocks
+ */
+static void dedup_inflight_end_io(struct bio *bio, int err)
+{
+	struct dedup_inflight_bio *ibio = bio->bi_private;
+	int uptodate = !err && test_bit(BIO_UPTODATE, &bio->bi_flags);
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&inflight_lock, flags);
+	for (i = 0; i < ibio->nr_blocks; ++i)
+		hash_del(&ibio->blocks[i].node);
+	spin_unlock_irqrestore(&inflight_lock, flags);
+
+	for (i = 0; i < ibio->nr_blocks; ++i) {
+		struct dedup_inflight_block *ib = &ibio->blocks[i];
+		int valid = uptodate && dedup_inflight_block_valid(ib);
+
+		if (uptodate && !valid) {
+			spin_lock_irqsave(&inflight_lock, flags);
+			++stale_inflight_count;
+			spin_unlock_irqrestore(&inflight_lock, flags);
+		}
+
+		dedup_complete_waiters(ib, valid);
+		if (valid)
+			dedup_cache_insert(ib->crc, ib->hash, ib->page, ib->offset, ib->weight);
+	}
+
+	// Give the bio back to its owner
+	bio->bi_end_io = ibio->bi_end_io;
+	bio->bi_private = ibio->bi_private;
+	kfree(ibio);
+	bio_endio(bio, err);
+}
+
+/*
+ * Resubmits waiters whose in-flight read failed
+ */
+static void dedup_retry_reads(struct work_struct *work)
+{
+	struct bio_list bios;
+	struct bio *bio;
+	unsigned long flags;
+
+	spin_lock_irqsave(&inflight_lock, flags);
+	bios = retry_bios;
+	bio_list_init(&retry_bios);
+	spin_unlock_irqrestore(&inflight_lock, flags);
+
+	while ((bio = bio_list_pop(&bios)) != NULL) {
+		// The bio was moved to the domain, it's submitted to its device
+		// again and mapped by the hook like a new bio
+		dedup_unmap_bio(bio);
+		generic_make_request(bio);
+	}
+}
+
+/*
+ * Hash the bio's duplicated blocks as in-flight, so equal reads can wait for
+ * them instead of going to the block device.
+ * Only blocks that are entirely inside one bio_vec are tracked.
+ */
+static void dedup_track_inflight_read(struct bio *bio)
+{
+	size_t block_size = dedup_get_block_size();
+	sector_t sectors_per_block = block_size >> 9;
+	sector_t sector = bio->bi_sector;
+	struct dedup_inflight_bio *ibio = NULL;
+	struct bio_vec *bvec;
+	unsigned long flags;
+	int i;
+
+	bio_for_each_segment(bvec, bio, i) {
+		// First block boundary inside this bio_vec
+		unsigned int skip = ((sectors_per_block - (sector & (sectors_per_block - 1))) &
+							 (sectors_per_block - 1)) << 9;
+		unsigned int offset;
+
+		for (offset = skip; offset + block_size <= bvec->bv_len; offset += block_size) {
+			sector_t block = dedup_sector_to_block(sector + (offset >> 9));
+			struct dedup_inflight_block *ib;
+
+			if (!dedup_block_has_duplicates(block))
+				continue;
+
+			if (!ibio) {
+				int max_blocks = bio->bi_size / block_size;
+
+				ibio = kmalloc(sizeof(*ibio) + max_blocks * sizeof(*ib), GFP_NOIO);
+				if (!ibio)
+					return;
+				ibio->nr_blocks = 0;
+			}
+
+			ib = &ibio->blocks[ibio->nr_blocks];
+			if (!dedup_get_block_hash(block, ib->hash, &ib->crc))
+				continue;
+
+			ib->block = block;
+			ib->page = bvec->bv_page;
+			ib->offset = bvec->bv_offset + offset;
+			ib->weight = (dedup_cache_enabled()) ?
+				dedup_get_class_size(block, DEDUP_CLASS_SIZE_MAX_WALK) : 0;
+			bio_list_init(&ib->waiters);
+			ib->nr_waiters = 0;
+			ib->wait_start_ns = 0;
+			++ibio->nr_blocks;
+		}
+
+		sector += bvec->bv_len >> 9;
+	}
+
+	if (!ibio)
+		return;
+
+	if (!ibio->nr_blocks) {
+		kfree(ibio);
+		return;
+	}
+
+	ibio->bi_end_io = bio->bi_end_io;
+	ibio->bi_private = bio->bi_private;
+	bio->bi_end_io = dedup_inflight_end_io;
+	bio->bi_private = ibio;
+
+	spin_lock_irqsave(&inflight_lock, flags);
+	for (i = 0; i < ibio->nr_blocks; ++i)
+		hash_add(inflight_blocks, &ibio->blocks[i].node, ibio->blocks[i].crc);
+	spin_unlock_irqrestore(&inflight_lock, flags);
+}
+
+/*
+ * Remembers where the bio ends, used to estimate the disk head position
+ */
+void dedup_track_head(struct bio *bio)
+{
+	unsigned long flags;
+
+	if (redirect_mode == DEDUP_REDIRECT_OFF)
+		return;
+
+	spin_lock_irqsave(&head_lock, flags);
+	recent_ends[recent_idx] = bio->bi_sector + bio_sectors(bio);
+	recent_idx = (recent_idx + 1) % DEDUP_RECENT_REQUESTS;
+	spin_unlock_irqrestore(&head_lock, flags);
+}
+
+/*
+ * Estimated cost of reading from sector: 0 if it continues a recent request,
+ * otherwise the distance from the disk head
+ */
+static sector_t dedup_seek_cost(sector_t sector, sector_t head, sector_t *ends)
+{
+	int i;
+
+	for (i = 0; i < DEDUP_RECENT_REQUESTS; ++i) {
+		if (ends[i] == sector)
+			return 0;
+	}
+
+	return (sector > head) ? sector - head : head - sector;
+}
+
+/*
+ * Checks that nr_blocks blocks starting at block1 are equal to the
+ * blocks starting at block2. The first blocks are in the same ring, but a
+ * block being written may still be linked to its old equal blocks, so they're
+ * checked too.
+ */
+static int dedup_blocks_run_equal(sector_t block1, sector_t block2, int nr_blocks)
+{
+	u8 hash1[SHA256_DIGEST_SIZE], hash2[SHA256_DIGEST_SIZE];
+	u32 crc1, crc2;
+	int i;
+
+	for (i = 0; i < nr_blocks; ++i) {
+		if (!dedup_get_block_hash(block1 + i, hash1, &crc1) ||
+			!dedup_get_block_hash(block2 + i, hash2, &crc2))
+			return 0;
+
+		if (crc1 != crc2 || memcmp(hash1, hash2, SHA256_DIGEST_SIZE) != 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Moves the read to the equal blocks that are cheapest to reach
+ */
+static void dedup_redirect_read(struct bio *bio)
+{
+	size_t block_size = dedup_get_block_size();
+	sector_t sectors_per_block = block_size >> 9;
+	sector_t ends[DEDUP_RECENT_REQUESTS];
+	sector_t block, best_block, equal_block, head;
+	sector_t orig_cost, best_cost;
+	unsigned long flags;
+	int nr_blocks, candidates = 0;
+
+	if (redirect_mode != DEDUP_REDIRECT_SEEK ||
+		blk_queue_nonrot(bdev_get_queue(bio->bi_bdev)))
+		return;
+
+	// Only whole blocks can be moved
+	if ((bio->bi_sector & (sectors_per_block - 1)) || (bio->bi_size % block_size))
+		return;
+
+	block = dedup_sector_to_block(bio->bi_sector);
+	nr_blocks = bio->bi_size / block_size;
+	if (!dedup_block_has_duplicates(block))
+		return;
+
+	spin_lock_irqsave(&head_lock, flags);
+	memcpy(ends, recent_ends, sizeof(ends));
+	head = recent_ends[(recent_idx + DEDUP_RECENT_REQUESTS - 1) % DEDUP_RECENT_REQUESTS];
+	spin_unlock_irqrestore(&head_lock, flags);
+
+	best_block = block;
+	orig_cost = best_cost = dedup_seek_cost(bio->bi_sector, head, ends);
+
+	equal_block = dedup_get_next_equal_block(block);
+	while (best_cost && equal_block != block &&
+		   candidates++ < DEDUP_REDIRECT_MAX_CANDIDATES) {
+		sector_t cost = dedup_seek_cost(equal_block * sectors_per_block, head, ends);
+
+		if (DEDUP_BLOCK_DEV(equal_block) == DEDUP_BLOCK_DEV(block) &&
+			cost < best_cost && dedup_is_in_range(equal_block + nr_blocks - 1) &&
+			dedup_blocks_run_equal(block, equal_block, nr_blocks)) {
+			best_block = equal_block;
+			best_cost = cost;
+		}
+
+		equal_block = dedup_get_next_equal_block(equal_block);
+	}
+
+	if (best_block != block)
+		bio->bi_sector = best_block * sectors_per_block;
+
+	spin_lock_irqsave(&head_lock, flags);
+	if (best_block != block)
+		++redirected_read_count;
+	++seek_read_count;
+	seek_distance_before += orig_cost;
+	seek_distance_after += best_cost;
+	spin_unlock_irqrestore(&head_lock, flags);
+}
+
+/*
+ * Completion of a redirected read. Its data is used only if the blocks it
+ * was read from are still equal to its own, otherwise it's read again.
+ * May be called in interrupt context.
+ */
+static void dedup_redirect_end_io(struct bio *bio, int err)
+{
+	struct dedup_redirect_bio *rbio = bio->bi_private;
+	unsigned long flags;
+
+	if (rbio->rereading ||
+		(!err && dedup_blocks_run_equal(rbio->block, rbio->target, rbio->nr_blocks))) {
+		bio->bi_end_io = rbio->bi_end_io;
+		bio->bi_private = rbio->bi_private;
+		kfree(rbio);
+		bio_endio(bio, err);
+		return;
+	}
+
+	spin_lock_irqsave(&reread_lock, flags);
+	list_add_tail(&rbio->list, &reread_bios);
+	++reread_count;
+	spin_unlock_irqrestore(&reread_lock, flags);
+	schedule_work(&reread_work);
+}
+
+/*
+ * Sends redirected reads whose data can't be used to their own blocks again
+ */
+static void dedup_reread(struct work_struct *work)
+{
+	struct dedup_redirect_bio *rbio, *tmp;
+	struct bio *bio;
+	unsigned long flags;
+	LIST_HEAD(rbios);
+
+	spin_lock_irqsave(&reread_lock, flags);
+	list_splice_init(&reread_bios, &rbios);
+	spin_unlock_irqrestore(&reread_lock, flags);
+
+	list_for_each_entry_safe(rbio, tmp, &rbios, list) {
+		bio = rbio->bio;
+		memcpy(bio->bi_io_vec + rbio->idx, rbio->vecs, rbio->nr_vecs * sizeof(struct bio_vec));
+		bio->bi_idx = rbio->idx;
+		bio->bi_size = rbio->size;
+		bio->bi_sector = rbio->sector;
+		set_bit(BIO_UPTODATE, &bio->bi_flags);
+		clear_bit(BIO_SEG_VALID, &bio->bi_flags);
+		rbio->rereading = 1;
+
+		// The hook leaves it alone, see dedup_make_read_request()
+		dedup_unmap_bio(bio);
+		generic_make_request(bio);
+	}
+}
+
+/*
+ * Hooks the completion of a read moved from sector to other blocks, so its
+ * data is checked before anyone uses it. The bio is put back on its sector
+ * if it can't be hooked.
+ */
+static void dedup_check_redirect(struct bio *bio, sector_t sector)
+{
+	size_t block_size = dedup_get_block_size();
+	int nr_vecs = bio->bi_vcnt - bio->bi_idx;
+	struct dedup_redirect_bio *rbio;
+
+	rbio = kmalloc(sizeof(*rbio) + nr_vecs * sizeof(struct bio_vec), GFP_NOIO);
+	if (!rbio) {
+		bio->bi_sector = sector;
+		return;
+	}
+
+	rbio->bio = bio;
+	rbio->bi_end_io = bio->bi_end_io;
+	rbio->bi_private = bio->bi_private;
+	rbio->sector = sector;
+	rbio->block = dedup_sector_to_block(sector);
+	rbio->target = dedup_sector_to_block(bio->bi_sector);
+	rbio->nr_blocks = bio->bi_size / block_size;
+	rbio->size = bio->bi_size;
+	rbio->idx = bio->bi_idx;
+	rbio->nr_vecs = nr_vecs;
+	rbio->rereading = 0;
+	memcpy(rbio->vecs, bio->bi_io_vec + bio->bi_idx, nr_vecs * sizeof(struct bio_vec));
+
+	bio->bi_end_io = dedup_redirect_end_io;
+	bio->bi_private = rbio;
+}
+
+/*
+ * Returns the load entry of a block device, adding it if it's not there yet.
+ * returns NULL if there are too many devices.
+ */
+static struct dedup_dev_load *dedup_get_dev_load(dev_t dev)
+{
+	struct dedup_dev_load *load = NULL;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&load_lock, flags);
+	for (i = 0; i < nr_dev_loads; ++i) {
+		if (dev_loads[i].dev == dev) {
+			load = &dev_loads[i];
+			break;
+		}
+	}
+
+	if (!load && nr_dev_loads < DEDUP_MAX_LOAD_DEVS) {
+		load = &dev_loads[nr_dev_loads++];
+		load->dev = dev;
+		atomic_set(&load->in_flight, 0);
+	}
+	spin_unlock_irqrestore(&load_lock, flags);
+
+	return load;
+}
+
+/*
+ * Number of reads in flight on the device holding the block
+ */
+static int dedup_block_dev_load(sector_t block)
+{
+	struct dedup_dev_load *load = dedup_get_dev_load(dedup_get_block_dev(block));
+
+	return (load) ? atomic_read(&load->in_flight) : INT_MAX;
+}
+
+/*
+ * Moves the read to the equal blocks whose device is the least busy
+ */
+static void dedup_balance_read(struct bio *bio)
+{
+	size_t block_size = dedup_get_block_size();
+	sector_t sectors_per_block = block_size >> 9;
+	sector_t block, best_block, equal_block;
+	int nr_blocks, best_load, candidates = 0;
+	unsigned long flags;
+
+	if (redirect_mode != DEDUP_REDIRECT_LOAD)
+		return;
+
+	// Only whole blocks can be moved
+	if ((bio->bi_sector & (sectors_per_block - 1)) || (bio->bi_size % block_size))
+		return;
+
+	block = dedup_sector_to_block(bio->bi_sector);
+	nr_blocks = bio->bi_size / block_size;
+	if (!dedup_block_has_duplicates(block))
+		return;
+
+	best_block = block;
+	best_load = dedup_block_dev_load(block);
+
+	equal_block = dedup_get_next_equal_block(block);
+	while (best_load && equal_block != block &&
+		   candidates++ < DEDUP_REDIRECT_MAX_CANDIDATES) {
+		int load = dedup_block_dev_load(equal_block);
+
+		if (load < best_load && dedup_is_in_range(equal_block + nr_blocks - 1) &&
+			dedup_blocks_run_equal(block, equal_block, nr_blocks)) {
+			best_block = equal_block;
+			best_load = load;
+		}
+
+		equal_block = dedup_get_next_equal_block(equal_block);
+	}
+
+	if (best_block != block) {
+		bio->bi_sector = best_block * sectors_per_block;
+
+		spin_lock_irqsave(&load_lock, flags);
+		++balanced_read_count;
+		spin_unlock_irqrestore(&load_lock, flags);
+	}
+}
+
+/*
+ * Completion of an accounted read bio
+ */
+static void dedup_load_end_io(struct bio *bio, int err)
+{
+	struct dedup_load_bio *lbio = bio->bi_private;
+	u64 lat_us = ktime_to_us(ktime_sub(ktime_get(), lbio->start));
+	int bucket = (lat_us) ? ilog2(lat_us) + 1 : 0;
+	unsigned long flags;
+
+	if (bucket >= DEDUP_LAT_BUCKETS)
+		bucket = DEDUP_LAT_BUCKETS - 1;
+
+	atomic_dec(&lbio->load->in_flight);
+	spin_lock_irqsave(&load_lock, flags);
+	++lbio->load->reads;
+	++lbio->load->lat_hist[bucket];
+	spin_unlock_irqrestore(&load_lock, flags);
+
+	// Give the bio back to its owner
+	bio->bi_end_io = lbio->bi_end_io;
+	bio->bi_private = lbio->bi_private;
+	kfree(lbio);
+	bio_endio(bio, err);
+}
+
+/*
+ * Accounts the read in its device's load until it completes. Reads are not
+ * accounted while they're not redirected.
+ */
+static void dedup_account_read(struct bio *bio)
+{
+	struct dedup_load_bio *lbio;
+	struct dedup_dev_load *load;
+
+	if (redirect_mode == DEDUP_REDIRECT_OFF)
+		return;
+
+	load = dedup_get_dev_load(dedup_get_block_dev(dedup_sector_to_block(bio->bi_sector)));
+	if (!load)
+		return;
+
+	lbio = kmalloc(sizeof(*lbio), GFP_NOIO);
+	if (!lbio)
+		return;
+
+	lbio->bi_end_io = bio->bi_end_io;
+	lbio->bi_private = bio->bi_private;
+	lbio->load = load;
+	lbio->start = ktime_get();
+	bio->bi_end_io = dedup_load_end_io;
+	bio->bi_private = lbio;
+
+	atomic_inc(&load->in_flight);
+}
+
+/*
+ * Returns the latency (us) under which permille of the reads completed
+ */
+static u64 dedup_lat_percentile(long *hist, long reads, int permille)
+{
+	long count = 0;
+	int i;
+
+	for (i = 0; i < DEDUP_LAT_BUCKETS; ++i) {
+		count += hist[i];
+		if ((u64)count * 1000 >= (u64)reads * permille)
+			break;
+	}
+
+	return 1ULL << i;
+}
+
+/*
+ * Sets how reads of duplicated blocks are redirected
+ */
+void dedup_set_redirect_mode(int mode)
+{
+	redirect_mode = mode;
+}
+
+/*
+ * Returns the page (and offset inside it) where a block of the bio lands,
+ * or NULL if the block is split between several bio_vecs
+ */
+static struct page *dedup_bio_block_page(struct bio *bio, unsigned int bio_offset,
+										 unsigned int *page_offset)
+{
+	size_t block_size = dedup_get_block_size();
+	struct bio_vec *bvec;
+	int i;
+
+	bio_for_each_segment(bvec, bio, i) {
+		if (bio_offset < bvec->bv_len) {
+			if (bio_offset + block_size > bvec->bv_len)
+				return NULL;
+
+			*page_offset = bvec->bv_offset + bio_offset;
+			return bvec->bv_page;
+		}
+
+		bio_offset -= bvec->bv_len;
+	}
+
+	return NULL;
+}
+
+/*
+ * Fills one block of the bio with a copy of a resident page or buffer
+ * holding an equal block.
+ * return 1 if the block was filled
+ */
+static int dedup_read_block_from_page_cache(struct bio *bio, unsigned int bio_offset,
+											sector_t block)
+{
+	struct page *page, *dst_page;
+	unsigned int offset, page_offset;
+	unsigned long flags;
+	char *buf;
+
+	// Called from generic_make_request(), only pages found without sleeping
+	page = dedup_class_get_page(block, &offset, 0);
+	if (!page)
+		return 0;
+
+	dst_page = dedup_bio_block_page(bio, bio_offset, &page_offset);
+	if (dst_page == page) {
+		page_cache_release(page);
+		return 0;
+	}
+
+	// Copy under the page lock, so the data isn't torn by a write or a
+	// journal changing it. We must not sleep here, a locked page is skipped.
+	if (!trylock_page(page)) {
+		page_cache_release(page);
+		return 0;
+	}
+	if (!dedup_block_data_stable(page, offset)) {
+		unlock_page(page);
+		page_cache_release(page);
+		return 0;
+	}
+
+	buf = kmap_atomic(page);
+	dedup_copy_to_bio(bio, bio_offset, buf + offset, dedup_get_block_size());
+	kunmap_atomic(buf);
+	unlock_page(page);
+	page_cache_release(page);
+
+	spin_lock_irqsave(&memory_lock, flags);
+	++resident_block_count;
+	if (dedup_is_bdev_page(dst_page))
+		++bdev_block_count;
+	if (bio->bi_rw & REQ_META)
+		++meta_block_count;
+	spin_unlock_irqrestore(&memory_lock, flags);
+
+	return 1;
+}
+
+/*
+ * Fills one block of the bio from memory: a resident page of an equal block,
+ * the content cache or the compressed pool.
+ * return 1 if the block was filled
+ */
+static int dedup_read_block_from_memory(struct bio *bio, unsigned int bio_offset,
+										sector_t block)
+{
+	size_t block_size = dedup_get_block_size();
+	u8 hash[SHA256_DIGEST_SIZE];
+	struct page *page;
+	unsigned int page_offset;
+	unsigned long flags, word;
+	u32 crc;
+	char *buf;
+	int ret;
+
+	if (dedup_get_block_pattern(block, &word)) {
+		dedup_fill_bio(bio, bio_offset, word, block_size);
+		spin_lock_irqsave(&memory_lock, flags);
+		++pattern_block_count;
+		if (!word)
+			++zero_block_count;
+		spin_unlock_irqrestore(&memory_lock, flags);
+		return 1;
+	}
+
+	if (!dedup_block_has_duplicates(block) || !dedup_get_block_hash(block, hash, &crc))
+		return 0;
+
+	if (dedup_read_block_from_page_cache(bio, bio_offset, block))
+		return 1;
+
+	page = dedup_cache_get_page(crc, hash);
+	if (page) {
+		buf = kmap_atomic(page);
+		dedup_copy_to_bio(bio, bio_offset, buf, block_size);
+		kunmap_atomic(buf);
+		put_page(page);
+		return 1;
+	}
+
+	page = dedup_bio_block_page(bio, bio_offset, &page_offset);
+	if (!page)
+		return 0;
+
+	buf = kmap_atomic(page);
+	ret = dedup_zpool_load(crc, hash, buf + page_offset);
+	kunmap_atomic(buf);
+	if (ret)
+		flush_dcache_page(page);
+
+	return ret;
+}
+
+/*
+ * Serves the read from memory if all its blocks are there.
+ * return 1 if the bio was completed
+ */
+static int dedup_read_from_memory(struct bio *bio)
+{
+	size_t block_size = dedup_get_block_size();
+	unsigned long flags, word;
+	sector_t block;
+	int nr_blocks, i;
+
+	// Only whole blocks can be served
+	if ((bio->bi_sector & ((block_size >> 9) - 1)) || (bio->bi_size % block_size))
+		return 0;
+
+	nr_blocks = bio->bi_size / block_size;
+	block = dedup_sector_to_block(bio->bi_sector);
+	if (nr_blocks > DEDUP_MEMORY_MAX_BIO_BLOCKS ||
+		(!dedup_block_has_duplicates(block) && !dedup_get_block_pattern(block, &word)))
+		return 0;
+
+	spin_lock_irqsave(&memory_lock, flags);
+	++memory_lookup_count;
+	spin_unlock_irqrestore(&memory_lock, flags);
+
+	// Blocks filled before a miss are simply read again from the device
+	for (i = 0; i < nr_blocks; ++i) {
+		if (!dedup_read_block_from_memory(bio, i * block_size, block + i))
+			return 0;
+	}
+
+	spin_lock_irqsave(&memory_lock, flags);
+	++memory_read_count;
+	spin_unlock_irqrestore(&memory_lock, flags);
+
+	bio_endio(bio, 0);
+	return 1;
+}
+
+/*
+ * Serves the read without I/O and without looking for equal blocks if all
+ * its blocks are pattern blocks, whatever its size is.
+ * return 1 if the bio was completed
+ */
+static int dedup_read_patterns(struct bio *bio)
+{
+	size_t block_size = dedup_get_block_size();
+	unsigned long flags, word;
+	sector_t block;
+	int nr_blocks, i, zero = 0;
+
+	if ((bio->bi_sector & ((block_size >> 9) - 1)) || (bio->bi_size % block_size))
+		return 0;
+
+	nr_blocks = bio->bi_size / block_size;
+	block = dedup_sector_to_block(bio->bi_sector);
+	if (!dedup_get_block_pattern(block, &word))
+		return 0;
+
+	spin_lock_irqsave(&memory_lock, flags);
+	++pattern_lookup_count;
+	spin_unlock_irqrestore(&memory_lock, flags);
+
+	// Blocks filled before a block that isn't a pattern are simply read
+	// again, by the memory path or from the device
+	for (i = 0; i < nr_blocks; ++i) {
+		if (i && !dedup_get_block_pattern(block + i, &word))
+			return 0;
+
+		dedup_fill_bio(bio, i * block_size, word, block_size);
+		if (!word)
+			++zero;
+	}
+
+	spin_lock_irqsave(&memory_lock, flags);
+	++pattern_read_count;
+	pattern_block_count += nr_blocks;
+	zero_block_count += zero;
+	spin_unlock_irqrestore(&memory_lock, flags);
+
+	bio_endio(bio, 0);
+	return 1;
+}
+
+/*
+ * Records the page cache pages the bio reads whole blocks into, as the
+ * resident pages of these blocks. Must be called before the bio is redirected.
+ * File pages hold a single block, pages of the buffer cache may hold several.
+ */
+static void dedup_record_page_refs(struct bio *bio)
+{
+	size_t block_size = dedup_get_block_size();
+	sector_t block = dedup_sector_to_block(bio->bi_sector);
+	struct bio_vec *bvec;
+	int i;
+
+	if (bio->bi_sector & ((block_size >> 9) - 1))
+		return;
+
+	bio_for_each_segment(bvec, bio, i) {
+		struct page *page = bvec->bv_page;
+		unsigned int offset;
+
+		if ((bvec->bv_offset | bvec->bv_len) & (block_size - 1))
+			return;
+
+		if (PageSwapCache(page)) {
+			if (block_size == PAGE_SIZE && dedup_block_has_duplicates(block))
+				dedup_set_block_page_ref(block, page);
+			block += bvec->bv_len / block_size;
+			continue;
+		}
+
+		if (!page->mapping || PageAnon(page) ||
+			(block_size != PAGE_SIZE && !dedup_is_bdev_page(page))) {
+			block += bvec->bv_len / block_size;
+			continue;
+		}
+
+		for (offset = 0; offset < bvec->bv_len; offset += block_size, ++block) {
+			if (dedup_block_has_duplicates(block))
+				dedup_set_block_page_ref(block, page);
+		}
+	}
+}
+
+/*
+ * return 1 if the bio reads into user pages (O_DIRECT), not into the page
+ * cache or the swap cache
+ */
+static int dedup_bio_is_direct(struct bio *bio)
+{
+	struct bio_vec *bvec;
+	int i;
+
+	bio_for_each_segment(bvec, bio, i) {
+		struct page *page = bvec->bv_page;
+
+		if ((page->mapping && !PageAnon(page)) || PageSwapCache(page))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * return 1 if the bio is a swap-in read
+ */
+static int dedup_bio_is_swap(struct bio *bio)
+{
+	return PageSwapCache(bio_page(bio));
+}
+
+/*
+ * Turns serving swap-in reads from memory on/off
+ */
+void dedup_set_swap_reads(int on)
+{
+	swap_reads_on = on;
+}
+
+/*
+ * Checks if a direct read may be served from memory: direct reads are on and
+ * none of its blocks is being written. The write path keeps a block pending
+ * from its write's submission until the write is hashed, so the blocks'
+ * state is checked, without tracking writes here.
+ */
+static int dedup_direct_read_allowed(struct bio *bio)
+{
+	sector_t block = dedup_sector_to_block(bio->bi_sector);
+	sector_t last_block = dedup_sector_to_block(bio_end_sector(bio) - 1);
+	unsigned long flags;
+	int allowed = direct_reads_on, conflict = 0;
+
+	for (; allowed && block <= last_block; ++block) {
+		if (dedup_block_write_pending(block)) {
+			conflict = 1;
+			allowed = 0;
+		}
+	}
+
+	spin_lock_irqsave(&write_lock, flags);
+	++direct_read_count;
+	direct_write_conflicts += conflict;
+	spin_unlock_irqrestore(&write_lock, flags);
+
+	return allowed;
+}
+
+/*
+ * Turns serving direct reads from memory on/off
+ */
+void dedup_set_direct_reads(int on)
+{
+	direct_reads_on = on;
+}
+
+/*
+ * Counts the read heat of the bio's duplicated blocks
+ */
+static void dedup_count_heat(struct bio *bio)
+{
+	size_t block_size = dedup_get_block_size();
+	sector_t block = dedup_sector_to_block(bio->bi_sector);
+	int nr_blocks = bio->bi_size / block_size;
+	int i;
+
+	if (bio->bi_sector & ((block_size >> 9) - 1))
+		return;
+
+	for (i = 0; i < nr_blocks; ++i) {
+		if (dedup_block_has_duplicates(block + i))
+			dedup_heat_add_read(block + i);
+	}
+}
+
+/*
+ * Called from generic_make_request() for read bios of our block device.
+ * return 1 if the bio was taken care of and must not be submitted
+ */
+int dedup_make_read_request(struct bio *bio)
+{
+	sector_t block, sector;
+	int direct, swap, from_memory;
+	unsigned long flags;
+
+	// A redirected read sent again to its own blocks, it was seen already
+	if (!bio_has_data(bio) || bio->bi_end_io == dedup_redirect_end_io)
+		return 0;
+
+	dedup_count_heat(bio);
+	block = dedup_sector_to_block(bio->bi_sector);
+	dedup_churn_add_read(block);
+
+	swap = dedup_bio_is_swap(bio);
+	direct = !swap && dedup_bio_is_direct(bio);
+	if (swap)
+		from_memory = swap_reads_on;
+	else
+		from_memory = (!direct || dedup_direct_read_allowed(bio));
+
+	if (swap) {
+		spin_lock_irqsave(&write_lock, flags);
+		++swap_read_count;
+		spin_unlock_irqrestore(&write_lock, flags);
+	}
+
+	if (from_memory && (dedup_read_patterns(bio) || dedup_read_from_memory(bio))) {
+		dedup_dev_add_memory_read(block);
+		if (direct || swap) {
+			spin_lock_irqsave(&write_lock, flags);
+			if (direct)
+				++direct_memory_count;
+			else
+				++swap_memory_count;
+			spin_unlock_irqrestore(&write_lock, flags);
+		}
+		return 1;
+	}
+
+	// A single block read may wait for an equal block already being read
+	block = dedup_bio_single_block(bio);
+	if (from_memory && block != (sector_t)-1 && dedup_block_has_duplicates(block) &&
+		dedup_wait_inflight_read(bio, block))
+		return 1;
+
+	if (!swap || swap_reads_on)
+		dedup_record_page_refs(bio);
+	sector = bio->bi_sector;
+	dedup_redirect_read(bio);
+	dedup_balance_read(bio);
+	dedup_track_head(bio);
+	// User pages can't be trusted as a source for other reads
+	if (!direct && (!swap || swap_reads_on))
+		dedup_track_inflight_read(bio);
+	dedup_account_read(bio);
+	// Hooked last, so its completion runs first and checks the data before
+	// reads waiting for it get it
+	if (bio->bi_sector != sector)
+		dedup_check_redirect(bio, sector);
+
+	return 0;
+}
+
+/*
+ * Prints read path statistics, used by stats_show()
+ */
+void dedup_print_read_stats(void)
+{
+	u64 avg_wait_ns = 0;
+	int i;
+
+	if (collapsed_read_count)
+		avg_wait_ns = div64_u64(collapsed_wait_ns, collapsed_read_count);
+
+	printk(KERN_ERR "collapsed reads = %ld, written while in flight = %ld\n",
+		   collapsed_read_count, stale_inflight_count);
+	printk(KERN_ERR "collapsed read wait avg = %llu ns, max = %llu ns\n",
+		   avg_wait_ns, collapsed_max_wait_ns);
+
+	if (seek_read_count) {
+		printk(KERN_ERR "redirected reads = %ld out of %ld\n",
+			   redirected_read_count, seek_read_count);
+		printk(KERN_ERR "avg seek distance = %llu sectors (%llu without redirect)\n",
+			   div64_u64(seek_distance_after, seek_read_count),
+			   div64_u64(seek_distance_before, seek_read_count));
+	}
+
+	printk(KERN_ERR "redirected reads read again from their own blocks = %ld\n", reread_count);
+	printk(KERN_ERR "reads from memory = %ld out of %ld, hit rate = %ld%%\n",
+		   memory_read_count, memory_lookup_count,
+		   (memory_lookup_count) ? memory_read_count * 100 / memory_lookup_count : 0);
+	printk(KERN_ERR "blocks from resident pages = %ld (into blkdev page cache = %ld, metadata = %ld)\n",
+		   resident_block_count, bdev_block_count, meta_block_count);
+	printk(KERN_ERR "pattern reads = %ld out of %ld, hit rate = %ld%%, blocks filled without I/O = %ld "
+		   "(zero = %ld)\n",
+		   pattern_read_count, pattern_lookup_count,
+		   (pattern_lookup_count) ? pattern_read_count * 100 / pattern_lookup_count : 0,
+		   pattern_block_count, zero_block_count);
+
+	printk(KERN_ERR "direct reads = %ld, from memory = %ld, write conflicts = %ld (%s)\n",
+		   direct_read_count, direct_memory_count, direct_write_conflicts,
+		   (direct_reads_on) ? "on" : "off");
+
+	printk(KERN_ERR "swap-in reads = %ld, from memory = %ld, %ld KB I/O saved (%s)\n",
+		   swap_read_count, swap_memory_count,
+		   swap_memory_count * (PAGE_SIZE >> 10), (swap_reads_on) ? "on" : "off");
+
+	printk(KERN_ERR "balanced reads = %ld\n", balanced_read_count);
+	for (i = 0; i < nr_dev_loads; ++i) {
+		struct dedup_dev_load *load = &dev_loads[i];
+
+		if (!load->reads)
+			continue;
+
+		printk(KERN_ERR "dev %d:%d reads = %ld, in flight = %d, p50 < %llu us, p99 < %llu us, p99.9 < %llu us\n",
+			   MAJOR(load->dev), MINOR(load->dev), load->reads,
+			   atomic_read(&load->in_flight),
+			   dedup_lat_percentile(load->lat_hist, load->reads, 500),
+			   dedup_lat_percentile(load->lat_hist, load->reads, 990),
+			   dedup_lat_percentile(load->lat_hist, load->reads, 999));
+	}
+}
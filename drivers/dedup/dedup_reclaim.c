@@ -0,0 +1,196 @@
+#include <linux/mm.h>
+#include <linux/swap.h>
+#include <linux/pagemap.h>
+#include <linux/shrinker.h>
+#include <linux/mutex.h>
+#include <linux/dedup.h>
+
+/*
+ * Reclaim hints.
+ *
+ * The page cache doesn't know that one resident page of a duplicated block can
+ * serve reads of all its equal blocks. Under memory pressure the VM calls our
+ * shrinker, and we go over the next part of the dedup range:
+ * 	- a resident page that has an equal block with a lower number that is also
+ * 	  resident is a redundant copy, it's deactivated so it's reclaimed first.
+ * 	- otherwise the page is the copy we keep for its equal blocks, and it's
+ * 	  marked accessed to be activated.
+ * We don't free anything ourselves, the hints take effect on the next LRU scan.
+ *
+ * Reclaim must not sleep on I/O, so only pages found without sleeping are
+ * hinted: pages of the block device's page cache and of the swap cache. Files'
+ * pages need ilookup() and bmap() and are left alone. Equal blocks rings are
+ * walked up to DEDUP_RECLAIM_MAX_WALK blocks.
+ *
+ * The shrinker reports as objects the redundant copies the last full pass over
+ * the range deactivated, what the VM can reclaim thanks to the hints, not the
+ * size of the range. Until the first pass completes it reports one batch, and
+ * a pass that found none stops the scans until hints are turned on again.
+ */
+
+// Max equal blocks looked at for a lower resident copy
+#define DEDUP_RECLAIM_MAX_WALK 16
+// Objects reported before a full pass over the range completed
+#define DEDUP_RECLAIM_BATCH 128
+
+static int reclaim_hints_on = 0;
+static sector_t reclaim_cursor = 0;	// next block to scan, relative to the range
+static DEFINE_MUTEX(reclaim_mutex);
+// Redundant copies deactivated by the current and the last full pass,
+// -1 before a pass completed
+static long reclaim_pass_redundant = 0, reclaim_last_redundant = -1;
+
+// Statistics, protected by reclaim_mutex
+static long reclaim_scanned = 0, reclaim_activated = 0, reclaim_deactivated = 0;
+
+/*
+ * Returns the block's resident page if it can be found without sleeping
+ */
+static struct page *dedup_reclaim_get_page(sector_t block)
+{
+	unsigned int offset;
+
+	return dedup_get_block_data(block, &offset, 0);
+}
+
+/*
+ * Checks if an equal block with a lower number has a resident page
+ */
+static int dedup_has_lower_resident_copy(sector_t block)
+{
+	sector_t equal_block = dedup_get_next_equal_block(block);
+	struct page *page;
+	int walked = 0;
+
+	while (equal_block != block && walked++ < DEDUP_RECLAIM_MAX_WALK) {
+		if (equal_block < block) {
+			page = dedup_reclaim_get_page(equal_block);
+			if (page) {
+				page_cache_release(page);
+				return 1;
+			}
+		}
+
+		equal_block = dedup_get_next_equal_block(equal_block);
+	}
+
+	return 0;
+}
+
+/*
+ * Gives a hint to the VM about the block's page, if it's resident
+ */
+static void dedup_reclaim_hint(sector_t block)
+{
+	struct page *page;
+
+	if (!dedup_block_has_duplicates(block))
+		return;
+
+	page = dedup_reclaim_get_page(block);
+	if (!page)
+		return;
+
+	if (dedup_has_lower_resident_copy(block)) {
+		deactivate_page(page);
+		++reclaim_deactivated;
+		++reclaim_pass_redundant;
+	}
+	else {
+		mark_page_accessed(page);
+		++reclaim_activated;
+	}
+
+	page_cache_release(page);
+}
+
+/*
+ * Number of objects reported to the VM
+ */
+static int dedup_reclaim_count(void)
+{
+	long count = reclaim_last_redundant;
+
+	if (count < 0)
+		return DEDUP_RECLAIM_BATCH;
+
+	return (count > INT_MAX) ? INT_MAX : count;
+}
+
+/*
+ * Shrinker callback, called by the VM under memory pressure.
+ * Scans sc->nr_to_scan blocks and returns the number of redundant copies.
+ */
+static int dedup_reclaim_shrink(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	sector_t block;
+	long blocks = dedup_get_blocks_count();
+	unsigned long nr = sc->nr_to_scan;
+	int count;
+
+	if (!reclaim_hints_on || dedup_wait_for_init())
+		return 0;
+
+	if (!nr)
+		return dedup_reclaim_count();
+
+	if (!mutex_trylock(&reclaim_mutex))
+		return -1;
+
+	while (nr--) {
+		if (reclaim_cursor >= blocks) {
+			reclaim_cursor = 0;
+			reclaim_last_redundant = reclaim_pass_redundant;
+			reclaim_pass_redundant = 0;
+		}
+
+		block = dedup_get_index_block(reclaim_cursor);
+		if (dedup_is_in_range(block))
+			dedup_reclaim_hint(block);
+
+		++reclaim_cursor;
+		++reclaim_scanned;
+	}
+
+	count = dedup_reclaim_count();
+	mutex_unlock(&reclaim_mutex);
+
+	return count;
+}
+
+static struct shrinker dedup_reclaim_shrinker = {
+	.shrink = dedup_reclaim_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+/*
+ * Turns reclaim hints on/off
+ */
+void dedup_set_reclaim_hints(int on)
+{
+	static int registered = 0;
+
+	if (on && !registered) {
+		register_shrinker(&dedup_reclaim_shrinker);
+		registered = 1;
+	}
+
+	// Start over with a new pass
+	mutex_lock(&reclaim_mutex);
+	reclaim_pass_redundant = 0;
+	reclaim_last_redundant = -1;
+	mutex_unlock(&reclaim_mutex);
+
+	reclaim_hints_on = on;
+}
+
+/*
+ * Prints reclaim hints statistics, used by stats_show()
+ */
+void dedup_print_reclaim_stats(void)
+{
+	printk(KERN_ERR "reclaim hints: scanned = %ld, activated = %ld, deactivated = %ld\n",
+		   reclaim_scanned, reclaim_activated, reclaim_deactivated);
+	printk(KERN_ERR "reclaim hints: redundant copies in last pass = %ld\n",
+		   reclaim_last_redundant);
+}
@@ -5,6 +5,7 @@
 #include <linux/init.h>
 #include <linux/genhd.h>
 #include <linux/buffer_head.h>
+#include <linux/jbd_common.h>
 #include <crypto/hash.h>
 #include <linux/scatterlist.h>
 #include <linux/bootmem.h>
@@ -16,6 +17,15 @@
 #include <linux/crc32.h>
 #include <linux/time.h>
 #include <linux/kdev_t.h>
+#include <linux/log2.h>
+#include <linux/vmalloc.h>
+#include <linux/hash.h>
+#include <linux/fs.h>
+#include <linux/pagemap.h>
+#include <linux/swap.h>
+#include <linux/swapops.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 
 static struct kobject *stats_kobj;
 static int collect_stats;
@@ -38,23 +48,91 @@ static sector_t duplicatedBlocks; // Number of duplicated blocks
 
 static int need_to_init = 2;
 static char* dedup_bdev_name = NULL;
-// Used for bdev compare, encoded value using MAJOR MINOR
-static u32 our_bdev_id = 0;
 
 static int dedup_bdev_name_len = 0;
 static struct block_device *dedup_bdev = NULL;
 
+// A block device of the dedup domain. Device 0 is our block device (setbd),
+// its blocks are the dedup range. The others are enrolled ('enrol'), with
+// their first nr_blocks blocks.
+struct dedup_dev {
+	char *name;					// enrolled devices only
+	// Used for bdev compare, encoded value using MAJOR MINOR
+	u32 bdev_id;
+	// Disk holding the device and where it starts on it, if it's a partition
+	u32 disk_id;
+	sector_t start_sect, nr_sects;
+	// Opened for reading while the domain exists, to look up its page cache
+	// and to send it reads redirected from the other devices
+	struct block_device *bdev;
+	// Superblock of the file system on the device, where the inodes of the
+	// block page references live. Pinned with s_count so it can be checked
+	// safely after umount, set on the first read.
+	struct super_block *sb;
+	// Swap type of the device (or of a swap file on it), -1 if not swap
+	int swap_type;
+	long nr_blocks;				// enrolled devices only
+	long index_base;			// index of the device's first block in blocksArray
+	// Statistics
+	atomic_long_t reads, writes, memory_reads, remote_blocks;
+};
+
+static struct dedup_dev dedup_devs[DEDUP_MAX_DEVS] = {
+	[0 ... DEDUP_MAX_DEVS - 1] = { .swap_type = -1 },
+};
+static int nr_dedup_devs = 1;
+// Number of blocks of all devices, the size of blocksArray in use
+static long total_blocks = 0;
+
+// Devices by the id a bio of theirs may carry, open addressed, so a bio is
+// matched without going over all the devices. An id is the device's own
+// (dev is its index) or the disk holding partitions of the domain (parts has
+// a bit per partition). Entries are added when devices are opened, before
+// the dedup structure is ready, and never removed.
+#define DEDUP_DEV_TABLE_SIZE (4 * DEDUP_MAX_DEVS)
+struct dedup_dev_id {
+	u32 id;						// 0 means a free entry
+	s8 dev;						// -1 if it's only a disk of partitions
+	u8 parts;
+};
+static struct dedup_dev_id dedup_dev_ids[DEDUP_DEV_TABLE_SIZE];
+
 // max blocks to allocate, the maximum kmalloc can afford is 128k.
 // This will be allocated by alloc_bootmem int start_kernel() init/main.c
 static const long BLOCKS_MAX_COUNT = (DEDUP_ALLOC_BOOTMEM_BSIZE / sizeof(u8*));
 
 static long equal_read_count = 0, total_read_count = 0;
+
+// Block read into each page, direct mapped by page pointer.
+// Used to find the block of a page that leaves the page cache.
+#define DEDUP_PAGE_RECS_BITS 16
+struct dedup_page_rec {
+	struct page *page;
+	struct address_space *mapping;
+	pgoff_t index;
+	sector_t block;
+};
+static struct dedup_page_rec *page_recs = NULL;
+static DEFINE_SPINLOCK(page_recs_lock);
+
+// Protects blocksArray.write_state updates
+static DEFINE_SPINLOCK(write_state_lock);
+// Free blocks not unlinked from their equal blocks yet
+static long free_linked_blocks = 0;
+
+// Scan statistics of pattern blocks vs. hashed blocks
+static long scan_pattern_count = 0, scan_hashed_count = 0;
+static u64 scan_pattern_ns = 0, scan_hashed_ns = 0;
+
+// Protects the devices' superblock pointers
+static DEFINE_SPINLOCK(dedup_sb_lock);
 // ------------------------ for tests ------------------------------
 void print_dedup_data_structure(void);
 // -----------------------------------------------------------------
 
 int calc_hash(char* data, size_t size, u8* hash_out);
 struct block_device* get_our_bdev(void);
+static int dedup_enroll_dev(const char *name, long nr_blocks);
 
 void dedup_add_total_read(void) { ++total_read_count; }
 void dedup_add_equal_read(void) { ++equal_read_count; }
@@ -66,7 +144,12 @@ void dedup_add_equal_read(void) { ++equal_read_count; }
 
 int dedup_is_in_range(sector_t block)
 {
-	int bInRange = 0, i;
+	int bInRange = 0, i, dev = DEDUP_BLOCK_DEV(block);
+
+	// Blocks of the enrolled devices are all in range once they're opened
+	if (dev)
+		return (dev < nr_dedup_devs && dedup_devs[dev].bdev &&
+				DEDUP_DEV_BLOCK(block) < dedup_devs[dev].nr_blocks);
 
 	if ((block >= start_block)  && (block < (start_block + blocks_count))) {
 		for (i = 0; i < nRangesCount; ++i)
@@ -95,7 +178,131 @@ int dedup_is_in_range(sector_t block)
 }*/
 
 /*
- * Check if bdev is the block device we use for dedup.
+ * Index of a block in range in blocksArray
+ */
+static long dedup_block_index(sector_t block)
+{
+	int dev = DEDUP_BLOCK_DEV(block);
+
+	if (!dev)
+		return block - start_block;
+
+	return dedup_devs[dev].index_base + DEDUP_DEV_BLOCK(block);
+}
+
+/*
+ * Block of an index of blocksArray
+ */
+static sector_t dedup_index_block(long index)
+{
+	int dev = nr_dedup_devs - 1;
+
+	while (dev && index < dedup_devs[dev].index_base)
+		--dev;
+
+	if (!dev)
+		return start_block + index;
+
+	return DEDUP_DEV_TO_BLOCK(dev, index - dedup_devs[dev].index_base);
+}
+
+/*
+ * Index of the block in the dedup structure, -1 if it's not in range
+ */
+long dedup_get_block_index(sector_t block)
+{
+	return (dedup_is_in_range(block)) ? dedup_block_index(block) : -1;
+}
+
+/*
+ * Block of an index of the dedup structure, from 0 to dedup_get_blocks_count()
+ */
+sector_t dedup_get_index_block(long index) { return dedup_index_block(index); }
+
+/*
+ * Returns the device table entry of the id, or the free entry where it goes
+ */
+static struct dedup_dev_id *dedup_dev_id_slot(u32 id)
+{
+	unsigned int i = hash_32(id, ilog2(DEDUP_DEV_TABLE_SIZE));
+	struct dedup_dev_id *e;
+
+	for (;; i = (i + 1) % DEDUP_DEV_TABLE_SIZE) {
+		e = &dedup_dev_ids[i];
+		if (!ACCESS_ONCE(e->id) || e->id == id)
+			return e;
+	}
+}
+
+/*
+ * Adds the opened device to the device table: its own id, and its disk's if
+ * it's a partition
+ */
+static void dedup_dev_id_add(struct dedup_dev *d)
+{
+	struct dedup_dev_id *e = dedup_dev_id_slot(d->bdev_id);
+
+	e->dev = d - dedup_devs;
+	if (!e->id) {
+		e->parts = 0;
+		smp_wmb();
+		e->id = d->bdev_id;
+	}
+
+	if (d->bdev == d->bdev->bd_contains)
+		return;
+
+	e = dedup_dev_id_slot(d->disk_id);
+	e->parts |= 1 << (d - dedup_devs);
+	if (!e->id) {
+		e->dev = -1;
+		smp_wmb();
+		e->id = d->disk_id;
+	}
+}
+
+/*
+ * Returns the device table entry of the id, or NULL if it's not in the domain
+ */
+static struct dedup_dev_id *dedup_dev_id_find(u32 id)
+{
+	struct dedup_dev_id *e = dedup_dev_id_slot(id);
+
+	if (!ACCESS_ONCE(e->id))
+		return NULL;
+
+	smp_rmb();
+	return e;
+}
+
+/*
+ * Returns the domain device of the block device, or NULL if it's not one
+ */
+static struct dedup_dev *dedup_find_dev(struct block_device *bdev)
+{
+	struct dedup_dev_id *e = dedup_dev_id_find(new_encode_dev(bdev->bd_dev));
+
+	return (e && e->dev >= 0) ? &dedup_devs[e->dev] : NULL;
+}
+
+/*
+ * Block number in the domain of a block of the device
+ */
+static sector_t dedup_dev_block(struct dedup_dev *d, sector_t block)
+{
+	return DEDUP_DEV_TO_BLOCK(d - dedup_devs, block);
+}
+
+/*
+ * First sector of the device in the domain
+ */
+static sector_t dedup_dev_sector_base(int dev)
+{
+	return (sector_t)dev << (DEDUP_DEV_BLOCK_BITS + ilog2(dedup_get_block_size()) - 9);
+}
+
+/*
+ * Check if bdev is a block device of the dedup domain.
  * Compare block device's encode value using MAJOR MINOR.
  */
 int dedup_is_our_bdev(struct block_device *bdev)
@@ -104,12 +311,91 @@ int dedup_is_our_bdev(struct block_device *bdev)
 
 	if (bdev == NULL)
 		printk("bdev is NULL, cannot compare\n");
-	else if (new_encode_dev(bdev->bd_dev) == our_bdev_id)
+	else if (dedup_find_dev(bdev))
 		res = 1;
 
 	return res;
 }
 
+/*
+ * Checks if the bio lands on a block device of the domain. A bio of the disk
+ * holding a partition (remapped by blk_partition_remap() or sent to the disk
+ * itself) that is inside the partition is moved back to it. The bio's sectors
+ * are then moved to the device's blocks in the domain, so they're ours.
+ * return 1 if the bio is ours
+ */
+int dedup_map_bio(struct bio *bio)
+{
+	struct dedup_dev_id *e = dedup_dev_id_find(new_encode_dev(bio->bi_bdev->bd_dev));
+	struct dedup_dev *d;
+	int i;
+
+	if (!e)
+		return 0;
+
+	// A disk holding partitions of the domain, look for the bio's partition
+	for (i = 0; e->parts && i < DEDUP_MAX_DEVS; ++i) {
+		d = &dedup_devs[i];
+		if ((e->parts & (1 << i)) && bio->bi_sector >= d->start_sect &&
+			bio->bi_sector + bio_sectors(bio) <= d->start_sect + d->nr_sects) {
+			bio->bi_sector -= d->start_sect;
+			bio->bi_bdev = d->bdev;
+			break;
+		}
+	}
+
+	if (!e->parts || i == DEDUP_MAX_DEVS) {
+		if (e->dev < 0)
+			return 0;
+		i = e->dev;
+	}
+
+	d = &dedup_devs[i];
+	bio->bi_sector += dedup_dev_sector_base(i);
+
+	if (bio->bi_rw & WRITE)
+		atomic_long_inc(&d->writes);
+	else if (bio_has_data(bio))
+		atomic_long_inc(&d->reads);
+
+	return 1;
+}
+
+/*
+ * Moves a bio that dedup_map_bio() moved to the domain back to its device,
+ * and to the disk if the device is a partition. A read may have been moved
+ * to equal blocks of another device meanwhile.
+ */
+void dedup_unmap_bio(struct bio *bio)
+{
+	int dev = bio->bi_sector >> (DEDUP_DEV_BLOCK_BITS + ilog2(dedup_get_block_size()) - 9);
+	struct dedup_dev *d = &dedup_devs[dev];
+
+	bio->bi_sector -= dedup_dev_sector_base(dev);
+	bio->bi_bdev = d->bdev;
+	if (d->bdev != d->bdev->bd_contains) {
+		bio->bi_sector += d->start_sect;
+		bio->bi_bdev = d->bdev->bd_contains;
+	}
+}
+
+/*
+ * A read starting at the block was served without I/O
+ */
+void dedup_dev_add_memory_read(sector_t block)
+{
+	atomic_long_inc(&dedup_devs[DEDUP_BLOCK_DEV(block)].memory_reads);
+}
+
+/*
+ * A read of the block was served with the data of an equal block on another
+ * device
+ */
+void dedup_dev_add_remote_block(sector_t block)
+{
+	atomic_long_inc(&dedup_devs[DEDUP_BLOCK_DEV(block)].remote_blocks);
+}
+
 /*
  * Will return a pointer to the block device, used for the dedup access.
  * The device is found by its name, configured in dedup_bdev_name.
@@ -123,45 +409,629 @@ struct block_device* get_our_bdev(void)
 	return ((bdev == NULL) ?NULL : blkdev_get_by_dev(bdev->bd_dev, FMODE_READ|FMODE_WRITE, NULL));
 }
 
+/*
+ * Reads one block from its device into page, waiting for it
+ */
+int dedup_read_block(sector_t block, struct page *page)
+{
+	size_t block_size = dedup_get_block_size();
+	struct dedup_dev *d = &dedup_devs[DEDUP_BLOCK_DEV(block)];
+	struct bio *bio;
+	int ret;
+
+	if (!dedup_is_in_range(block) || !d->bdev)
+		return -EINVAL;
+
+	bio = bio_alloc(GFP_KERNEL, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = d->bdev;
+	bio->bi_sector = DEDUP_DEV_BLOCK(block) * (block_size >> 9);
+	bio_add_page(bio, page, block_size, 0);
+	ret = submit_bio_wait(READ, bio);
+	bio_put(bio);
+
+	return ret;
+}
+
+/*
+ * Pins the superblock the device's block page references point to
+ */
+static void dedup_set_sb(struct dedup_dev *d, struct super_block *sb)
+{
+	struct super_block *old_sb;
+	unsigned long flags;
+
+	if (likely(sb == d->sb))
+		return;
+
+	spin_lock(&sb_lock);
+	sb->s_count++;
+	spin_unlock(&sb_lock);
+
+	spin_lock_irqsave(&dedup_sb_lock, flags);
+	old_sb = d->sb;
+	d->sb = sb;
+	spin_unlock_irqrestore(&dedup_sb_lock, flags);
+
+	// Unpin the old one, the file system was mounted again
+	if (old_sb) {
+		down_read(&old_sb->s_umount);
+		drop_super(old_sb);
+	}
+}
+
+/*
+ * Pins and read locks the device's superblock if it's still mounted, without
+ * waiting for umount, we may be called from reclaim. The superblock can't be
+ * freed meanwhile, dedup_set_sb() holds a reference on it.
+ * Released with drop_super().
+ */
+static struct super_block *dedup_grab_sb(struct dedup_dev *d)
+{
+	struct super_block *sb;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dedup_sb_lock, flags);
+	sb = d->sb;
+	if (sb && !down_read_trylock(&sb->s_umount))
+		sb = NULL;
+	if (sb) {
+		spin_lock(&sb_lock);
+		sb->s_count++;
+		spin_unlock(&sb_lock);
+	}
+	spin_unlock_irqrestore(&dedup_sb_lock, flags);
+
+	if (sb && (!sb->s_root || !(sb->s_flags & MS_BORN))) {
+		drop_super(sb);
+		sb = NULL;
+	}
+
+	return sb;
+}
+
+/*
+ * Dedup block holding the file's data at offset of the page at index, or -1
+ * if it's a hole or isn't one whole block of the device (file system blocks
+ * smaller than ours that are not contiguous). bmap() counts in file system
+ * blocks, not in pages.
+ * May sleep.
+ */
+static sector_t dedup_file_block(struct inode *inode, pgoff_t index, unsigned int offset)
+{
+	unsigned int blkbits = inode->i_blkbits, block_shift = ilog2(dedup_get_block_size());
+	u64 pos = ((u64)index << PAGE_CACHE_SHIFT) + offset;
+	sector_t fs_block = pos >> blkbits, first;
+	int i, n;
+
+	first = bmap(inode, fs_block);
+	if (!first)
+		return (sector_t)-1;
+
+	if (blkbits >= block_shift)
+		return (((u64)first << blkbits) + (pos & ((1ULL << blkbits) - 1))) >> block_shift;
+
+	// Our block spans several file system blocks
+	n = 1 << (block_shift - blkbits);
+	if ((pos & ((1ULL << block_shift) - 1)) || (first & (n - 1)))
+		return (sector_t)-1;
+	for (i = 1; i < n; ++i) {
+		if (bmap(inode, fs_block + i) != first + i)
+			return (sector_t)-1;
+	}
+
+	return first >> (block_shift - blkbits);
+}
+
+/*
+ * A buffer holds its block's data only while it's read, clean, not locked
+ * (being read or written) and not attached to a journal, which changes
+ * metadata in place before marking it dirty
+ */
+static int dedup_bh_stable(struct buffer_head *bh)
+{
+	return (buffer_uptodate(bh) && !buffer_dirty(bh) && !buffer_locked(bh) &&
+			!buffer_jbd(bh) && !buffer_jbddirty(bh));
+}
+
+/*
+ * Checks that the page still holds its block's data at offset before it's
+ * copied. Must be called with the page locked, so it can't be read, written
+ * back or lose its buffers meanwhile.
+ * return 1 if the data can be copied
+ */
+int dedup_block_data_stable(struct page *page, unsigned int offset)
+{
+	struct buffer_head *bh, *head;
+
+	if (!page_mapping(page) || !PageUptodate(page) || PageDirty(page) || PageWriteback(page))
+		return 0;
+
+	if (!page_has_buffers(page))
+		return 1;
+
+	// The buffers covering the block
+	bh = head = page_buffers(page);
+	do {
+		if (bh_offset(bh) + bh->b_size > offset &&
+			bh_offset(bh) < offset + dedup_get_block_size() && !dedup_bh_stable(bh))
+			return 0;
+		bh = bh->b_this_page;
+	} while (bh != head);
+
+	return 1;
+}
+
+/*
+ * Finds the block in the block device's own page cache, where buffer heads
+ * (metadata) and raw image reads land. Blocks smaller than a page are looked
+ * up as buffers. Pages and buffers under I/O or owned by a journal are
+ * skipped, the caller checks again with the page locked.
+ * The block's position is computed from the block, not taken from its page
+ * reference: a reference being moved from a file page may still hold the
+ * file's index.
+ */
+static struct page *dedup_get_bdev_block_data(sector_t block, unsigned int *offset)
+{
+	struct block_device *bdev = dedup_devs[DEDUP_BLOCK_DEV(block)].bdev;
+	size_t block_size = dedup_get_block_size();
+	struct buffer_head *bh;
+	struct page *res = NULL;
+
+	if (!bdev)
+		return NULL;
+
+	if (block_size == PAGE_SIZE) {
+		res = find_get_page(bdev->bd_inode->i_mapping, DEDUP_DEV_BLOCK(block));
+		if (res && (!PageUptodate(res) || PageDirty(res) || PageLocked(res) ||
+					PageWriteback(res))) {
+			page_cache_release(res);
+			res = NULL;
+		}
+		*offset = 0;
+		return res;
+	}
+
+	bh = __find_get_block(bdev, DEDUP_DEV_BLOCK(block), block_size);
+	if (bh) {
+		if (dedup_bh_stable(bh)) {
+			res = bh->b_page;
+			page_cache_get(res);
+			*offset = bh_offset(bh);
+		}
+		brelse(bh);
+	}
+
+	return res;
+}
+
+/*
+ * Finds the swap cache page of the swap slot. It's a copy of the block only
+ * as long as it's clean and still in the swap cache for this slot.
+ */
+static struct page *dedup_get_swap_block_data(struct dedup_dev *d, pgoff_t swap_offset,
+											  unsigned int *offset)
+{
+	swp_entry_t entry;
+	struct page *res;
+
+	if (d->swap_type < 0)
+		return NULL;
+
+	entry = swp_entry(d->swap_type, swap_offset);
+	res = find_get_page(swap_address_space(entry), entry.val);
+	if (res && (!PageSwapCache(res) || page_private(res) != entry.val ||
+				!PageUptodate(res) || PageDirty(res))) {
+		page_cache_release(res);
+		res = NULL;
+	}
+
+	*offset = 0;
+	return res;
+}
+
 /**
- * get the page associated with the block inside our dedup structure
+ * get a resident copy of the block's data: the page holding it, with an
+ * elevated reference count, and the data's offset inside the page.
+ * Pages are looked up in the page cache by their inode and index, so a page
+ * that was freed or reused since the block was read is never returned.
+ * Dirty copies don't hold the data we hashed and are never returned either.
+ * Pages of files are looked up by ilookup() and bmap(), which may sleep on
+ * I/O: without may_sleep (bio submit path, inside generic_make_request())
+ * only the block device's page cache, which we hold open, and the swap cache
+ * are looked up, with find_get_page().
  */
-struct page* dedup_get_block_page(sector_t block)
+struct page *dedup_get_block_data(sector_t block, unsigned int *offset, int may_sleep)
 {
+	struct dedup_dev *d = &dedup_devs[DEDUP_BLOCK_DEV(block)];
+	struct dedup_page_ref ref;
+	struct super_block *sb;
+	struct inode *inode;
 	struct page *res = NULL;
 
 	// Check if the block is inside our range
-	if (dedup_is_in_range(block)) {
-		// Get the page pointer stored inside the dedup structure
-		res = blocksArray.pages[block - start_block];
-		if (res != NULL) {
-			// If its not NULL, check if the page is up to date and used
-			if (PageLRU(res) && PageUptodate(res)) {
-				page_cache_get(res);
-			}
-			else {
-				// Cannot use page, need to read from bdev
-				blocksArray.pages[block - start_block] = NULL;
-				res = NULL;
-			}
+	if (!dedup_is_in_range(block)) {
+		printk("get_block_page: block not in range.\n");
+		return NULL;
+	}
+
+	// A page of a block being written doesn't hold its hashed content
+	ref = blocksArray.page_refs[dedup_block_index(block)];
+	if (!ref.ino || blocksArray.write_state[dedup_block_index(block)])
+		return NULL;
+
+	// Read through the block device's page cache (buffer heads, raw images)
+	if (ref.ino == DEDUP_BDEV_INO)
+		return dedup_get_bdev_block_data(block, offset);
+
+	// Swapped in page
+	if (ref.ino == DEDUP_SWAP_INO)
+		return dedup_get_swap_block_data(d, ref.index, offset);
+
+	if (!may_sleep)
+		return NULL;
+
+	sb = dedup_grab_sb(d);
+	if (!sb)
+		return NULL;
+
+	inode = ilookup(sb, ref.ino);
+	if (inode) {
+		res = find_get_page(inode->i_mapping, ref.index);
+		// The page must be read and clean, and the file must still hold the
+		// block there
+		if (res && (!PageUptodate(res) || PageDirty(res) ||
+					dedup_file_block(inode, ref.index, 0) != DEDUP_DEV_BLOCK(block))) {
+			page_cache_release(res);
+			res = NULL;
 		}
+		iput(inode);
 	}
-	else
-		printk("get_block_page: block not in range.\n");
+	drop_super(sb);
 
+	*offset = 0;
 	return res;
 }
 
+/**
+ * get the page associated with the block inside our dedup structure.
+ * May sleep.
+ */
+struct page* dedup_get_block_page(sector_t block)
+{
+	unsigned int offset;
+
+	return dedup_get_block_data(block, &offset, 1);
+}
+
+/*
+ * Converts a bio sector into a dedup block number
+ */
+sector_t dedup_sector_to_block(sector_t sector)
+{
+	return sector >> (ilog2(dedup_get_block_size()) - 9);
+}
+
+/*
+ * Copies block's hash and crc into the given buffers.
+ * return 1 if the block has a valid hash
+ */
+int dedup_get_block_hash(sector_t block, u8 *hash_out, u32 *crc_out)
+{
+	if (!dedup_is_in_range(block))
+		return 0;
+
+	block = dedup_block_index(block);
+	// A block being written has no known content
+	if (blocksArray.hashes[block] == NULL || blocksArray.write_state[block])
+		return 0;
+
+	memcpy(hash_out, blocksArray.hashes[block], SHA256_DIGEST_SIZE);
+	*crc_out = blocksArray.hash_crc[block];
+
+	return 1;
+}
+
+/*
+ * return 1 if the block is linked to at least one equal block
+ */
+int dedup_block_has_duplicates(sector_t block)
+{
+	if (!dedup_is_in_range(block))
+		return 0;
+
+	block = dedup_block_index(block);
+	return (blocksArray.equal_blocks[block] != block && !blocksArray.write_state[block]);
+}
+
+/*
+ * return 1 if the block's hash is its content: no write is pending on it
+ * and it's not unknown
+ */
+int dedup_block_is_known(sector_t block)
+{
+	return (dedup_is_in_range(block) && !blocksArray.write_state[dedup_block_index(block)]);
+}
+
+/*
+ * Checks if the data is one machine word repeated, like a zeroed block.
+ * The words of each cache line are or'ed together and checked once per line,
+ * so most data that is not a pattern is rejected at the first line.
+ * return 1 and the word if it is
+ */
+int dedup_data_pattern(const void *data, size_t size, unsigned long *word)
+{
+	const unsigned long *p = data, *end = p + size / sizeof(unsigned long);
+	unsigned long w = *p, diff;
+
+	for (; p < end; p += 8) {
+		diff = (p[0] ^ w) | (p[1] ^ w) | (p[2] ^ w) | (p[3] ^ w) |
+			(p[4] ^ w) | (p[5] ^ w) | (p[6] ^ w) | (p[7] ^ w);
+		if (diff)
+			return 0;
+	}
+
+	*word = w;
+	return 1;
+}
+// Used by the dedup target, which may be a module
+EXPORT_SYMBOL_GPL(dedup_data_pattern);
+
+/*
+ * return 1 and the block's word if it's known to be a pattern block
+ */
+int dedup_get_block_pattern(sector_t block, unsigned long *word)
+{
+	if (!dedup_is_in_range(block))
+		return 0;
+
+	block = dedup_block_index(block);
+	if (!blocksArray.pattern[block] || blocksArray.write_state[block] ||
+		blocksArray.hashes[block] == NULL)
+		return 0;
+
+	memcpy(word, blocksArray.hashes[block], sizeof(*word));
+	return 1;
+}
+
+/*
+ * Pattern blocks are not hashed, their hash buffer holds the word followed by
+ * zeros and a marker, which no sha256 of real data is expected to be
+ */
+static void dedup_pattern_hash(unsigned long word, u8 *hash)
+{
+	memset(hash, 0, SHA256_DIGEST_SIZE);
+	memcpy(hash, &word, sizeof(word));
+	hash[SHA256_DIGEST_SIZE - 1] = 0xff;
+}
+
+/*
+ * A write of the block was submitted, its content is not known until the
+ * write is hashed. An unknown block becomes pending.
+ * The count only saturates with more writes of one block in flight than a
+ * queue ever holds. A saturated block stays pending for good, ends don't
+ * count down writes whose start wasn't counted.
+ */
+void dedup_block_write_start(sector_t block)
+{
+	unsigned long flags;
+	u16 *state;
+
+	if (!dedup_is_in_range(block))
+		return;
+
+	// Data being read back for a rehash is not the block's content anymore
+	state = &blocksArray.write_state[dedup_block_index(block)];
+	spin_lock_irqsave(&write_state_lock, flags);
+	if (*state > DEDUP_BLOCK_MAX_PENDING)
+		*state = 1;
+	else if (*state < DEDUP_BLOCK_MAX_PENDING)
+		++*state;
+	spin_unlock_irqrestore(&write_state_lock, flags);
+}
+
+/*
+ * return the number of writes pending on the block
+ */
+int dedup_block_write_pending(sector_t block)
+{
+	u16 state;
+
+	if (!dedup_is_in_range(block))
+		return 0;
+
+	state = blocksArray.write_state[dedup_block_index(block)];
+	return (state > DEDUP_BLOCK_MAX_PENDING) ? 0 : state;
+}
+
+/*
+ * A write of the block was processed. known is 0 if the block's content
+ * could not be hashed, and it's left unknown if no other write is pending.
+ */
+void dedup_block_write_end(sector_t block, int known)
+{
+	unsigned long flags;
+	u16 *state;
+
+	if (!dedup_is_in_range(block))
+		return;
+
+	state = &blocksArray.write_state[dedup_block_index(block)];
+	spin_lock_irqsave(&write_state_lock, flags);
+	if (*state && *state < DEDUP_BLOCK_MAX_PENDING && --*state == 0 && !known)
+		*state = DEDUP_BLOCK_UNKNOWN;
+	spin_unlock_irqrestore(&write_state_lock, flags);
+}
+
+/*
+ * An unknown block's data is about to be read back and hashed.
+ * return 1 if the block is unknown and is now being rehashed
+ */
+int dedup_block_rehash_start(sector_t block)
+{
+	unsigned long flags;
+	u16 *state;
+	int ret = 0;
+
+	if (!dedup_is_in_range(block))
+		return 0;
+
+	state = &blocksArray.write_state[dedup_block_index(block)];
+	spin_lock_irqsave(&write_state_lock, flags);
+	if (*state == DEDUP_BLOCK_UNKNOWN) {
+		*state = DEDUP_BLOCK_REHASH;
+		ret = 1;
+	}
+	spin_unlock_irqrestore(&write_state_lock, flags);
+
+	return ret;
+}
+
+/*
+ * return 1 if the block is being rehashed and no write came meanwhile
+ */
+int dedup_block_is_rehashing(sector_t block)
+{
+	return (dedup_is_in_range(block) &&
+			blocksArray.write_state[dedup_block_index(block)] == DEDUP_BLOCK_REHASH);
+}
+
+/*
+ * The block's data was read back, known is 0 if it could not be hashed.
+ * return 1 if the block is known now
+ */
+int dedup_block_rehash_end(sector_t block, int known)
+{
+	unsigned long flags;
+	u16 *state;
+	int ret = 0;
+
+	if (!dedup_is_in_range(block))
+		return 0;
+
+	// A write that came meanwhile decides the block's content
+	state = &blocksArray.write_state[dedup_block_index(block)];
+	spin_lock_irqsave(&write_state_lock, flags);
+	if (*state == DEDUP_BLOCK_REHASH) {
+		*state = (known) ? 0 : DEDUP_BLOCK_UNKNOWN;
+		ret = known;
+	}
+	spin_unlock_irqrestore(&write_state_lock, flags);
+
+	return ret;
+}
+
+/*
+ * Bulk dedup_block_write_start() of nr blocks from block, taking the lock once
+ */
+void dedup_blocks_write_start(sector_t block, long nr)
+{
+	unsigned long flags;
+	u16 *state;
+	long i;
+
+	spin_lock_irqsave(&write_state_lock, flags);
+	for (i = 0; i < nr; ++i) {
+		if (!dedup_is_in_range(block + i))
+			continue;
+
+		// Saturates like dedup_block_write_start()
+		state = &blocksArray.write_state[dedup_block_index(block + i)];
+		if (*state > DEDUP_BLOCK_MAX_PENDING)
+			*state = 1;
+		else if (*state < DEDUP_BLOCK_MAX_PENDING)
+			++*state;
+	}
+	spin_unlock_irqrestore(&write_state_lock, flags);
+}
+
+/*
+ * A discard of nr blocks from block completed. Blocks with no other write
+ * pending become free, they stay in their equal blocks ring until
+ * dedup_unlink_free_blocks() and are skipped like unknown blocks.
+ * Callers must serialize updates of the dedup structure.
+ * return the number of blocks that became free
+ */
+long dedup_blocks_discard_end(sector_t block, long nr)
+{
+	unsigned long flags;
+	sector_t b;
+	long i, freed = 0;
+	u16 *state;
+
+	spin_lock_irqsave(&write_state_lock, flags);
+	for (i = 0; i < nr; ++i) {
+		if (!dedup_is_in_range(block + i))
+			continue;
+
+		b = dedup_block_index(block + i);
+		state = &blocksArray.write_state[b];
+		if (!*state || *state >= DEDUP_BLOCK_MAX_PENDING || --*state)
+			continue;
+
+		*state = DEDUP_BLOCK_FREE;
+		++freed;
+		if (blocksArray.equal_blocks[b] != b)
+			++free_linked_blocks;
+	}
+	spin_unlock_irqrestore(&write_state_lock, flags);
+
+	return freed;
+}
+
+/*
+ * Number of free blocks still linked to their old equal blocks
+ */
+long dedup_get_free_linked_blocks(void) { return free_linked_blocks; }
+
+/*
+ * Number of blocks of the dedup structure, of all the domain's devices
+ */
+long dedup_get_blocks_count(void) { return total_blocks; }
+
+/*
+ * Returns the number of blocks with the same content as the block,
+ * counting up to max blocks
+ */
+int dedup_get_class_size(sector_t block, int max)
+{
+	sector_t next;
+	int size = 1;
+
+	if (!dedup_is_in_range(block))
+		return 0;
+
+	block = dedup_block_index(block);
+	next = blocksArray.equal_blocks[block];
+	while (next != block && size < max) {
+		next = blocksArray.equal_blocks[next];
+		++size;
+	}
+
+	return size;
+}
+
+/*
+ * Returns the block device holding the block
+ */
+dev_t dedup_get_block_dev(sector_t block)
+{
+	return new_decode_dev(dedup_devs[DEDUP_BLOCK_DEV(block)].bdev_id);
+}
+
 /*
  * Uses kernel's function to read sector's data to read the requested block
+ * of the block device
  */
-void read_block(char *dest, size_t size, sector_t block)
+void read_block(struct block_device *bdev, char *dest, size_t size, sector_t block)
 {
 	// Sector size is 512, so we calculate the block's sector index
 	sector_t sector = block * (dedup_get_block_size() / 512);
 	Sector sect;
 	// Read data
-	void *tmp = read_dev_sector(dedup_bdev, sector, &sect);
+	void *tmp = read_dev_sector(bdev, sector, &sect);
 
 	if (!tmp) {
 		printk(KERN_ERR "failed to read sector.\n");
@@ -173,6 +1043,68 @@ void read_block(char *dest, size_t size, sector_t block)
 	put_dev_sector(sect);
 }
 
+/*
+ * Prints the scan time of pattern blocks vs. hashed blocks
+ */
+static void dedup_print_scan_stats(void)
+{
+	u64 pattern_avg = 0, hashed_avg = 0, saved_ns = 0;
+
+	if (scan_pattern_count)
+		pattern_avg = div64_u64(scan_pattern_ns, scan_pattern_count);
+	if (scan_hashed_count)
+		hashed_avg = div64_u64(scan_hashed_ns, scan_hashed_count);
+	if (hashed_avg > pattern_avg)
+		saved_ns = (hashed_avg - pattern_avg) * scan_pattern_count;
+
+	printk(KERN_ERR "scan: pattern blocks = %ld (%llu ns/block), hashed blocks = %ld (%llu ns/block), "
+		   "~%llu ms saved\n",
+		   scan_pattern_count, pattern_avg, scan_hashed_count, hashed_avg,
+		   div64_u64(saved_ns, NSEC_PER_MSEC));
+}
+
+/*
+ * Prints the statistics of each device of the domain: its duplicated blocks,
+ * how many of them have an equal block on another device, and its reads
+ */
+static void dedup_print_dev_stats(void)
+{
+	long duplicated[DEDUP_MAX_DEVS] = {0}, shared[DEDUP_MAX_DEVS] = {0};
+	sector_t next;
+	long i;
+	int dev, walk;
+
+	for (i = 0; !need_to_init && i < total_blocks; ++i) {
+		if (blocksArray.equal_blocks[i] == i)
+			continue;
+
+		dev = DEDUP_BLOCK_DEV(dedup_index_block(i));
+		++duplicated[dev];
+		next = blocksArray.equal_blocks[i];
+		for (walk = 0; next != i && walk < DEDUP_CLASS_SIZE_MAX_WALK; ++walk) {
+			if (DEDUP_BLOCK_DEV(dedup_index_block(next)) != dev) {
+				++shared[dev];
+				break;
+			}
+			next = blocksArray.equal_blocks[next];
+		}
+	}
+
+	for (dev = 0; dev < nr_dedup_devs; ++dev) {
+		struct dedup_dev *d = &dedup_devs[dev];
+
+		printk(KERN_ERR "dev %d:%d (%s): blocks = %ld, duplicated = %ld, shared with other devices = %ld\n",
+			   MAJOR(new_decode_dev(d->bdev_id)), MINOR(new_decode_dev(d->bdev_id)),
+			   (dev) ? d->name : ((dedup_bdev_name) ? dedup_bdev_name : DEDUP_BDEV_NAME),
+			   (dev) ? d->nr_blocks : blocks_count, duplicated[dev], shared[dev]);
+		printk(KERN_ERR "dev %d:%d reads = %ld (from memory = %ld), writes = %ld, "
+			   "blocks read from other devices = %ld\n",
+			   MAJOR(new_decode_dev(d->bdev_id)), MINOR(new_decode_dev(d->bdev_id)),
+			   atomic_long_read(&d->reads), atomic_long_read(&d->memory_reads),
+			   atomic_long_read(&d->writes), atomic_long_read(&d->remote_blocks));
+	}
+}
+
 /*
  * The "stats" file where a statistics is read from.
  */
@@ -182,8 +1114,17 @@ static ssize_t stats_show(struct kobject *kobj, struct kobj_attribute *attr,
 	int stats = 0;
 	printk(KERN_ERR "**************************** STATS *****************************\n");
 	printk(KERN_ERR "total duplicated blocks = %ld\n", duplicatedBlocks);
+	dedup_print_scan_stats();
+	dedup_print_dev_stats();
 	printk(KERN_ERR "equal read = %ld\n", equal_read_count);
 	printk(KERN_ERR "total read = %ld\n", total_read_count);
+	dedup_print_read_stats();
+	dedup_print_write_stats();
+	dedup_print_cache_stats();
+	dedup_print_zpool_stats();
+	dedup_print_reclaim_stats();
+	dedup_print_heat_stats();
+	dedup_print_class_stats();
 	printk(KERN_ERR "**************************** STATS *****************************\n");
 
 	return sprintf(buf, "%d\n", stats);
@@ -196,6 +1137,11 @@ size_t dedup_get_block_size(void)
 {
 	static size_t block_size = 4096;
 
+	// Block size can't change once the dedup structure was built, and the
+	// read/write hooks call us for every bio - don't reopen the device.
+	if (!need_to_init)
+		return block_size;
+
 	if (dedup_bdev == NULL) {
 		// Get block device
 		dedup_bdev = get_our_bdev();
@@ -238,7 +1184,7 @@ void print_block(int block_num)
 		return;
 	}
 
-	read_block(curr_data, block_size, block_num);
+	read_block(dedup_bdev, curr_data, block_size, block_num);
 
 	// Print block
 	printk("block no.%d: \"%s\"\n", block_num, curr_data);
@@ -252,9 +1198,22 @@ void print_block(int block_num)
 * Input help function, used to handle several commands:
 * 'block 12345' sets start block to be 12345.
 * 'setbd /dev/sda2' sets the block device to work on
+* 'enrol /dev/sdb1 65536' adds the first 65536 blocks of sdb1 to the dedup domain, before 'dedup'
 * 'dedup 12' performs blocks read and compare on 12 blocks starting from start_block.
 * 'print 123' prints block 123 content
 * 'print tree' prints all dedup structure
+* 'redir seek' redirects reads to the closest equal block, 'redir off' stops
+* 'redir load' redirects reads to the equal block on the least busy device
+* 'cache 1024' caches up to 1024 duplicated blocks, 'cache 0' drops the cache
+* 'zpool 8192' keeps up to 8192KB of compressed evicted pages, 'zpool 0' drops them
+*   (pages of file systems mounted after the first 'zpool <KB>' only)
+* 'rclm on' gives reclaim hints about duplicated pages, 'rclm off' stops
+* 'warm 65536 pin' prewarms up to 64MB of the hot blocks written to the hot file
+* 'bench 1000 100000' times 100000 lookups of a cached page equal to block 1000
+* 'odir on' serves O_DIRECT reads from memory too, 'odir off' stops
+* 'swap on' serves swap-in reads from memory too, 'swap off' stops
+* 'same on' completes writes of the content already on disk without writing, 'same off' stops
+* 'churn 32' stops hashing regions written more than 32 times a second, 'churn 0' never stops
 */
 long check_input(const char *buffer)
 {
@@ -271,84 +1230,225 @@ long check_input(const char *buffer)
 				/* stop command */
 				n = 0;
 			}
-			else if (sscanf (op, "%ld", &n) == 1) {
-				/* set block count */
-				if (n == 0)
-					n = -2;
+			else if (sscanf (op, "%ld", &n) == 1) {
+				/* set block count */
+				if (n == 0)
+					n = -2;
+			}
+			else
+				/* invalid input */
+				n = -2;
+		}
+		else if (strncmp ("block", dedup, 5) == 0) {
+			if (sscanf (op, "%ld", &n) == 1) {
+				start_block = n;
+				printk(KERN_ERR "start_block = %lu.\n", start_block);
+				n = -1;
+			}
+			else
+				/* invalid input */
+				n = -2;
+		}
+		else if (strncmp ("setbd", dedup, 5) == 0) {
+			kfree(dedup_bdev_name);
+
+			dedup_bdev_name_len = strlen(op);
+			// +1 for \0
+			dedup_bdev_name = kmalloc(dedup_bdev_name_len + 1, GFP_KERNEL);
+			if (!dedup_bdev_name) {
+				printk("dedup_bdev_name allocation failed.\n");
+				return -2;
+			}
+
+			memcpy(dedup_bdev_name, op, dedup_bdev_name_len);
+			dedup_bdev_name[dedup_bdev_name_len] = 0;
+			printk("dedup_bdev_name = %s, len = %d.\n", dedup_bdev_name, dedup_bdev_name_len);
+			n = -1;
+		}
+		else if (strncmp ("enrol", dedup, 5) == 0) {
+			// Paths don't fit in op, the line is parsed again (PATH_MAX - 1)
+			char *path = kmalloc(PATH_MAX, GFP_KERNEL);
+			long nr_blocks;
+			if (path && sscanf (buffer, "%*s %4095s %ld", path, &nr_blocks) == 2 &&
+				nr_blocks > 0 && !dedup_enroll_dev(path, nr_blocks))
+				n = -1;
+			else
+				/* invalid input */
+				n = -2;
+			kfree(path);
+		}
+		else if (strncmp ("print", dedup, 5) == 0) {
+			// print block!!!!!!! - DEBUG
+			if (sscanf (op, "%ld", &n) == 1) {
+				printk(KERN_ERR "printing block %ld.\n", n);
+				print_block(n);
+				n = -1;
+			}
+			else if (strncmp ("tree", op, 4) == 0) {
+				/* print tree command */
+				print_dedup_data_structure();
+				n = -1;
+			}
+			else if (strncmp ("bdev", op, 4) == 0) {
+				/* print block device name command */
+				int i;
+				printk("dedup_bdev_name = %s, len = %d.\n", dedup_bdev_name, dedup_bdev_name_len);
+				for (i = 1; i < nr_dedup_devs; ++i)
+					printk("enrolled %s, %ld blocks.\n", dedup_devs[i].name,
+						   dedup_devs[i].nr_blocks);
+				n = -1;
+			}
+			else if (strncmp ("ranges", op, 6) == 0) {
+				int i;
+				for (i = 0; i < nRangesCount; ++i)
+					printk("%ld-%ld\n", arrOurBlocks[i].start, arrOurBlocks[i].end);
+				n = -1;
+			}
+			else
+				/* invalid input */
+				n = -2;
+		}
+		else if (strncmp ("count", dedup, 5) == 0) {
+			if (sscanf (op, "%ld", &n) == 1) {
+				long int i = 0, count = 0;
+				printk("%ld -> %ld\n", n*1000, (n+1)*1000);
+				for (i = n*1000; 
+					 (i < total_blocks) && (i < ((n+1)*1000)); 
+					++i){
+					if (blocksArray.equal_blocks[i] != i) {
+						++count;
+						printk("%llu-%llu ", (unsigned long long)dedup_index_block(i),
+							   (unsigned long long)dedup_index_block(blocksArray.equal_blocks[i]));
+					}
+				}
+
+				printk("\ntotal duplicated block: %ld\n", count);
+				n = -1;
+			}
+		}
+		else if (strncmp ("redir", dedup, 5) == 0) {
+			if (strncmp ("seek", op, 4) == 0) {
+				dedup_set_redirect_mode(DEDUP_REDIRECT_SEEK);
+				n = -1;
+			}
+			else if (strncmp ("load", op, 4) == 0) {
+				dedup_set_redirect_mode(DEDUP_REDIRECT_LOAD);
+				n = -1;
+			}
+			else if (strncmp ("off", op, 3) == 0) {
+				dedup_set_redirect_mode(DEDUP_REDIRECT_OFF);
+				n = -1;
+			}
+			else
+				/* invalid input */
+				n = -2;
+		}
+		else if (strncmp ("cache", dedup, 5) == 0) {
+			long max_blocks;
+			if (sscanf (op, "%ld", &max_blocks) == 1 && max_blocks >= 0) {
+				dedup_cache_set_size(max_blocks);
+				printk("cache size = %ld blocks.\n", max_blocks);
+				n = -1;
+			}
+			else
+				/* invalid input */
+				n = -2;
+		}
+		else if (strncmp ("zpool", dedup, 5) == 0) {
+			long max_kb;
+			if (sscanf (op, "%ld", &max_kb) == 1 && max_kb >= 0) {
+				dedup_zpool_set_size(max_kb);
+				printk("zpool size = %ld KB.\n", max_kb);
+				n = -1;
+			}
+			else
+				/* invalid input */
+				n = -2;
+		}
+		else if (strncmp ("rclm", dedup, 5) == 0) {
+			if (strncmp ("on", op, 2) == 0) {
+				dedup_set_reclaim_hints(DEDUP_ON);
+				n = -1;
+			}
+			else if (strncmp ("off", op, 3) == 0) {
+				dedup_set_reclaim_hints(DEDUP_OFF);
+				n = -1;
 			}
 			else
 				/* invalid input */
 				n = -2;
 		}
-		else if (strncmp ("block", dedup, 5) == 0) {
-			if (sscanf (op, "%ld", &n) == 1) {
-				start_block = n;
-				printk(KERN_ERR "start_block = %lu.\n", start_block);
+		else if (strncmp ("warm", dedup, 5) == 0) {
+			long budget_kb;
+			if (sscanf (op, "%ld", &budget_kb) == 1 && budget_kb >= 0) {
+				int pin = (params == 3 && strncmp ("pin", op2, 3) == 0);
+				dedup_set_prewarm(budget_kb, pin);
+				printk("prewarm budget = %ld KB%s.\n", budget_kb, (pin) ? ", pinned" : "");
 				n = -1;
 			}
 			else
 				/* invalid input */
 				n = -2;
 		}
-		else if (strncmp ("setbd", dedup, 5) == 0) {
-			kfree(dedup_bdev_name);
-
-			dedup_bdev_name_len = strlen(op);
-			// +1 for \0
-			dedup_bdev_name = kmalloc(dedup_bdev_name_len + 1, GFP_KERNEL);
-			if (!dedup_bdev_name) {
-				printk("dedup_bdev_name allocation failed.\n");
-				return -2;
+		else if (strncmp ("odir", dedup, 5) == 0) {
+			if (strncmp ("on", op, 2) == 0) {
+				dedup_set_direct_reads(DEDUP_ON);
+				n = -1;
 			}
-
-			memcpy(dedup_bdev_name, op, dedup_bdev_name_len);
-			dedup_bdev_name[dedup_bdev_name_len] = 0;
-			printk("dedup_bdev_name = %s, len = %d.\n", dedup_bdev_name, dedup_bdev_name_len);
-			n = -1;
+			else if (strncmp ("off", op, 3) == 0) {
+				dedup_set_direct_reads(DEDUP_OFF);
+				n = -1;
+			}
+			else
+				/* invalid input */
+				n = -2;
 		}
-		else if (strncmp ("print", dedup, 5) == 0) {
-			// print block!!!!!!! - DEBUG
-			if (sscanf (op, "%ld", &n) == 1) {
-				printk(KERN_ERR "printing block %ld.\n", n);
-				print_block(n);
+		else if (strncmp ("swap", dedup, 5) == 0) {
+			if (strncmp ("on", op, 2) == 0) {
+				dedup_set_swap_reads(DEDUP_ON);
 				n = -1;
 			}
-			else if (strncmp ("tree", op, 4) == 0) {
-				/* print tree command */
-				print_dedup_data_structure();
+			else if (strncmp ("off", op, 3) == 0) {
+				dedup_set_swap_reads(DEDUP_OFF);
 				n = -1;
 			}
-			else if (strncmp ("bdev", op, 4) == 0) {
-				/* print block device name command */
-				printk("dedup_bdev_name = %s, len = %d.\n", dedup_bdev_name, dedup_bdev_name_len);
+			else
+				/* invalid input */
+				n = -2;
+		}
+		else if (strncmp ("same", dedup, 5) == 0) {
+			if (strncmp ("on", op, 2) == 0) {
+				dedup_set_same_writes(DEDUP_ON);
 				n = -1;
 			}
-			else if (strncmp ("ranges", op, 6) == 0) {
-				int i;
-				for (i = 0; i < nRangesCount; ++i)
-					printk("%ld-%ld\n", arrOurBlocks[i].start, arrOurBlocks[i].end);
+			else if (strncmp ("off", op, 3) == 0) {
+				dedup_set_same_writes(DEDUP_OFF);
 				n = -1;
 			}
 			else
 				/* invalid input */
 				n = -2;
 		}
-		else if (strncmp ("count", dedup, 5) == 0) {
-			if (sscanf (op, "%ld", &n) == 1) {
-				long int i = 0, count = 0;
-				printk("%ld -> %ld\n", n*1000, (n+1)*1000);
-				for (i = n*1000; 
-					 (i < blocks_count) && (i < ((n+1)*1000)); 
-					++i){
-					if (blocksArray.equal_blocks[i] != i) {
-						++count;
-						printk("%ld-%ld ", i+start_block, blocksArray.equal_blocks[i]+start_block);
-					}
-				}
-
-				printk("\ntotal duplicated block: %ld\n", count);
+		else if (strncmp ("churn", dedup, 5) == 0) {
+			int max_writes;
+			if (sscanf (op, "%d", &max_writes) == 1 && max_writes >= 0) {
+				dedup_set_churn(max_writes);
+				n = -1;
+			}
+			else
+				/* invalid input */
+				n = -2;
+		}
+		else if (strncmp ("bench", dedup, 5) == 0) {
+			long block, iterations;
+			if (params == 3 && sscanf (op, "%ld", &block) == 1 &&
+				sscanf (op2, "%ld", &iterations) == 1 && !dedup_wait_for_init()) {
+				dedup_class_bench(block, iterations);
 				n = -1;
 			}
+			else
+				/* invalid input */
+				n = -2;
 		}
 		else if (strncmp ("range", dedup, 5) == 0) {
 			long start, end;
@@ -418,9 +1518,28 @@ static ssize_t stats_store(struct kobject *kobj, struct kobj_attribute *attr,
 static struct kobj_attribute stats_attribute =
     __ATTR(stats, 0666, stats_show, stats_store);
 
+/*
+ * The "hot" file lists the hottest duplicated blocks, writing a saved list
+ * prewarms them.
+ */
+static ssize_t hot_show(struct kobject *kobj, struct kobj_attribute *attr,
+						char *buf)
+{
+	return dedup_heat_show(buf);
+}
+
+static ssize_t hot_store(struct kobject *kobj, struct kobj_attribute *attr,
+						 const char *buf, size_t count)
+{
+	return dedup_heat_store(buf, count);
+}
+
+static struct kobj_attribute hot_attribute =
+    __ATTR(hot, 0644, hot_show, hot_store);
 
 static struct attribute *attrs[] = {
     &stats_attribute.attr,
+    &hot_attribute.attr,
     NULL,
 };
 
@@ -439,16 +1558,20 @@ int __init dedup_init(void)
 
 	printk("********************* Dedup Init ******************************\n");
 
-	if (!blocksArray.hashes && !blocksArray.pages && !blocksArray.equal_blocks)
+	if (!blocksArray.hashes && !blocksArray.page_refs && !blocksArray.equal_blocks)
 	{
 		blk_info_alloc_size = DEDUP_ALLOC_BOOTMEM_BSIZE;
 		printk("allocating %lu bytes in bootmem.\n", blk_info_alloc_size);
 		blocksArray.hashes = (u8**)alloc_bootmem(blk_info_alloc_size);
-		blocksArray.pages = (struct page **)alloc_bootmem(blk_info_alloc_size);
+		blocksArray.page_refs = (struct dedup_page_ref *)alloc_bootmem(
+				BLOCKS_MAX_COUNT * sizeof(struct dedup_page_ref));
 		blocksArray.equal_blocks = (sector_t *)alloc_bootmem(blk_info_alloc_size);
 		blocksArray.hash_crc = (u32 *)alloc_bootmem(blk_info_alloc_size);
+		blocksArray.write_state = (u16 *)alloc_bootmem(BLOCKS_MAX_COUNT * sizeof(u16));
+		blocksArray.pattern = (u8 *)alloc_bootmem(BLOCKS_MAX_COUNT);
 
-		if (!blocksArray.hashes || !blocksArray.pages || !blocksArray.equal_blocks) {
+		if (!blocksArray.hashes || !blocksArray.page_refs || !blocksArray.equal_blocks ||
+			!blocksArray.write_state || !blocksArray.pattern) {
 			printk(KERN_ERR "dedup_sysfs.c: failed to allocate blocks array.\n");
 			return -1;
 		}
@@ -485,11 +1608,114 @@ static int __init stats_init(void)
 	return retval;
 }
 
+/*
+ * Enrolls the first nr_blocks blocks of a block device in the dedup domain.
+ * Devices are enrolled before the dedup structure is built ('dedup').
+ */
+static int dedup_enroll_dev(const char *name, long nr_blocks)
+{
+	struct dedup_dev *d;
+
+	if (!need_to_init) {
+		printk(KERN_ERR "dedup structure is built, enrol devices before 'dedup'.\n");
+		return -EBUSY;
+	}
+
+	if (nr_dedup_devs == DEDUP_MAX_DEVS) {
+		printk(KERN_ERR "dedup domain is full (%d devices).\n", DEDUP_MAX_DEVS);
+		return -ENOSPC;
+	}
+
+	d = &dedup_devs[nr_dedup_devs];
+	d->name = kstrdup(name, GFP_KERNEL);
+	if (!d->name)
+		return -ENOMEM;
+
+	d->nr_blocks = nr_blocks;
+	++nr_dedup_devs;
+	printk("enrolled %s, %ld blocks.\n", name, nr_blocks);
+
+	return 0;
+}
+
+/*
+ * Opens the domain device for reading, and keeps where it is on its disk
+ */
+static int dedup_open_dev(struct dedup_dev *d, dev_t dev)
+{
+	struct block_device *bdev = blkdev_get_by_dev(dev, FMODE_READ, NULL);
+
+	if (IS_ERR(bdev))
+		return PTR_ERR(bdev);
+
+	// Blocks of all devices are compared as equal size buffers
+	if (bdev->bd_block_size != dedup_get_block_size()) {
+		printk(KERN_ERR "block size of dev %d:%d is %u, not %ld.\n", MAJOR(dev), MINOR(dev),
+			   bdev->bd_block_size, dedup_get_block_size());
+		blkdev_put(bdev, FMODE_READ);
+		return -EINVAL;
+	}
+
+	d->bdev_id = new_encode_dev(dev);
+	// Bios of a partition reach us remapped to its disk
+	d->disk_id = new_encode_dev(bdev->bd_contains->bd_dev);
+	if (bdev != bdev->bd_contains) {
+		d->start_sect = bdev->bd_part->start_sect;
+		d->nr_sects = part_nr_sects_read(bdev->bd_part);
+	}
+	d->bdev = bdev;
+	dedup_dev_id_add(d);
+
+	return 0;
+}
+
+/*
+ * Opens the enrolled devices and places their blocks after our block
+ * device's in blocksArray. A device that can't be used is left out.
+ */
+static void dedup_open_enrolled_devs(void)
+{
+	struct block_device *bdev;
+	struct dedup_dev *d;
+	long dev_blocks;
+	int i, ret;
+
+	for (i = 1; i < nr_dedup_devs; ++i) {
+		d = &dedup_devs[i];
+		if (!d->bdev) {
+			bdev = lookup_bdev(d->name);
+			ret = (IS_ERR(bdev)) ? PTR_ERR(bdev) : dedup_open_dev(d, bdev->bd_dev);
+			if (!IS_ERR(bdev))
+				bdput(bdev);
+			if (ret) {
+				printk(KERN_ERR "failed to open %s (%d), left out of the domain.\n",
+					   d->name, ret);
+				d->nr_blocks = 0;
+				continue;
+			}
+		}
+
+		dev_blocks = i_size_read(d->bdev->bd_inode) >> ilog2(dedup_get_block_size());
+		if (d->nr_blocks > dev_blocks)
+			d->nr_blocks = dev_blocks;
+		if (d->nr_blocks > BLOCKS_MAX_COUNT - total_blocks)
+			d->nr_blocks = BLOCKS_MAX_COUNT - total_blocks;
+
+		d->index_base = total_blocks;
+		total_blocks += d->nr_blocks;
+		printk("%s (dev id=%d): %ld blocks from block %llu of the domain.\n", d->name,
+			   d->bdev_id, d->nr_blocks,
+			   (unsigned long long)DEDUP_DEV_TO_BLOCK(i, 0));
+	}
+}
+
 /*
  * Opens block device and performs read and compare operations
  */
 int dedup_calc(void)
 {
+	int ret;
+
 	// Check if we did not init already
 	if (need_to_init)
 	{
@@ -501,18 +1727,33 @@ int dedup_calc(void)
 		}
 
 		// Update our gendisk pointer
-		our_bdev_id = new_encode_dev(dedup_bdev->bd_dev);
+		if (!dedup_devs[0].bdev) {
+			ret = dedup_open_dev(&dedup_devs[0], dedup_bdev->bd_dev);
+			if (ret) {
+				printk(KERN_ERR "failed to open bdev (%d).\n", ret);
+				blkdev_put(dedup_bdev, FMODE_READ|FMODE_WRITE);
+				dedup_bdev = NULL;
+				return -1;
+			}
+		}
 
 		printk("****************** our bdev id *****************\n");
-		printk("dev id=%d\n", our_bdev_id);
+		printk("dev id=%d\n", dedup_devs[0].bdev_id);
 		printk("************************************************\n");
 
 		if (blocks_count > BLOCKS_MAX_COUNT)
 			blocks_count = BLOCKS_MAX_COUNT;
+		total_blocks = blocks_count;
+		dedup_open_enrolled_devs();
 
-		printk(KERN_ERR "blocks count = %ld (max = %ld)\n", blocks_count, BLOCKS_MAX_COUNT);
+		printk(KERN_ERR "blocks count = %ld, all devices = %ld (max = %ld)\n", blocks_count,
+			   total_blocks, BLOCKS_MAX_COUNT);
 		printk(KERN_ERR "each block size is (%ld)\n", dedup_get_block_size());
 
+		page_recs = vzalloc(sizeof(struct dedup_page_rec) << DEDUP_PAGE_RECS_BITS);
+		if (!page_recs)
+			printk(KERN_ERR "failed to alloc page records, zpool disabled.\n");
+
 		// Initialize block structure
 		if (dedup_init_blocks()) {
 			blkdev_put(dedup_bdev, FMODE_READ|FMODE_WRITE);
@@ -520,6 +1761,10 @@ int dedup_calc(void)
 			return -1;
 		}
 
+		// Without the write workers written blocks are left unknown
+		if (dedup_write_init())
+			printk(KERN_ERR "failed to init write workers.\n");
+
 		// Release bdev
 		blkdev_put(dedup_bdev, FMODE_READ|FMODE_WRITE);
 		dedup_bdev = NULL;
@@ -538,7 +1783,25 @@ int dedup_calc(void)
  */
 int dedup_update_page_changed(sector_t block, char* block_data)
 {
-	size_t block_size = dedup_get_block_size();
+	u8 hash[SHA256_DIGEST_SIZE];
+	unsigned long word;
+
+	if (dedup_data_pattern(block_data, dedup_get_block_size(), &word)) {
+		dedup_set_block_pattern(block, word);
+		return 0;
+	}
+
+	calc_hash(block_data, dedup_get_block_size(), hash);
+
+	return dedup_update_block_hash(block, hash);
+}
+
+/*
+ * Same as dedup_update_page_changed(), with the new data already hashed.
+ * Callers must serialize updates of the dedup structure.
+ */
+int dedup_update_block_hash(sector_t block, const u8 *hash)
+{
 	sector_t currblock, equal_block;
 
 	// Todo: add support if there is more than 1 block in page - check them all
@@ -548,23 +1811,29 @@ int dedup_update_page_changed(sector_t block, char* block_data)
 		return 0;
 	}
 
-	block = block - start_block;
+	// The block's page no longer holds its old content
+	dedup_class_remove_block(block);
+
+	block = dedup_block_index(block);
 	equal_block = block;
 
 	trace_printk("page is being updated : block = %ld\n", block);
 
 	// Remove from dedup structure
 	dedup_remove_block_duplication(block);
-	// Calc hash
-	calc_hash(block_data, block_size, blocksArray.hashes[block]);
+	// Set hash
+	memcpy(blocksArray.hashes[block], hash, SHA256_DIGEST_SIZE);
+	blocksArray.pattern[block] = 0;
 	// Calc crc32
 	blocksArray.hash_crc[block] = crc32_le(0, blocksArray.hashes[block], SHA256_DIGEST_SIZE);
 
 	// Go over other blocks
-	for (currblock = 0; currblock < blocks_count; ++currblock) {
+	for (currblock = 0; currblock < total_blocks; ++currblock) {
 		// If blocks equal, update dedup structure
 		if (currblock != block) {
-			if (blocksArray.hashes[currblock] == NULL)
+			// Free, unknown and rehashing blocks don't hold their hash
+			if (blocksArray.hashes[currblock] == NULL || blocksArray.pattern[currblock] ||
+				blocksArray.write_state[currblock] > DEDUP_BLOCK_MAX_PENDING)
 				continue;
 
 			// first, compare crc - should be faster
@@ -582,13 +1851,173 @@ int dedup_update_page_changed(sector_t block, char* block_data)
 	}
 
 	if (block != equal_block) {
-		trace_printk("found new duplicated block ! %ld = %ld\n", block + start_block, equal_block + start_block);
+		trace_printk("found new duplicated block ! %llu = %llu\n",
+					 (unsigned long long)dedup_index_block(block),
+					 (unsigned long long)dedup_index_block(equal_block));
 		dedup_set_block_duplication(equal_block, block);
 	}
 
 	return 0;
 }
 
+/*
+ * The block's content is unknown, unlink it from its equal blocks.
+ * Callers must serialize updates of the dedup structure.
+ */
+void dedup_invalidate_block(sector_t block)
+{
+	if (!dedup_is_in_range(block))
+		return;
+
+	dedup_class_remove_block(block);
+	dedup_remove_block_duplication(dedup_block_index(block));
+}
+
+/*
+ * Sets the block's hash and links it to equal_block, that has the same hash,
+ * without going over the other blocks. Falls back to dedup_update_block_hash()
+ * if equal_block's content changed or it's not linked anymore.
+ * Callers must serialize updates of the dedup structure.
+ */
+int dedup_set_block_hash_equal(sector_t block, const u8 *hash, sector_t equal_block)
+{
+	sector_t equal;
+
+	if (!dedup_is_in_range(block))
+		return 0;
+
+	if (equal_block == block || !dedup_is_in_range(equal_block))
+		return dedup_update_block_hash(block, hash);
+
+	// A pending block is still linked by its old hash, an unknown or free
+	// one may not be
+	equal = dedup_block_index(equal_block);
+	if (blocksArray.hashes[equal] == NULL || blocksArray.pattern[equal] ||
+		blocksArray.write_state[equal] > DEDUP_BLOCK_MAX_PENDING ||
+		memcmp(blocksArray.hashes[equal], hash, SHA256_DIGEST_SIZE) != 0)
+		return dedup_update_block_hash(block, hash);
+
+	dedup_class_remove_block(block);
+
+	block = dedup_block_index(block);
+	dedup_remove_block_duplication(block);
+	memcpy(blocksArray.hashes[block], hash, SHA256_DIGEST_SIZE);
+	blocksArray.pattern[block] = 0;
+	blocksArray.hash_crc[block] = blocksArray.hash_crc[equal];
+	dedup_set_block_duplication(equal, block);
+
+	return 0;
+}
+
+/*
+ * The block's data is the word repeated. It's tagged as a pattern block
+ * without hashing it, and it's not linked to the other blocks of the pattern:
+ * their reads are filled without reading any of them.
+ * Callers must serialize updates of the dedup structure.
+ */
+void dedup_set_block_pattern(sector_t block, unsigned long word)
+{
+	if (!dedup_is_in_range(block))
+		return;
+
+	dedup_class_remove_block(block);
+
+	block = dedup_block_index(block);
+	dedup_remove_block_duplication(block);
+	dedup_pattern_hash(word, blocksArray.hashes[block]);
+	blocksArray.hash_crc[block] = crc32_le(0, blocksArray.hashes[block], SHA256_DIGEST_SIZE);
+	blocksArray.pattern[block] = 1;
+}
+
+/*
+ * Unlinks the free blocks that follow the block in its ring.
+ * return the number of blocks unlinked
+ */
+static long dedup_skip_free_blocks(sector_t block)
+{
+	sector_t next = blocksArray.equal_blocks[block], after;
+	long unlinked = 0;
+
+	while (next != block && blocksArray.write_state[next] == DEDUP_BLOCK_FREE) {
+		after = blocksArray.equal_blocks[next];
+		blocksArray.equal_blocks[next] = next;
+		--duplicatedBlocks;
+		++unlinked;
+		next = after;
+	}
+	blocksArray.equal_blocks[block] = next;
+
+	return unlinked;
+}
+
+/*
+ * Unlinks the free blocks that follow the blocks of nr indexes from start,
+ * instead of walking the ring of each free block. Going over the whole range
+ * this way unlinks all free blocks but those whose predecessor changed
+ * meanwhile, dedup_unlink_free_rings() then unlinks these.
+ * A pass starting at index 0 restarts the count of free linked blocks.
+ * Callers must serialize updates of the dedup structure.
+ * return the number of blocks unlinked
+ */
+long dedup_unlink_free_blocks(long start, long nr)
+{
+	sector_t block, end = min_t(long, start + nr, total_blocks);
+	long unlinked = 0;
+
+	if (!start)
+		free_linked_blocks = 0;
+
+	for (block = start; block < end; ++block) {
+		if (blocksArray.write_state[block] != DEDUP_BLOCK_FREE)
+			unlinked += dedup_skip_free_blocks(block);
+	}
+
+	return unlinked;
+}
+
+/*
+ * Second pass of dedup_unlink_free_blocks() over nr indexes from start,
+ * unlinks free blocks still linked by walking their ring.
+ * Callers must serialize updates of the dedup structure.
+ * return the number of blocks unlinked
+ */
+long dedup_unlink_free_rings(long start, long nr)
+{
+	sector_t block, next, prev, end = min_t(long, start + nr, total_blocks);
+	long unlinked = 0;
+
+	// A write may have made a free block pending after we went over it,
+	// the free blocks after it are still linked
+	for (block = start; block < end; ++block) {
+		if (blocksArray.write_state[block] != DEDUP_BLOCK_FREE ||
+			blocksArray.equal_blocks[block] == block)
+			continue;
+
+		prev = block;
+		for (next = blocksArray.equal_blocks[block]; next != block;
+			 next = blocksArray.equal_blocks[next]) {
+			if (blocksArray.write_state[next] != DEDUP_BLOCK_FREE)
+				prev = next;
+		}
+
+		if (prev != block) {
+			unlinked += dedup_skip_free_blocks(prev);
+			continue;
+		}
+
+		// Only free blocks are left in the ring
+		while (blocksArray.equal_blocks[block] != block) {
+			next = blocksArray.equal_blocks[block];
+			blocksArray.equal_blocks[block] = blocksArray.equal_blocks[next];
+			blocksArray.equal_blocks[next] = next;
+			--duplicatedBlocks;
+			++unlinked;
+		}
+	}
+
+	return unlinked;
+}
+
 /*
  * Calculates block's hash value, to avoid all block compare.
  * hash_out must be allocated outside.
@@ -619,9 +2048,10 @@ void test_final_hash_compare(void)
 	sector_t i, j, equal_block;
 
 	// Go over all blocks
-	for (i = 0; i < blocks_count; ++i) {
+	for (i = 0; i < total_blocks; ++i) {
 		equal_block = i;
-		if (blocksArray.hashes[i] == NULL)
+		// Pattern blocks have no equal blocks ring
+		if (blocksArray.hashes[i] == NULL || blocksArray.pattern[i])
 			continue;
 
 		// Loop until current block
@@ -630,7 +2060,7 @@ void test_final_hash_compare(void)
 			if (blocksArray.hash_crc[i] == blocksArray.hash_crc[j]){
 				// If hash array is NULL then there is a block at lower index
 				// that is equal to this block and it was already compared to.
-				if (blocksArray.hashes[j] && blocksArray.hashes[i] &&
+				if (blocksArray.hashes[j] && blocksArray.hashes[i] && !blocksArray.pattern[j] &&
 					memcmp(blocksArray.hashes[i], blocksArray.hashes[j], SHA256_DIGEST_SIZE) == 0)
 				{
 					equal_block = j;
@@ -651,20 +2081,22 @@ void test_final_hash_compare(void)
  */
 int dedup_init_blocks(void)
 {
-	const int status_update_step = blocks_count / 10;
+	const int status_update_step = total_blocks / 10;
 	sector_t block_idx;
 	sector_t next_status_block = status_update_step;
 
-	printk(KERN_ERR "Initializing blocks array. blocks_count = %lu.\n", blocks_count);
+	printk(KERN_ERR "Initializing blocks array. blocks_count = %lu.\n", total_blocks);
 	// Go over all block and initialize blocks array
-	for (block_idx = 0; block_idx < blocks_count; ++block_idx) {
+	for (block_idx = 0; block_idx < total_blocks; ++block_idx) {
 		// Init blocks info
 		blocksArray.equal_blocks[block_idx] = block_idx;
-		blocksArray.pages[block_idx] = NULL;
+		blocksArray.page_refs[block_idx].ino = 0;
+		blocksArray.write_state[block_idx] = 0;
+		blocksArray.pattern[block_idx] = 0;
 		blocksArray.hashes[block_idx] = NULL;
 
 		// allocate hash array and init crc
-		if (dedup_is_in_range(block_idx + start_block)) {
+		if (dedup_is_in_range(dedup_index_block(block_idx))) {
 			blocksArray.hashes[block_idx] = (u8*)kmalloc(SHA256_DIGEST_SIZE, GFP_KERNEL);
 			blocksArray.hash_crc[block_idx] = 0;
 
@@ -677,17 +2109,17 @@ int dedup_init_blocks(void)
 
 	printk(KERN_ERR "Looking for equal blocks.\n");
 	// Go over all block set equal
-	for (block_idx = 0; block_idx < blocks_count; ++block_idx) {
+	for (block_idx = 0; block_idx < total_blocks; ++block_idx) {
 		if (blocksArray.hashes[block_idx] != NULL)
 			// Find equal block
 			dedup_calc_block_hash_crc(block_idx);
 
 		if (block_idx == next_status_block) {
 			next_status_block += status_update_step;
-			if (next_status_block > blocks_count)
-				next_status_block = blocks_count;
+			if (next_status_block > total_blocks)
+				next_status_block = total_blocks;
 			printk(KERN_ERR "%lu out of %lu blocks compared.\n",
-					block_idx, blocks_count);
+					block_idx, total_blocks);
 		}
 	}
 
@@ -715,16 +2147,16 @@ void print_dedup_data_structure(void)
 {
 	long i, j;
 	// Init array used to indicate if we already printed this link
-	char* tmp_buf = (char *)kmalloc(blocks_count, GFP_KERNEL);
+	char* tmp_buf = (char *)kmalloc(total_blocks, GFP_KERNEL);
 	if (!tmp_buf) {
 		printk("failed to alloc tmp_buf\n");
 		return;
 	}
 	// All set to 1. 1 means we need to print.
-	memset(tmp_buf, 1, blocks_count);
+	memset(tmp_buf, 1, total_blocks);
 
 	// Go over all blocks
-	for (i = 0; i < blocks_count; ++i) {
+	for (i = 0; i < total_blocks; ++i) {
 		// Check if we need to print this link
 		if (tmp_buf[i]) {
 			// Make sure it will not be printed next time
@@ -734,14 +2166,14 @@ void print_dedup_data_structure(void)
 				// Ignore blocks that do not have equal blocks
 				continue;
 
-			printk("%ld", i + start_block);
+			printk("%llu", (unsigned long long)dedup_index_block(i));
 
 			// Loop all equal blocks
 			while (j != i){
 				if (tmp_buf[j]){
 					// Make sure it will not be printed next time
 					tmp_buf[j] = 0;
-					printk("->%ld", j + start_block);
+					printk("->%llu", (unsigned long long)dedup_index_block(j));
 				}
 
 				j = blocksArray.equal_blocks[j];
@@ -763,8 +2195,7 @@ sector_t dedup_get_next_equal_block(sector_t block)
 
 	// Check if in dedup range
 	if (dedup_is_in_range(block)) {
-		next_equal = blocksArray.equal_blocks[block - start_block];
-		next_equal += start_block;
+		next_equal = dedup_index_block(blocksArray.equal_blocks[dedup_block_index(block)]);
 	}
 
 	return next_equal;
@@ -778,9 +2209,13 @@ void dedup_calc_block_hash_crc(sector_t block)
 	// Check if block in dedup range
 	if (blocksArray.hashes[block] != NULL) {
 		size_t block_size = dedup_get_block_size();
+		sector_t dev_block;
+		unsigned long word;
 		char *block_data;
+		ktime_t start;
+		u64 ns;
 
-		if (block >= blocks_count)
+		if (block >= total_blocks)
 			// outside dedup range
 			return;
 
@@ -790,13 +2225,32 @@ void dedup_calc_block_hash_crc(sector_t block)
 			return;
 		}
 
-		// Read block
-		read_block(block_data, block_size, start_block + block);
-		// Calc hash
-		calc_hash(block_data, block_size, blocksArray.hashes[block]);
+		// Read block from its device
+		dev_block = dedup_index_block(block);
+		read_block(dedup_devs[DEDUP_BLOCK_DEV(dev_block)].bdev, block_data, block_size,
+				   DEDUP_DEV_BLOCK(dev_block));
+
+		// Pattern blocks (mostly zeros) are tagged, not hashed
+		start = ktime_get();
+		blocksArray.pattern[block] = dedup_data_pattern(block_data, block_size, &word);
+		if (blocksArray.pattern[block])
+			dedup_pattern_hash(word, blocksArray.hashes[block]);
+		else
+			// Calc hash
+			calc_hash(block_data, block_size, blocksArray.hashes[block]);
 		// Calc crc32
 		blocksArray.hash_crc[block] = crc32_le(0, blocksArray.hashes[block], SHA256_DIGEST_SIZE);
 
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		if (blocksArray.pattern[block]) {
+			++scan_pattern_count;
+			scan_pattern_ns += ns;
+		}
+		else {
+			++scan_hashed_count;
+			scan_hashed_ns += ns;
+		}
+
 		kfree(block_data);
 	}
 }
@@ -841,34 +2295,174 @@ void dedup_update_block_page(struct page *page)
 {
 	struct address_space *mapping = page->mapping;
 	struct inode *inode = (mapping) ? page->mapping->host : NULL;
+	struct dedup_dev *d;
+	sector_t block;
 
 	if (inode != NULL) {
-		// get the block number
-		sector_t page_block = bmap(inode, page->index);
+		// Only files on the domain's block devices
+		d = dedup_find_dev(inode->i_sb->s_bdev);
+		if (!d)
+			return;
 
-		// Check if the block is inside dedup range
-		if (dedup_is_in_range(page_block)) {
-			// Update block's page reference
-			blocksArray.pages[page_block - start_block] = page;
-		}
+		// get the block number of the page's first block, holes have none
+		block = dedup_file_block(inode, page->index, 0);
+		if (block != (sector_t)-1)
+			dedup_set_block_page_ref(dedup_dev_block(d, block), page);
 	}
 	else
 		printk("inode is NULL :(\n");
 }
 
+/*
+ * return 1 if the page belongs to the block device's own page cache
+ */
+int dedup_is_bdev_page(struct page *page)
+{
+	return (page && page->mapping && !PageAnon(page) &&
+			S_ISBLK(page->mapping->host->i_mode));
+}
+
+/*
+ * Keeps a connection between block and the page it's read to, by the page's
+ * position in the page cache and not by the page itself. The page is either
+ * a page of a file on the block's device, of the block device's own page
+ * cache (buffer heads, raw images) or of the swap cache.
+ */
+void dedup_set_block_page_ref(sector_t block, struct page *page)
+{
+	struct dedup_dev *d = &dedup_devs[DEDUP_BLOCK_DEV(block)];
+	struct inode *inode;
+	struct dedup_page_ref *ref;
+	pgoff_t index = page->index;
+	u32 ino;
+
+	if (!dedup_is_in_range(block))
+		return;
+
+	if (PageSwapCache(page)) {
+		swp_entry_t entry = { .val = page_private(page) };
+
+		// Swap slots are pages
+		if (dedup_get_block_size() != PAGE_SIZE)
+			return;
+		d->swap_type = swp_type(entry);
+		index = swp_offset(entry);
+		ino = DEDUP_SWAP_INO;
+		goto set_ref;
+	}
+
+	inode = page->mapping->host;
+	if (S_ISBLK(inode->i_mode)) {
+		if (dedup_find_dev(I_BDEV(inode)) != d)
+			return;
+		ino = DEDUP_BDEV_INO;
+	}
+	else {
+		if (dedup_find_dev(inode->i_sb->s_bdev) != d || inode->i_ino >= DEDUP_SWAP_INO)
+			return;
+		dedup_set_sb(d, inode->i_sb);
+		ino = inode->i_ino;
+	}
+
+set_ref:
+	// Check the position fits
+	if (index > U32_MAX)
+		return;
+
+	// Update block's page reference
+	ref = &blocksArray.page_refs[dedup_block_index(block)];
+	ref->index = index;
+	ref->ino = ino;
+	dedup_set_page_block(page, block);
+	dedup_class_add_block(block);
+}
+
+/*
+ * Remember which block was read into the page
+ */
+void dedup_set_page_block(struct page *page, sector_t block)
+{
+	struct dedup_page_rec *rec;
+	unsigned long flags;
+
+	if (!page_recs)
+		return;
+
+	rec = &page_recs[hash_ptr(page, DEDUP_PAGE_RECS_BITS)];
+	spin_lock_irqsave(&page_recs_lock, flags);
+	rec->page = page;
+	rec->mapping = page->mapping;
+	rec->index = page->index;
+	rec->block = block;
+	spin_unlock_irqrestore(&page_recs_lock, flags);
+}
+
+/*
+ * Forgets the block read into the page, the page is written to another block
+ * or with other data.
+ * Safe to call with interrupts off.
+ */
+void dedup_clear_page_block(struct page *page)
+{
+	struct dedup_page_rec *rec;
+	unsigned long flags;
+
+	if (!page_recs)
+		return;
+
+	rec = &page_recs[hash_ptr(page, DEDUP_PAGE_RECS_BITS)];
+	if (ACCESS_ONCE(rec->page) != page)
+		return;
+
+	spin_lock_irqsave(&page_recs_lock, flags);
+	if (rec->page == page)
+		rec->page = NULL;
+	spin_unlock_irqrestore(&page_recs_lock, flags);
+}
+
+/*
+ * Finds the block that was read into the page, if the page still holds it.
+ * Safe to call with interrupts off.
+ * return 1 if the block was found
+ */
+int dedup_get_page_block(struct page *page, sector_t *block)
+{
+	struct dedup_page_rec *rec;
+	unsigned long flags;
+	int found = 0;
+
+	if (!page_recs)
+		return 0;
+
+	rec = &page_recs[hash_ptr(page, DEDUP_PAGE_RECS_BITS)];
+	spin_lock_irqsave(&page_recs_lock, flags);
+	if (rec->page == page && rec->mapping == page->mapping &&
+		rec->index == page->index) {
+		*block = rec->block;
+		found = 1;
+	}
+	spin_unlock_irqrestore(&page_recs_lock, flags);
+
+	return found;
+}
+
 /*
 * One page may contain several blocks
-* This function will go over page's block and return their indexes inside bdev
+* This function will go over page's block and return their indexes inside bdev,
+* as blocks of the domain, -1 for blocks without one (holes)
 */
 sector_t *dedup_get_page_physical_blocks(struct page *page, int *nr_blocks)
 {
 	struct inode *inode = page->mapping->host;
+	struct dedup_dev *d = dedup_find_dev(inode->i_sb->s_bdev);
 	sector_t block;
 	int curr_block = 0;
-	unsigned long index = page->index;
 	int blocksize = dedup_get_block_size();
 	sector_t *blocks;
 
+	if (!d)
+		return NULL;
+
 	// Calc blocks count
 	*nr_blocks = ((PAGE_SIZE + blocksize - 1) / blocksize);
 	// Allocate buffer to store all blocks' indexes
@@ -880,10 +2474,9 @@ sector_t *dedup_get_page_physical_blocks(struct page *page, int *nr_blocks)
 	}
 
 	// Get all blocks
-	block = index << (PAGE_SHIFT - inode->i_blkbits);
-	while (curr_block < *nr_blocks) {
-		blocks[curr_block++] = bmap(inode, block);
-		block++;
+	for (curr_block = 0; curr_block < *nr_blocks; ++curr_block) {
+		block = dedup_file_block(inode, page->index, curr_block * blocksize);
+		blocks[curr_block] = (block == (sector_t)-1) ? block : dedup_dev_block(d, block);
 	}
 
 	return blocks;
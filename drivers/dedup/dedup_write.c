@@ -0,0 +1,1403 @@
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/mempool.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/log2.h>
+#include <linux/jiffies.h>
+#include <linux/vmalloc.h>
+#include <crypto/hash.h>
+#include <linux/scatterlist.h>
+#include <linux/dedup.h>
+
+/*
+ * Write path of the dedup, called from generic_make_request() block/blk-core.c
+ *
+ * Written blocks used to be copied and hashed, and the whole range scanned for
+ * an equal block, in the submitting thread before the bio was even sent.
+ * Now the submit path only marks the bio's blocks as pending (their hash isn't
+ * their content anymore, so they're not used to serve reads) and hooks the
+ * bio's completion.
+ * When the write completes, the bio is queued to a worker of the completing
+ * CPU, which hashes the written data and updates the index in batches.
+ * A bio of page cache pages is completed to its owner first: the worker holds
+ * its pages and a copy of its segments, and hashes them afterwards. Page
+ * cache pages may be changed while they're written or once they're
+ * completed. A buffered write copies into a page under its lock and dirties
+ * it before unlocking it, so a held page is read only under trylock_page(),
+ * once it's found clean and still mapped. A block whose page is locked,
+ * dirty or gone is left unknown and read back instead. Other bios (direct I/O, swap) have no such tracking, they're hashed
+ * before their owner gets them back.
+ * Blocks are hashed straight from the pages through a scatterlist
+ * (the crypto API maps highmem pages itself), with a transform of the worker,
+ * so no data is copied.
+ * A bio covers blocks by its byte range, whatever its segments are. Blocks
+ * it fully overwrites are hashed from its segments, blocks it only partly
+ * writes are left unknown and queued to be read back from the device and
+ * hashed in the background.
+ * With 'same on', a write whose blocks all have the content they already have
+ * on the device is completed without sending it. Its blocks are hashed in the
+ * submitting thread and compared with the index, and a match is verified
+ * byte by byte against a copy of the content in memory (content cache or a
+ * resident page other than the written one), so a hash collision can't lose
+ * a write. Copies are only looked up without sleeping (block device and swap
+ * cache pages, not file pages). Writes that have no copy to verify against
+ * are sent. Flush and FUA writes are always sent.
+ * Churn:
+ * Journals, swap and WAL regions are rewritten many times a second and are
+ * rarely worth deduplicating. Writes are counted per region of blocks (once
+ * per bio), and a region with more than 'churn <n>' writes in a second stops
+ * being hashed: its written blocks are unlinked and left unknown. A region
+ * that calms down is hashed again, its unknown blocks are queued to be read
+ * back and hashed.
+ * Discards:
+ * A discarded block has no content, it becomes free and is skipped like an
+ * unknown block. Unlinking it from its ring right away would walk the ring,
+ * so free blocks stay linked, and once enough of them piled up (or after a
+ * large discard) a background pass over the range unlinks them all, in chunks
+ * so index_mutex is not held for the whole range. Freeing a block is O(1),
+ * large discards are freed in chunks.
+ * A write same (zeroing) writes one segment over all its blocks, a segment of
+ * one whole block is hashed once for all of them.
+ * Patterns:
+ * A written block of one repeated word (zeros, mostly) is not hashed, it's
+ * tagged as a pattern block and is not linked to the other blocks of its
+ * pattern. Reads of it are filled by the read hook without any I/O.
+ * A block written again before its previous write was hashed is only hashed
+ * once, by the last write. A failed write leaves its blocks unknown until they
+ * are written again.
+ */
+
+// Max bios a worker handles before it lets others run
+#define DEDUP_WRITE_BATCH 64
+// Reserved write trackers, so tracking never fails under memory pressure
+#define DEDUP_WRITE_POOL_SIZE 64
+
+// Max unknown blocks waiting to be read back and hashed
+#define DEDUP_REHASH_MAX 1024
+// Max blocks of a write checked for identical content
+#define DEDUP_SAME_MAX_BLOCKS 16
+// Blocks of a churn region, and the window writes are counted in (jiffies)
+#define DEDUP_CHURN_REGION_BLOCKS 256
+#define DEDUP_CHURN_WINDOW HZ
+// Discards of more blocks than this unlink the free blocks right away
+#define DEDUP_DISCARD_BULK_BLOCKS 65536
+// Blocks freed under the blocks state lock at a time
+#define DEDUP_DISCARD_CHUNK_BLOCKS 1024
+// Free blocks left linked before they are unlinked
+#define DEDUP_FREE_LINKED_MAX 65536
+// Blocks gone over under index_mutex at a time when unlinking free blocks
+#define DEDUP_UNLINK_CHUNK_BLOCKS 16384
+
+// A write bio waiting for its completion to be processed
+struct dedup_write_bio {
+	struct list_head list;
+	struct bio *bio;
+	bio_end_io_t *bi_end_io;	// owner's completion
+	void *bi_private;
+	unsigned short idx;			// first segment of the bio
+	sector_t first_block;		// blocks the bio covers
+	long nr_blocks;
+	unsigned int head;			// write offset inside the first block
+	unsigned int tail;			// written bytes of the last block, 0 if all
+	int err;
+	ktime_t start;				// when the bio was submitted
+	ktime_t end;				// when the device completed it
+	struct bio_vec *vecs;		// segments from idx, the bio's or a copy
+	int nr_vecs;
+	int held;					// owner has the bio back, we hold the copy
+};
+
+// Completed writes of one CPU
+struct dedup_write_cpu {
+	spinlock_t lock;
+	struct list_head bios;
+	struct work_struct work;
+	struct crypto_hash *tfm;	// sha256 of the worker
+	struct crypto_hash *same_tfm;	// sha256 of the submit path, used with
+									// preemption off
+};
+
+// Write churn of a region of blocks
+struct dedup_churn_region {
+	unsigned long window;		// window of the last write
+	u16 writes;					// writes in that window
+	u8 churning;				// written blocks are not hashed
+};
+
+// Hashing of a completed bio's blocks
+struct dedup_write_walk {
+	struct hash_desc desc;
+	int hashing;				// current block is hashed
+	int pattern;				// current block is a pattern, not hashed
+	unsigned long word;
+	struct page *page;			// current block's page, if it's all in one
+	int changed;				// current block's page changed before it was hashed
+	long region;				// churn region of the current block
+	int churning;
+	ktime_t hash_start;
+	u64 hash_ns;
+	long hashed, coalesced, partial, page_refs, churned;
+	long freed, linked, patterns, changed_blocks;
+};
+
+static struct workqueue_struct *write_wq = NULL;
+static struct dedup_write_cpu __percpu *write_cpus = NULL;
+static mempool_t *write_pool = NULL;
+// Serializes index updates of the workers
+static DEFINE_MUTEX(index_mutex);
+
+// Blocks left unknown by partial writes, as a circular queue
+static sector_t rehash_blocks[DEDUP_REHASH_MAX];
+static int rehash_head = 0, nr_rehash = 0;
+static DEFINE_SPINLOCK(rehash_lock);
+static struct crypto_hash *rehash_tfm = NULL;
+static void dedup_rehash(struct work_struct *work);
+static DECLARE_WORK(rehash_work, dedup_rehash);
+// Unlinks free blocks from their rings
+static void dedup_free_sweep(struct work_struct *work);
+static DECLARE_WORK(free_sweep_work, dedup_free_sweep);
+
+// Statistics, protected by write_stats_lock
+static DEFINE_SPINLOCK(write_stats_lock);
+static long write_count = 0, hashed_block_count = 0, coalesced_block_count = 0;
+static long failed_write_count = 0, write_batch_count = 0;
+static long partial_block_count = 0, rehashed_block_count = 0, rehash_dropped_count = 0;
+static long written_page_ref_count = 0;
+static long discard_count = 0, freed_block_count = 0, free_unlinked_count = 0;
+static long free_sweep_count = 0, linked_block_count = 0, pattern_block_count = 0;
+static long early_complete_count = 0, changed_block_count = 0;
+
+// Churn regions of the dedup range
+static struct dedup_churn_region *churn_regions = NULL;
+static long nr_churn_regions = 0, nr_churning = 0;
+// Writes per second that make a region churning, 0 means never
+static int churn_max_writes = 32;
+static DEFINE_SPINLOCK(churn_lock);
+static void dedup_churn_scan(struct work_struct *work);
+static DECLARE_DELAYED_WORK(churn_work, dedup_churn_scan);
+// Statistics, protected by write_stats_lock
+static long churn_demoted_count = 0, churn_readmitted_count = 0, churn_block_count = 0;
+static long churn_read_count = 0;
+static u64 hash_total_ns = 0;
+
+// Identical writes suppression
+static int same_writes_on = 0;
+// Statistics, protected by write_stats_lock
+static long same_checked_count = 0, same_write_count = 0, same_block_count = 0;
+static long same_mismatch_count = 0, same_unverified_count = 0;
+static u64 same_total_ns = 0;
+static u64 write_total_ns = 0, write_max_ns = 0, write_delay_ns = 0;
+
+/*
+ * Hashes the block's data at offset of page, without copying it
+ */
+static void dedup_hash_block_page(struct crypto_hash *tfm, struct page *page,
+								  unsigned int offset, u8 *hash)
+{
+	size_t block_size = dedup_get_block_size();
+	struct hash_desc desc;
+	struct scatterlist sg;
+
+	desc.tfm = tfm;
+	desc.flags = 0;
+	sg_init_table(&sg, 1);
+	sg_set_page(&sg, page, block_size, offset);
+
+	crypto_hash_digest(&desc, &sg, block_size, hash);
+}
+
+/*
+ * return 1 and the word if the block's data at offset of page is a pattern
+ */
+static int dedup_page_pattern(struct page *page, unsigned int offset, unsigned long *word)
+{
+	char *addr;
+	int ret;
+
+	addr = kmap_atomic(page);
+	ret = dedup_data_pattern(addr + offset, dedup_get_block_size(), word);
+	kunmap_atomic(addr);
+
+	return ret;
+}
+
+/*
+ * Queues an unknown block to be read back and hashed
+ */
+static void dedup_queue_rehash(sector_t block)
+{
+	unsigned long flags;
+	int queued = 0;
+
+	spin_lock_irqsave(&rehash_lock, flags);
+	if (nr_rehash < DEDUP_REHASH_MAX) {
+		rehash_blocks[(rehash_head + nr_rehash++) % DEDUP_REHASH_MAX] = block;
+		queued = 1;
+	}
+	else
+		++rehash_dropped_count;
+	spin_unlock_irqrestore(&rehash_lock, flags);
+
+	if (queued)
+		schedule_work(&rehash_work);
+}
+
+/*
+ * Reads back the queued unknown blocks and hashes them
+ */
+static void dedup_rehash(struct work_struct *work)
+{
+	struct page *page = alloc_page(GFP_KERNEL);
+	u8 hash[SHA256_DIGEST_SIZE];
+	unsigned long flags, word;
+	sector_t block;
+	int pattern;
+
+	if (!page || !rehash_tfm) {
+		printk(KERN_ERR "rehash failed to get page.\n");
+		goto out;
+	}
+
+	for (;;) {
+		spin_lock_irqsave(&rehash_lock, flags);
+		if (!nr_rehash) {
+			spin_unlock_irqrestore(&rehash_lock, flags);
+			break;
+		}
+		block = rehash_blocks[rehash_head];
+		rehash_head = (rehash_head + 1) % DEDUP_REHASH_MAX;
+		--nr_rehash;
+		spin_unlock_irqrestore(&rehash_lock, flags);
+
+		// It may have been written since
+		if (!dedup_block_rehash_start(block))
+			continue;
+
+		if (dedup_read_block(block, page)) {
+			dedup_block_rehash_end(block, 0);
+			continue;
+		}
+
+		pattern = dedup_page_pattern(page, 0, &word);
+		if (!pattern)
+			dedup_hash_block_page(rehash_tfm, page, 0, hash);
+
+		mutex_lock(&index_mutex);
+		if (dedup_block_is_rehashing(block)) {
+			if (pattern)
+				dedup_set_block_pattern(block, word);
+			else
+				dedup_update_block_hash(block, hash);
+			if (dedup_block_rehash_end(block, 1))
+				++rehashed_block_count;
+		}
+		mutex_unlock(&index_mutex);
+	}
+
+out:
+	if (page)
+		put_page(page);
+}
+
+/*
+ * Records the written page as the resident page of the block's new content.
+ * Only page cache and swap cache pages, the user pages of direct writes may
+ * change at any time.
+ * return 1 if the page was recorded
+ */
+static int dedup_write_set_page_ref(sector_t block, struct page *page)
+{
+	size_t block_size = dedup_get_block_size();
+
+	if (!dedup_block_has_duplicates(block))
+		return 0;
+
+	if (PageSwapCache(page)) {
+		if (block_size != PAGE_SIZE)
+			return 0;
+	}
+	// A file page is one block, a block device page may hold several
+	else if (!page->mapping || PageAnon(page) ||
+			 (block_size != PAGE_SIZE && !dedup_is_bdev_page(page)))
+		return 0;
+
+	dedup_set_block_page_ref(block, page);
+	return 1;
+}
+
+/*
+ * Checks if the region had no more than a quarter of the churn threshold
+ * writes in its last window, and nothing since.
+ * Must be called with churn_lock held.
+ */
+static int dedup_churn_calm(struct dedup_churn_region *r, unsigned long now)
+{
+	return (now != r->window &&
+			(now - r->window > 1 || r->writes <= churn_max_writes / 4));
+}
+
+/*
+ * Region of the block, regions split the blocks of all the domain's devices
+ * by their index. return -1 if the block is not in range.
+ */
+static long dedup_churn_region(sector_t block)
+{
+	long index = dedup_get_block_index(block);
+
+	return (index < 0) ? -1 : index / DEDUP_CHURN_REGION_BLOCKS;
+}
+
+/*
+ * The region calmed down, its unknown blocks are read back and hashed
+ */
+static void dedup_churn_readmit(long region)
+{
+	long index = region * DEDUP_CHURN_REGION_BLOCKS, nr_blocks = dedup_get_blocks_count();
+	sector_t block;
+	int i;
+
+	for (i = 0; i < DEDUP_CHURN_REGION_BLOCKS && index < nr_blocks; ++i, ++index) {
+		block = dedup_get_index_block(index);
+		if (dedup_is_in_range(block) && !dedup_block_is_known(block))
+			dedup_queue_rehash(block);
+	}
+}
+
+/*
+ * Counts a write to the block's region.
+ * return 1 if the region is churning, and its blocks must not be hashed
+ */
+static int dedup_churn_write(sector_t block)
+{
+	unsigned long now = jiffies / DEDUP_CHURN_WINDOW;
+	struct dedup_churn_region *r;
+	unsigned long flags;
+	long region;
+	int churning, readmit = 0, demote = 0;
+
+	region = dedup_churn_region(block);
+	if (!churn_regions || region < 0 || region >= nr_churn_regions)
+		return 0;
+
+	r = &churn_regions[region];
+	spin_lock_irqsave(&churn_lock, flags);
+	if (r->window != now) {
+		if (r->churning && (!churn_max_writes || dedup_churn_calm(r, now))) {
+			r->churning = 0;
+			--nr_churning;
+			readmit = 1;
+		}
+		r->window = now;
+		r->writes = 0;
+	}
+
+	if (r->writes < U16_MAX)
+		++r->writes;
+	if (churn_max_writes && !r->churning && r->writes > churn_max_writes) {
+		r->churning = 1;
+		++nr_churning;
+		demote = 1;
+	}
+	churning = r->churning;
+	spin_unlock_irqrestore(&churn_lock, flags);
+
+	if (readmit)
+		dedup_churn_readmit(region);
+
+	if (demote || readmit) {
+		spin_lock_irqsave(&write_stats_lock, flags);
+		churn_demoted_count += demote;
+		churn_readmitted_count += readmit;
+		spin_unlock_irqrestore(&write_stats_lock, flags);
+	}
+
+	// Regions that stop being written are readmitted by the scan
+	if (demote)
+		schedule_delayed_work(&churn_work, DEDUP_CHURN_WINDOW);
+
+	return churning;
+}
+
+/*
+ * Readmits churning regions that were not written for a while, runs every
+ * window while there are such regions
+ */
+static void dedup_churn_scan(struct work_struct *work)
+{
+	unsigned long now = jiffies / DEDUP_CHURN_WINDOW;
+	unsigned long flags;
+	long region, readmitted = 0;
+	int readmit;
+
+	for (region = 0; region < nr_churn_regions && nr_churning; ++region) {
+		struct dedup_churn_region *r = &churn_regions[region];
+
+		if (!r->churning)
+			continue;
+
+		spin_lock_irqsave(&churn_lock, flags);
+		readmit = (r->churning && (!churn_max_writes || dedup_churn_calm(r, now)));
+		if (readmit) {
+			r->churning = 0;
+			--nr_churning;
+		}
+		spin_unlock_irqrestore(&churn_lock, flags);
+
+		if (readmit) {
+			dedup_churn_readmit(region);
+			++readmitted;
+		}
+	}
+
+	spin_lock_irqsave(&write_stats_lock, flags);
+	churn_readmitted_count += readmitted;
+	spin_unlock_irqrestore(&write_stats_lock, flags);
+
+	if (nr_churning)
+		schedule_delayed_work(&churn_work, DEDUP_CHURN_WINDOW);
+}
+
+/*
+ * return 1 if the block's region is churning
+ */
+static int dedup_block_is_churning(sector_t block)
+{
+	long region = dedup_churn_region(block);
+
+	return (churn_regions && region >= 0 && region < nr_churn_regions &&
+			churn_regions[region].churning);
+}
+
+/*
+ * Counts a read of an untracked block, called from the read path
+ */
+void dedup_churn_add_read(sector_t block)
+{
+	unsigned long flags;
+
+	if (!nr_churning || !dedup_block_is_churning(block))
+		return;
+
+	spin_lock_irqsave(&write_stats_lock, flags);
+	++churn_read_count;
+	spin_unlock_irqrestore(&write_stats_lock, flags);
+}
+
+/*
+ * Sets the writes per second that make a region churning, 0 turns it off
+ */
+void dedup_set_churn(int max_writes)
+{
+	churn_max_writes = max_writes;
+	// Churning regions are readmitted by the next scan
+	if (nr_churning)
+		schedule_delayed_work(&churn_work, 0);
+}
+
+/*
+ * return 1 if only a part of the bio's j'th block is written
+ */
+static int dedup_write_block_partial(struct dedup_write_bio *wb, long j)
+{
+	return ((j == 0 && wb->head) || (j == wb->nr_blocks - 1 && wb->tail));
+}
+
+/*
+ * Starts hashing the bio's j'th block, if it's hashed at all
+ */
+static void dedup_write_walk_start(struct dedup_write_walk *walk,
+								   struct dedup_write_bio *wb, long j)
+{
+	sector_t block = wb->first_block + j;
+	long region = dedup_churn_region(block);
+
+	// A bio counts once in each region it writes
+	if (region != walk->region) {
+		walk->region = region;
+		walk->churning = (!wb->err && dedup_churn_write(block));
+	}
+
+	// Only the last pending write of a block is hashed. Overlapping
+	// writes in flight together leave the device with either data,
+	// we take the one that completed last.
+	walk->hashing = (!wb->err && !walk->churning && !dedup_write_block_partial(wb, j) &&
+					 dedup_block_write_pending(block) == 1);
+	walk->page = NULL;
+	walk->pattern = 0;
+	walk->changed = 0;
+	if (walk->hashing) {
+		walk->hash_start = ktime_get();
+		crypto_hash_init(&walk->desc);
+	}
+}
+
+/*
+ * The write of the block leaves its content unknown, it's no one's equal block
+ * until it's hashed again.
+ * return 1 if it was the block's last pending write
+ */
+static int dedup_write_block_unknown(sector_t block)
+{
+	int last;
+
+	mutex_lock(&index_mutex);
+	last = (dedup_block_write_pending(block) == 1);
+	if (last)
+		dedup_invalidate_block(block);
+	dedup_block_write_end(block, 0);
+	mutex_unlock(&index_mutex);
+
+	return last;
+}
+
+/*
+ * Updates the index with the bio's j'th block
+ */
+static void dedup_write_walk_end(struct dedup_write_walk *walk,
+								 struct dedup_write_bio *wb, long j)
+{
+	sector_t block = wb->first_block + j;
+	u8 hash[SHA256_DIGEST_SIZE];
+	int last;
+
+	if (!dedup_is_in_range(block))
+		return;
+
+	if (wb->err || walk->churning || dedup_write_block_partial(wb, j)) {
+		// Content on the device is unknown, or only a part of it is in
+		// the bio, or it's not hashed
+		last = dedup_write_block_unknown(block);
+		if (wb->err)
+			return;
+
+		if (walk->churning)
+			++walk->churned;
+		else {
+			++walk->partial;
+			if (last)
+				dedup_queue_rehash(block);
+		}
+		return;
+	}
+
+	if (!walk->hashing) {
+		dedup_block_write_end(block, 1);
+		++walk->coalesced;
+		return;
+	}
+
+	// The owner changed the page, we may not have hashed what the device has
+	if (walk->changed) {
+		if (dedup_write_block_unknown(block))
+			dedup_queue_rehash(block);
+		++walk->changed_blocks;
+		return;
+	}
+
+	if (!walk->pattern) {
+		crypto_hash_final(&walk->desc, hash);
+		walk->hash_ns += ktime_to_ns(ktime_sub(ktime_get(), walk->hash_start));
+	}
+
+	mutex_lock(&index_mutex);
+	// Another write may have come while we were hashing
+	last = (dedup_block_write_pending(block) == 1);
+	if (last && walk->pattern) {
+		dedup_set_block_pattern(block, walk->word);
+		++walk->patterns;
+	}
+	else if (last) {
+		dedup_update_block_hash(block, hash);
+		++walk->hashed;
+	}
+	else
+		++walk->coalesced;
+	dedup_block_write_end(block, 1);
+	mutex_unlock(&index_mutex);
+
+	// Reads of pattern blocks are filled without any page
+	if (walk->pattern)
+		return;
+
+	// The written page holds the new content, reads of equal blocks can
+	// use it right away
+	if (last && walk->page && dedup_write_set_page_ref(block, walk->page))
+		++walk->page_refs;
+}
+
+/*
+ * A held page cache page changed once the owner got it back: it was dirtied
+ * again or truncated.
+ * Must be called with the page locked.
+ */
+static int dedup_write_page_changed(struct page *page)
+{
+	return (!page->mapping || PageDirty(page));
+}
+
+/*
+ * Hashes the blocks of a completed bio from its segments
+ */
+static void dedup_write_walk_bio(struct dedup_write_walk *walk, struct dedup_write_bio *wb)
+{
+	size_t block_size = dedup_get_block_size();
+	struct scatterlist sg;
+	struct bio_vec *bvec;
+	unsigned int offset, len, n, filled = wb->head;
+	long j = 0;
+	int i, locked;
+
+	// Split the bio's segments at block boundaries, a block may span
+	// several segments and a segment several blocks
+	dedup_write_walk_start(walk, wb, 0);
+	for (i = 0; i < wb->nr_vecs && j < wb->nr_blocks; ++i) {
+		bvec = &wb->vecs[i];
+		offset = bvec->bv_offset;
+		len = bvec->bv_len;
+
+		while (len && j < wb->nr_blocks) {
+			n = min_t(unsigned int, len, block_size - filled);
+
+			// A held page is read locked, a write into it can't be
+			// halfway through, and it's clean if none came since
+			locked = 0;
+			if (walk->hashing && !walk->changed && wb->held) {
+				if (!trylock_page(bvec->bv_page))
+					walk->changed = 1;
+				else if (dedup_write_page_changed(bvec->bv_page)) {
+					unlock_page(bvec->bv_page);
+					walk->changed = 1;
+				}
+				else
+					locked = 1;
+			}
+
+			if (!filled && n == block_size) {
+				walk->page = bvec->bv_page;
+				// A block in one segment is checked for a pattern
+				// before it's hashed
+				if (walk->hashing && !walk->changed)
+					walk->pattern = dedup_page_pattern(bvec->bv_page, offset,
+													   &walk->word);
+			}
+
+			if (walk->hashing && !walk->changed && !walk->pattern) {
+				sg_init_table(&sg, 1);
+				sg_set_page(&sg, bvec->bv_page, n, offset);
+				crypto_hash_update(&walk->desc, &sg, n);
+			}
+
+			if (locked)
+				unlock_page(bvec->bv_page);
+
+			filled += n;
+			offset += n;
+			len -= n;
+
+			if (filled == block_size) {
+				dedup_write_walk_end(walk, wb, j);
+				filled = 0;
+				if (++j < wb->nr_blocks)
+					dedup_write_walk_start(walk, wb, j);
+			}
+		}
+	}
+
+	// Last block, only partly written
+	if (j < wb->nr_blocks)
+		dedup_write_walk_end(walk, wb, j);
+}
+
+/*
+ * Unlinks the free blocks from their rings in two passes over the range,
+ * releasing index_mutex between chunks
+ */
+static void dedup_free_sweep(struct work_struct *work)
+{
+	long start, nr = dedup_get_blocks_count(), unlinked = 0;
+	unsigned long flags;
+
+	for (start = 0; start < nr; start += DEDUP_UNLINK_CHUNK_BLOCKS) {
+		mutex_lock(&index_mutex);
+		unlinked += dedup_unlink_free_blocks(start, DEDUP_UNLINK_CHUNK_BLOCKS);
+		mutex_unlock(&index_mutex);
+		cond_resched();
+	}
+	for (start = 0; start < nr; start += DEDUP_UNLINK_CHUNK_BLOCKS) {
+		mutex_lock(&index_mutex);
+		unlinked += dedup_unlink_free_rings(start, DEDUP_UNLINK_CHUNK_BLOCKS);
+		mutex_unlock(&index_mutex);
+		cond_resched();
+	}
+
+	spin_lock_irqsave(&write_stats_lock, flags);
+	free_unlinked_count += unlinked;
+	++free_sweep_count;
+	spin_unlock_irqrestore(&write_stats_lock, flags);
+}
+
+/*
+ * A completed discard leaves the blocks it fully covers free. Partly
+ * discarded blocks are left unknown and queued to be read back.
+ */
+static void dedup_write_discard(struct dedup_write_walk *walk, struct dedup_write_bio *wb)
+{
+	sector_t block = wb->first_block;
+	long nr = wb->nr_blocks, i, n;
+	int bulk;
+
+	if (wb->err) {
+		for (i = 0; i < nr; ++i)
+			dedup_write_block_unknown(block + i);
+		return;
+	}
+
+	if (wb->head) {
+		if (dedup_write_block_unknown(block))
+			dedup_queue_rehash(block);
+		++walk->partial;
+		++block;
+		--nr;
+	}
+	if (wb->tail && nr > 0) {
+		if (dedup_write_block_unknown(block + nr - 1))
+			dedup_queue_rehash(block + nr - 1);
+		++walk->partial;
+		--nr;
+	}
+
+	// Large discards (fstrim) are freed in chunks, the locks are not held
+	// across all of them
+	bulk = (nr >= DEDUP_DISCARD_BULK_BLOCKS);
+	for (i = 0; i < nr; i += n) {
+		n = min_t(long, nr - i, DEDUP_DISCARD_CHUNK_BLOCKS);
+		mutex_lock(&index_mutex);
+		walk->freed += dedup_blocks_discard_end(block + i, n);
+		mutex_unlock(&index_mutex);
+		if (bulk)
+			cond_resched();
+	}
+
+	// Free blocks are unlinked from their rings in the background, after a
+	// large discard or once enough of them piled up
+	if (bulk || dedup_get_free_linked_blocks() >= DEDUP_FREE_LINKED_MAX)
+		schedule_work(&free_sweep_work);
+}
+
+/*
+ * A completed write same wrote its one segment over all its blocks. A pattern
+ * segment (zeros) tags the blocks as pattern blocks and a segment of a whole
+ * block is hashed once, without hashing each block. Otherwise blocks are left
+ * unknown and queued to be read back.
+ */
+static void dedup_write_same(struct dedup_write_walk *walk, struct dedup_write_bio *wb)
+{
+	size_t block_size = dedup_get_block_size();
+	struct bio_vec *bvec = &wb->bio->bi_io_vec[wb->idx];
+	sector_t block, equal_block = (sector_t)-1;
+	u8 hash[SHA256_DIGEST_SIZE];
+	unsigned long word;
+	int pattern, known;
+	char *addr;
+	long j;
+
+	// A segment of one repeated word makes blocks of that word too
+	addr = kmap_atomic(bvec->bv_page);
+	pattern = dedup_data_pattern(addr + bvec->bv_offset, bvec->bv_len, &word);
+	kunmap_atomic(addr);
+
+	known = (!wb->err && (pattern || bvec->bv_len == block_size));
+	if (known && !pattern)
+		dedup_hash_block_page(walk->desc.tfm, bvec->bv_page, bvec->bv_offset, hash);
+
+	for (j = 0; j < wb->nr_blocks; ++j) {
+		block = wb->first_block + j;
+		if (!dedup_is_in_range(block))
+			continue;
+
+		if (!known || dedup_write_block_partial(wb, j)) {
+			if (dedup_write_block_unknown(block) && !wb->err)
+				dedup_queue_rehash(block);
+			if (!wb->err)
+				++walk->partial;
+			continue;
+		}
+
+		mutex_lock(&index_mutex);
+		if (dedup_block_write_pending(block) == 1) {
+			if (pattern) {
+				dedup_set_block_pattern(block, word);
+				++walk->patterns;
+			}
+			else {
+				dedup_set_block_hash_equal(block, hash, equal_block);
+				equal_block = block;
+				++walk->linked;
+			}
+		}
+		else
+			++walk->coalesced;
+		dedup_block_write_end(block, 1);
+		mutex_unlock(&index_mutex);
+	}
+}
+
+/*
+ * Completes the bio to its owner
+ */
+static void dedup_write_end_owner(struct dedup_write_bio *wb)
+{
+	struct bio *bio = wb->bio;
+
+	bio->bi_end_io = wb->bi_end_io;
+	bio->bi_private = wb->bi_private;
+	bio_endio(bio, wb->err);
+}
+
+/*
+ * Holds what's needed to update the index once the owner has the bio back:
+ * a discard needs nothing, a write of page cache pages a reference on each
+ * page and a copy of its segments. Write same and other writes are processed
+ * with the bio.
+ * return 1 if the bio can be completed now
+ */
+static int dedup_write_hold(struct dedup_write_bio *wb)
+{
+	struct bio *bio = wb->bio;
+	struct bio_vec *vecs;
+	struct page *page;
+	int i, nr = bio->bi_vcnt - wb->idx;
+
+	wb->vecs = bio->bi_io_vec + wb->idx;
+	wb->nr_vecs = nr;
+	wb->held = 0;
+
+	if (bio->bi_rw & REQ_DISCARD) {
+		wb->nr_vecs = 0;
+		return 1;
+	}
+	if (bio->bi_rw & REQ_WRITE_SAME)
+		return 0;
+
+	for (i = 0; i < nr; ++i) {
+		page = wb->vecs[i].bv_page;
+		if (!page->mapping || PageAnon(page))
+			return 0;
+	}
+
+	vecs = kmalloc(nr * sizeof(struct bio_vec), GFP_NOIO | __GFP_NOWARN);
+	if (!vecs)
+		return 0;
+
+	memcpy(vecs, wb->vecs, nr * sizeof(struct bio_vec));
+	for (i = 0; i < nr; ++i)
+		get_page(vecs[i].bv_page);
+	wb->vecs = vecs;
+	wb->held = 1;
+
+	return 1;
+}
+
+/*
+ * Releases what dedup_write_hold() held
+ */
+static void dedup_write_release(struct dedup_write_bio *wb)
+{
+	int i;
+
+	if (!wb->held)
+		return;
+
+	for (i = 0; i < wb->nr_vecs; ++i)
+		put_page(wb->vecs[i].bv_page);
+	kfree(wb->vecs);
+}
+
+/*
+ * Updates the index with the written blocks of a completed bio, and completes
+ * it to its owner. A bio whose data is held is completed first, so the owner
+ * doesn't wait for hashing or for the index.
+ */
+static void dedup_write_complete(struct dedup_write_bio *wb, struct crypto_hash *tfm)
+{
+	unsigned long rw = wb->bio->bi_rw;
+	struct dedup_write_walk walk;
+	unsigned long flags;
+	int early;
+	u64 ns;
+
+	walk.desc.tfm = tfm;
+	walk.desc.flags = 0;
+	walk.hashed = walk.coalesced = walk.partial = walk.page_refs = walk.churned = 0;
+	walk.freed = walk.linked = walk.patterns = 0;
+	walk.changed_blocks = 0;
+	walk.region = -1;
+	walk.churning = 0;
+	walk.hash_ns = 0;
+
+	early = dedup_write_hold(wb);
+	if (early) {
+		dedup_write_end_owner(wb);
+		ns = ktime_to_ns(ktime_sub(ktime_get(), wb->start));
+	}
+
+	if (rw & REQ_DISCARD)
+		dedup_write_discard(&walk, wb);
+	else if (rw & REQ_WRITE_SAME)
+		dedup_write_same(&walk, wb);
+	else
+		dedup_write_walk_bio(&walk, wb);
+
+	dedup_write_release(wb);
+	if (!early)
+		ns = ktime_to_ns(ktime_sub(ktime_get(), wb->start));
+
+	spin_lock_irqsave(&write_stats_lock, flags);
+	++write_count;
+	hashed_block_count += walk.hashed;
+	coalesced_block_count += walk.coalesced;
+	partial_block_count += walk.partial;
+	written_page_ref_count += walk.page_refs;
+	churn_block_count += walk.churned;
+	hash_total_ns += walk.hash_ns;
+	freed_block_count += walk.freed;
+	linked_block_count += walk.linked;
+	pattern_block_count += walk.patterns;
+	changed_block_count += walk.changed_blocks;
+	early_complete_count += early;
+	if (rw & REQ_DISCARD)
+		++discard_count;
+	if (wb->err)
+		++failed_write_count;
+	write_total_ns += ns;
+	if (ns > write_max_ns)
+		write_max_ns = ns;
+	write_delay_ns += ktime_to_ns(ktime_sub(ktime_get(), wb->end));
+	spin_unlock_irqrestore(&write_stats_lock, flags);
+
+	if (!early)
+		dedup_write_end_owner(wb);
+	mempool_free(wb, write_pool);
+}
+
+/*
+ * Worker of one CPU, processes the writes that completed on it
+ */
+static void dedup_write_work(struct work_struct *work)
+{
+	struct dedup_write_cpu *wc = container_of(work, struct dedup_write_cpu, work);
+	struct dedup_write_bio *wb, *tmp;
+	unsigned long flags;
+	LIST_HEAD(batch);
+	int nr = 0, more;
+
+	spin_lock_irqsave(&wc->lock, flags);
+	list_for_each_entry_safe(wb, tmp, &wc->bios, list) {
+		if (nr++ == DEDUP_WRITE_BATCH)
+			break;
+		list_move_tail(&wb->list, &batch);
+	}
+	more = !list_empty(&wc->bios);
+	spin_unlock_irqrestore(&wc->lock, flags);
+
+	list_for_each_entry_safe(wb, tmp, &batch, list) {
+		list_del(&wb->list);
+		dedup_write_complete(wb, wc->tfm);
+	}
+
+	spin_lock_irqsave(&write_stats_lock, flags);
+	++write_batch_count;
+	spin_unlock_irqrestore(&write_stats_lock, flags);
+
+	if (more)
+		queue_work(write_wq, work);
+}
+
+/*
+ * Completion of a tracked write, may be called in interrupt context.
+ * Hands the bio to the completing CPU's worker.
+ */
+static void dedup_write_end_io(struct bio *bio, int err)
+{
+	struct dedup_write_bio *wb = bio->bi_private;
+	struct dedup_write_cpu *wc;
+	unsigned long flags;
+	int cpu;
+
+	wb->err = err;
+	wb->end = ktime_get();
+
+	cpu = get_cpu();
+	wc = per_cpu_ptr(write_cpus, cpu);
+	spin_lock_irqsave(&wc->lock, flags);
+	list_add_tail(&wb->list, &wc->bios);
+	spin_unlock_irqrestore(&wc->lock, flags);
+	queue_work_on(cpu, write_wq, &wc->work);
+	put_cpu();
+}
+
+/*
+ * Compares the block's written data with a copy of its content in memory,
+ * other than the written page itself. We're inside generic_make_request(),
+ * so only copies found without sleeping are used.
+ * return 1 if equal, 0 if not, -1 if there is no copy
+ */
+static int dedup_verify_same_block(sector_t block, u32 crc, const u8 *hash,
+								   struct page *page, unsigned int offset)
+{
+	struct page *copy;
+	unsigned int copy_offset = 0;
+	char *src, *dst;
+	int same, locked = 0;
+
+	copy = dedup_cache_get_page(crc, hash);
+	if (!copy) {
+		copy = dedup_class_get_page(block, &copy_offset, 0);
+		// A resident page is compared under its lock, without waiting for it
+		if (copy && (copy == page || !trylock_page(copy))) {
+			put_page(copy);
+			copy = NULL;
+		}
+		else if (copy && !dedup_block_data_stable(copy, copy_offset)) {
+			unlock_page(copy);
+			put_page(copy);
+			copy = NULL;
+		}
+		locked = (copy != NULL);
+	}
+
+	if (!copy)
+		return -1;
+
+	src = kmap_atomic(copy);
+	dst = kmap_atomic(page);
+	same = (memcmp(src + copy_offset, dst + offset, dedup_get_block_size()) == 0);
+	kunmap_atomic(dst);
+	kunmap_atomic(src);
+	if (locked)
+		unlock_page(copy);
+	put_page(copy);
+
+	return same;
+}
+
+/*
+ * Called for each write bio to our block device before it's tracked.
+ * return 1 if all its blocks already have its content, and it was completed
+ */
+int dedup_suppress_same_write(struct bio *bio)
+{
+	size_t block_size = dedup_get_block_size();
+	u8 hash[SHA256_DIGEST_SIZE], block_hash[SHA256_DIGEST_SIZE];
+	struct dedup_write_cpu *wc;
+	struct bio_vec *bvec;
+	ktime_t start = ktime_get();
+	unsigned long flags, word, written;
+	unsigned int offset;
+	sector_t block;
+	int i, nr_blocks, same = 1, collision = 0;
+	u32 crc;
+
+	if (!same_writes_on || !write_pool || !bio->bi_size ||
+		(bio->bi_rw & (REQ_FLUSH | REQ_FUA | REQ_DISCARD | REQ_WRITE_SAME)))
+		return 0;
+
+	// Only whole blocks
+	if ((bio->bi_sector & ((block_size >> 9) - 1)) || (bio->bi_size % block_size))
+		return 0;
+
+	nr_blocks = bio->bi_size / block_size;
+	block = dedup_sector_to_block(bio->bi_sector);
+	if (nr_blocks > DEDUP_SAME_MAX_BLOCKS)
+		return 0;
+
+	// Every block must have a known content, before any of them is hashed
+	for (i = 0; i < nr_blocks; ++i) {
+		if (!dedup_block_is_known(block + i))
+			return 0;
+	}
+
+	bio_for_each_segment(bvec, bio, i) {
+		if (bvec->bv_len & (block_size - 1)) {
+			same = 0;
+			break;
+		}
+
+		for (offset = bvec->bv_offset; same == 1 && offset < bvec->bv_offset + bvec->bv_len;
+			 offset += block_size, ++block) {
+			// A pattern block's data is compared as is
+			if (dedup_get_block_pattern(block, &word)) {
+				same = (dedup_page_pattern(bvec->bv_page, offset, &written) &&
+						written == word);
+				continue;
+			}
+
+			if (!dedup_get_block_hash(block, block_hash, &crc)) {
+				same = 0;
+				break;
+			}
+
+			wc = get_cpu_ptr(write_cpus);
+			dedup_hash_block_page(wc->same_tfm, bvec->bv_page, offset, hash);
+			put_cpu_ptr(write_cpus);
+
+			if (memcmp(hash, block_hash, SHA256_DIGEST_SIZE) != 0) {
+				same = 0;
+				break;
+			}
+
+			same = dedup_verify_same_block(block, crc, hash, bvec->bv_page, offset);
+			// Hashes matched but the data didn't
+			if (!same)
+				collision = 1;
+		}
+
+		if (same != 1)
+			break;
+	}
+
+	spin_lock_irqsave(&write_stats_lock, flags);
+	++same_checked_count;
+	if (same == 1) {
+		++same_write_count;
+		same_block_count += nr_blocks;
+		same_total_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	}
+	else if (same == -1)
+		++same_unverified_count;
+	else if (collision)
+		++same_mismatch_count;
+	spin_unlock_irqrestore(&write_stats_lock, flags);
+
+	if (same != 1)
+		return 0;
+
+	bio_endio(bio, 0);
+	return 1;
+}
+
+/*
+ * Turns identical writes suppression on/off
+ */
+void dedup_set_same_writes(int on)
+{
+	same_writes_on = on;
+}
+
+/*
+ * Called for each write bio to our block device, before it's sent.
+ * Marks the blocks it covers as pending and hooks its completion.
+ */
+void dedup_make_write_request(struct bio *bio)
+{
+	size_t block_size = dedup_get_block_size();
+	int block_shift = ilog2(block_size);
+	u64 start = (u64)bio->bi_sector << 9, end = start + bio->bi_size;
+	sector_t first_block, last_block, block, n;
+	struct dedup_write_bio *wb;
+	u8 hash[SHA256_DIGEST_SIZE];
+	struct bio_vec *bvec;
+	u32 crc;
+	int known, i;
+
+	if (!bio->bi_size)
+		return;
+
+	// A written page doesn't hold the block it was read from anymore, even
+	// if the write is out of range or its blocks are not hashed
+	if (!(bio->bi_rw & REQ_DISCARD)) {
+		bio_for_each_segment(bvec, bio, i)
+			dedup_clear_page_block(bvec->bv_page);
+	}
+
+	first_block = start >> block_shift;
+	last_block = (end - 1) >> block_shift;
+
+	for (block = first_block; block <= last_block; ++block) {
+		if (dedup_is_in_range(block))
+			break;
+	}
+	if (block > last_block)
+		return;
+
+	// The block's page stops being a representative of its old content.
+	// It's marked pending first, so a page added meanwhile is removed.
+	// A discarded block's page is found stale by the next lookup.
+	if (bio->bi_rw & REQ_DISCARD) {
+		for (block = first_block; block <= last_block; block += n) {
+			n = min_t(sector_t, last_block - block + 1, DEDUP_DISCARD_CHUNK_BLOCKS);
+			dedup_blocks_write_start(block, n);
+		}
+	}
+	else {
+		for (block = first_block; block <= last_block; ++block) {
+			known = dedup_get_block_hash(block, hash, &crc);
+			dedup_block_write_start(block);
+			if (known)
+				dedup_class_remove_block_hash(block, crc, hash);
+		}
+	}
+
+	wb = (write_pool) ? mempool_alloc(write_pool, GFP_NOIO) : NULL;
+	if (!wb) {
+		// No one will hash them
+		for (block = first_block; block <= last_block; ++block)
+			dedup_block_write_end(block, 0);
+		return;
+	}
+
+	wb->bio = bio;
+	wb->bi_end_io = bio->bi_end_io;
+	wb->bi_private = bio->bi_private;
+	wb->idx = bio->bi_idx;
+	wb->first_block = first_block;
+	wb->nr_blocks = last_block - first_block + 1;
+	wb->head = start & (block_size - 1);
+	wb->tail = end & (block_size - 1);
+	wb->err = 0;
+	wb->start = ktime_get();
+
+	bio->bi_end_io = dedup_write_end_io;
+	bio->bi_private = wb;
+}
+
+/*
+ * Creates the write workers, called once the dedup structure is built
+ */
+int dedup_write_init(void)
+{
+	struct dedup_write_cpu *wc;
+	int cpu;
+
+	if (write_pool)
+		return 0;
+
+	write_cpus = alloc_percpu(struct dedup_write_cpu);
+	if (!write_cpus)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		wc = per_cpu_ptr(write_cpus, cpu);
+		spin_lock_init(&wc->lock);
+		INIT_LIST_HEAD(&wc->bios);
+		INIT_WORK(&wc->work, dedup_write_work);
+		wc->tfm = crypto_alloc_hash("sha256", 0, CRYPTO_ALG_ASYNC);
+		if (IS_ERR(wc->tfm)) {
+			wc->tfm = NULL;
+			goto fail;
+		}
+		wc->same_tfm = crypto_alloc_hash("sha256", 0, CRYPTO_ALG_ASYNC);
+		if (IS_ERR(wc->same_tfm)) {
+			wc->same_tfm = NULL;
+			goto fail;
+		}
+	}
+
+	// Churn tracking is optional
+	nr_churn_regions = (dedup_get_blocks_count() + DEDUP_CHURN_REGION_BLOCKS - 1) /
+		DEDUP_CHURN_REGION_BLOCKS;
+	churn_regions = vzalloc(nr_churn_regions * sizeof(struct dedup_churn_region));
+	if (!churn_regions) {
+		printk(KERN_ERR "failed to alloc churn regions, churn tracking disabled.\n");
+		nr_churn_regions = 0;
+	}
+
+	// Completing writes may be needed to free memory
+	write_wq = alloc_workqueue("dedup_write", WQ_MEM_RECLAIM, 0);
+	if (!write_wq)
+		goto fail;
+
+	rehash_tfm = crypto_alloc_hash("sha256", 0, CRYPTO_ALG_ASYNC);
+	if (IS_ERR(rehash_tfm)) {
+		rehash_tfm = NULL;
+		goto fail;
+	}
+
+	// Writes are tracked once the pool is set
+	write_pool = mempool_create_kmalloc_pool(DEDUP_WRITE_POOL_SIZE,
+											 sizeof(struct dedup_write_bio));
+	if (!write_pool)
+		goto fail;
+
+	return 0;
+
+fail:
+	vfree(churn_regions);
+	churn_regions = NULL;
+	nr_churn_regions = 0;
+	if (rehash_tfm)
+		crypto_free_hash(rehash_tfm);
+	rehash_tfm = NULL;
+	if (write_wq)
+		destroy_workqueue(write_wq);
+	write_wq = NULL;
+	for_each_possible_cpu(cpu) {
+		wc = per_cpu_ptr(write_cpus, cpu);
+		if (wc->tfm)
+			crypto_free_hash(wc->tfm);
+		if (wc->same_tfm)
+			crypto_free_hash(wc->same_tfm);
+	}
+	free_percpu(write_cpus);
+	write_cpus = NULL;
+
+	return -ENOMEM;
+}
+
+/*
+ * Prints write path statistics, used by stats_show()
+ */
+void dedup_print_write_stats(void)
+{
+	u64 avg_ns = 0, avg_delay_ns = 0;
+
+	if (write_count) {
+		avg_ns = div64_u64(write_total_ns, write_count);
+		avg_delay_ns = div64_u64(write_delay_ns, write_count);
+	}
+
+	printk(KERN_ERR "writes = %ld (failed = %ld) in %ld batches\n",
+		   write_count, failed_write_count, write_batch_count);
+	printk(KERN_ERR "written blocks hashed = %ld, coalesced = %ld, pages recorded = %ld\n",
+		   hashed_block_count, coalesced_block_count, written_page_ref_count);
+	printk(KERN_ERR "partly written blocks = %ld, rehashed = %ld, not queued = %ld\n",
+		   partial_block_count, rehashed_block_count, rehash_dropped_count);
+	printk(KERN_ERR "write latency avg = %llu ns, max = %llu ns, completion delay avg = %llu ns\n",
+		   avg_ns, write_max_ns, avg_delay_ns);
+	printk(KERN_ERR "writes completed before hashing = %ld, blocks changed before hashed = %ld\n",
+		   early_complete_count, changed_block_count);
+	printk(KERN_ERR "discards = %ld, blocks freed = %ld, unlinked = %ld in %ld passes, "
+		   "still linked = %ld\n",
+		   discard_count, freed_block_count, free_unlinked_count, free_sweep_count,
+		   dedup_get_free_linked_blocks());
+	printk(KERN_ERR "write same blocks linked without hashing = %ld\n", linked_block_count);
+	printk(KERN_ERR "written pattern blocks tagged without hashing = %ld, ~%llu us CPU saved\n",
+		   pattern_block_count,
+		   div64_u64(pattern_block_count * ((hashed_block_count) ?
+											div64_u64(hash_total_ns, hashed_block_count) : 0),
+					 1000));
+
+	avg_ns = (hashed_block_count) ? div64_u64(hash_total_ns, hashed_block_count) : 0;
+	printk(KERN_ERR "churn: %ld regions untracked (max = %d writes/s), %ld demoted, %ld readmitted\n",
+		   nr_churning, churn_max_writes, churn_demoted_count, churn_readmitted_count);
+	printk(KERN_ERR "churn: %ld written blocks not hashed, ~%llu us CPU saved (%llu ns/block), "
+		   "reads of untracked blocks = %ld\n",
+		   churn_block_count, div64_u64(avg_ns * churn_block_count, 1000), avg_ns,
+		   churn_read_count);
+
+	printk(KERN_ERR "identical writes = %ld out of %ld checked, %ld KB not written (%s)\n",
+		   same_write_count, same_checked_count,
+		   same_block_count * (long)(dedup_get_block_size() >> 10),
+		   (same_writes_on) ? "on" : "off");
+	printk(KERN_ERR "identical write latency avg = %llu ns, hash matched but data differed = %ld, "
+		   "no copy to verify = %ld\n",
+		   (same_write_count) ? div64_u64(same_total_ns, same_write_count) : 0,
+		   same_mismatch_count, same_unverified_count);
+}
@@ -0,0 +1,403 @@
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/hashtable.h>
+#include <linux/list.h>
+#include <linux/percpu.h>
+#include <linux/lzo.h>
+#include <linux/cleancache.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <crypto/hash.h>
+#include <linux/scatterlist.h>
+#include <linux/dedup.h>
+
+/*
+ * Compressed tier of duplicated content.
+ *
+ * Registered as the cleancache backend, like zcache, by the first 'zpool <KB>'.
+ * 3.10 gives a cleancache pool only to file systems mounted while a backend is
+ * registered, so only file systems mounted after that are covered.
+ * When a clean page of our
+ * block device leaves the page cache and its block has at least
+ * DEDUP_ZPOOL_MIN_CLASS_SIZE equal blocks, the data is compressed with LZO and
+ * kept in RAM, keyed by its hash. Reads of any block with this content are then
+ * decompressed by the read hook instead of going to the block device.
+ * The pool is LRU, bounded by the compressed bytes it holds.
+ * The page's record of the block it was read from is dropped when the page is
+ * written, and the page is hashed again before it's stored, so data that is
+ * not the block's hashed content never lands under its hash.
+ */
+
+#define DEDUP_ZPOOL_HASH_BITS 12
+// Min number of equal blocks for content to be worth keeping
+#define DEDUP_ZPOOL_MIN_CLASS_SIZE 4
+
+struct dedup_zpool_entry {
+	struct hlist_node node;		// hashed by content crc
+	struct list_head lru;
+	u32 crc;
+	u8 hash[SHA256_DIGEST_SIZE];
+	size_t len;					// compressed length
+	u8 data[0];
+};
+
+static DEFINE_HASHTABLE(zpool_entries, DEDUP_ZPOOL_HASH_BITS);
+static LIST_HEAD(zpool_lru);
+static DEFINE_SPINLOCK(zpool_lock);
+
+// Max compressed bytes, 0 means the pool is off
+static size_t zpool_max_bytes = 0;
+static size_t zpool_bytes = 0;
+static long zpool_blocks = 0;
+
+// Per cpu compression buffers, used with interrupts off
+static DEFINE_PER_CPU(void *, zpool_wrkmem);
+static DEFINE_PER_CPU(u8 *, zpool_dst);
+static DEFINE_PER_CPU(struct crypto_hash *, zpool_tfm);
+static int zpool_registered = 0;
+
+// Statistics, protected by zpool_lock
+static long zpool_stores = 0, zpool_rejected = 0, zpool_evictions = 0;
+static long zpool_stale = 0;
+static long zpool_hits = 0, zpool_misses = 0;
+static u64 zpool_orig_bytes = 0, zpool_comp_bytes = 0;
+static u64 zpool_decomp_ns = 0;
+
+/*
+ * Look for an entry with the given content.
+ * Must be called with zpool_lock held.
+ */
+static struct dedup_zpool_entry *dedup_zpool_find(u32 crc, const u8 *hash)
+{
+	struct dedup_zpool_entry *entry;
+
+	hash_for_each_possible(zpool_entries, entry, node, crc) {
+		if (entry->crc == crc && memcmp(entry->hash, hash, SHA256_DIGEST_SIZE) == 0)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/*
+ * Evicts least recently used entries until there's room for len more bytes.
+ * Evicted entries are moved to the list, to be freed without the lock.
+ * Must be called with zpool_lock held.
+ */
+static void dedup_zpool_shrink(size_t len, struct list_head *evicted)
+{
+	struct dedup_zpool_entry *entry;
+
+	while (zpool_bytes + len > zpool_max_bytes && !list_empty(&zpool_lru)) {
+		entry = list_first_entry(&zpool_lru, struct dedup_zpool_entry, lru);
+		hash_del(&entry->node);
+		list_move(&entry->lru, evicted);
+		zpool_bytes -= entry->len;
+		--zpool_blocks;
+		++zpool_evictions;
+	}
+}
+
+static void dedup_zpool_free(struct list_head *evicted)
+{
+	struct dedup_zpool_entry *entry, *tmp;
+
+	list_for_each_entry_safe(entry, tmp, evicted, lru)
+		kfree(entry);
+}
+
+/*
+ * Compresses one block of data and adds it to the pool.
+ * Called with interrupts off, from page cache removal.
+ */
+static void dedup_zpool_store(u32 crc, const u8 *hash, const u8 *src)
+{
+	size_t block_size = dedup_get_block_size();
+	struct dedup_zpool_entry *entry = NULL;
+	size_t len = lzo1x_worst_compress(block_size);
+	LIST_HEAD(evicted);
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&zpool_lock, flags);
+	if (dedup_zpool_find(crc, hash)) {
+		spin_unlock_irqrestore(&zpool_lock, flags);
+		return;
+	}
+	spin_unlock_irqrestore(&zpool_lock, flags);
+
+	local_irq_save(flags);
+	ret = lzo1x_1_compress(src, block_size, __this_cpu_read(zpool_dst), &len,
+						   __this_cpu_read(zpool_wrkmem));
+	// Don't keep content that doesn't compress
+	if (ret == LZO_E_OK && len < block_size) {
+		entry = kmalloc(sizeof(*entry) + len, GFP_ATOMIC | __GFP_NOWARN);
+		if (entry)
+			memcpy(entry->data, __this_cpu_read(zpool_dst), len);
+	}
+	local_irq_restore(flags);
+
+	spin_lock_irqsave(&zpool_lock, flags);
+	if (!entry) {
+		++zpool_rejected;
+	}
+	else if (dedup_zpool_find(crc, hash)) {
+		list_add(&entry->lru, &evicted);
+	}
+	else {
+		entry->crc = crc;
+		memcpy(entry->hash, hash, SHA256_DIGEST_SIZE);
+		entry->len = len;
+
+		dedup_zpool_shrink(len, &evicted);
+		hash_add(zpool_entries, &entry->node, crc);
+		list_add_tail(&entry->lru, &zpool_lru);
+		zpool_bytes += len;
+		++zpool_blocks;
+		++zpool_stores;
+		zpool_orig_bytes += block_size;
+		zpool_comp_bytes += len;
+	}
+	spin_unlock_irqrestore(&zpool_lock, flags);
+
+	dedup_zpool_free(&evicted);
+}
+
+/*
+ * Decompresses the content into dst.
+ * return 1 if the content was in the pool
+ */
+int dedup_zpool_load(u32 crc, const u8 *hash, u8 *dst)
+{
+	size_t block_size = dedup_get_block_size();
+	struct dedup_zpool_entry *entry;
+	size_t len = block_size;
+	unsigned long flags;
+	ktime_t start;
+	int ret = 0;
+
+	if (!zpool_max_bytes)
+		return 0;
+
+	spin_lock_irqsave(&zpool_lock, flags);
+	entry = dedup_zpool_find(crc, hash);
+	if (entry) {
+		start = ktime_get();
+		ret = (lzo1x_decompress_safe(entry->data, entry->len, dst, &len) == LZO_E_OK &&
+			   len == block_size);
+		zpool_decomp_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+		list_move_tail(&entry->lru, &zpool_lru);
+	}
+
+	if (ret)
+		++zpool_hits;
+	else
+		++zpool_misses;
+	spin_unlock_irqrestore(&zpool_lock, flags);
+
+	return ret;
+}
+
+/*
+ * Checks the page still holds the content with the hash, with the cpu's
+ * transform.
+ * Called with interrupts off.
+ */
+static int dedup_zpool_page_matches(struct page *page, const u8 *hash)
+{
+	u8 page_hash[SHA256_DIGEST_SIZE];
+	struct hash_desc desc;
+	struct scatterlist sg;
+
+	desc.tfm = __this_cpu_read(zpool_tfm);
+	desc.flags = 0;
+	sg_init_table(&sg, 1);
+	sg_set_page(&sg, page, PAGE_SIZE, 0);
+	if (crypto_hash_digest(&desc, &sg, PAGE_SIZE, page_hash))
+		return 0;
+
+	return !memcmp(page_hash, hash, SHA256_DIGEST_SIZE);
+}
+
+/*
+ * cleancache callbacks.
+ * Everything is keyed by content, so there is nothing to invalidate and pages
+ * are served by the read hook, not by cleancache_get_page().
+ */
+static int dedup_zpool_init_fs(size_t pagesize)
+{
+	return 0;
+}
+
+static int dedup_zpool_init_shared_fs(char *uuid, size_t pagesize)
+{
+	return 0;
+}
+
+static int dedup_zpool_get_page(int pool_id, struct cleancache_filekey key,
+								pgoff_t index, struct page *page)
+{
+	return -1;
+}
+
+static void dedup_zpool_put_page(int pool_id, struct cleancache_filekey key,
+								 pgoff_t index, struct page *page)
+{
+	u8 hash[SHA256_DIGEST_SIZE];
+	unsigned long flags;
+	sector_t block;
+	u32 crc;
+	u8 *src;
+	int match;
+
+	if (dedup_wait_for_init() || !dedup_get_page_block(page, &block))
+		return;
+
+	// The page can't serve reads of its equal blocks anymore
+	dedup_class_remove_block(block);
+
+	if (!zpool_max_bytes || dedup_get_block_size() != PAGE_SIZE)
+		return;
+
+	// Keep only content of blocks that have enough equal blocks
+	if (dedup_get_class_size(block, DEDUP_ZPOOL_MIN_CLASS_SIZE) < DEDUP_ZPOOL_MIN_CLASS_SIZE ||
+		!dedup_get_block_hash(block, hash, &crc))
+		return;
+
+	// The page may have been written with other data since it was read
+	local_irq_save(flags);
+	match = dedup_zpool_page_matches(page, hash);
+	local_irq_restore(flags);
+	if (!match) {
+		spin_lock_irqsave(&zpool_lock, flags);
+		++zpool_stale;
+		spin_unlock_irqrestore(&zpool_lock, flags);
+		return;
+	}
+
+	src = kmap_atomic(page);
+	dedup_zpool_store(crc, hash, src);
+	kunmap_atomic(src);
+}
+
+static void dedup_zpool_invalidate_page(int pool_id, struct cleancache_filekey key,
+										pgoff_t index)
+{
+}
+
+static void dedup_zpool_invalidate_inode(int pool_id, struct cleancache_filekey key)
+{
+}
+
+static void dedup_zpool_invalidate_fs(int pool_id)
+{
+}
+
+static struct cleancache_ops dedup_cleancache_ops = {
+	.init_fs = dedup_zpool_init_fs,
+	.init_shared_fs = dedup_zpool_init_shared_fs,
+	.get_page = dedup_zpool_get_page,
+	.put_page = dedup_zpool_put_page,
+	.invalidate_page = dedup_zpool_invalidate_page,
+	.invalidate_inode = dedup_zpool_invalidate_inode,
+	.invalidate_fs = dedup_zpool_invalidate_fs,
+};
+
+/*
+ * Frees the compression buffers of all cpus
+ */
+static void dedup_zpool_free_buffers(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		kfree(per_cpu(zpool_wrkmem, cpu));
+		kfree(per_cpu(zpool_dst, cpu));
+		if (per_cpu(zpool_tfm, cpu))
+			crypto_free_hash(per_cpu(zpool_tfm, cpu));
+		per_cpu(zpool_wrkmem, cpu) = NULL;
+		per_cpu(zpool_dst, cpu) = NULL;
+		per_cpu(zpool_tfm, cpu) = NULL;
+	}
+}
+
+/*
+ * Allocates compression buffers and registers as cleancache backend.
+ * Fails if another cleancache backend is registered, its ops are put back.
+ */
+static int dedup_zpool_register(void)
+{
+	struct cleancache_ops old_ops;
+	struct crypto_hash *tfm;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		per_cpu(zpool_wrkmem, cpu) = kmalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
+		per_cpu(zpool_dst, cpu) = kmalloc(lzo1x_worst_compress(PAGE_SIZE), GFP_KERNEL);
+		tfm = crypto_alloc_hash("sha256", 0, CRYPTO_ALG_ASYNC);
+		per_cpu(zpool_tfm, cpu) = (IS_ERR(tfm)) ? NULL : tfm;
+
+		if (!per_cpu(zpool_wrkmem, cpu) || !per_cpu(zpool_dst, cpu) ||
+			!per_cpu(zpool_tfm, cpu)) {
+			printk(KERN_ERR "failed to alloc zpool compression buffers.\n");
+			dedup_zpool_free_buffers();
+			return -1;
+		}
+	}
+
+	old_ops = cleancache_register_ops(&dedup_cleancache_ops);
+	if (old_ops.init_fs) {
+		printk(KERN_WARNING "zpool: another cleancache backend is registered, zpool stays off.\n");
+		cleancache_register_ops(&old_ops);
+		dedup_zpool_free_buffers();
+		return -1;
+	}
+	zpool_registered = 1;
+
+	return 0;
+}
+
+/*
+ * Sets max compressed KB kept in the pool, 0 turns the pool off and empties it
+ */
+void dedup_zpool_set_size(size_t max_kb)
+{
+	LIST_HEAD(evicted);
+	unsigned long flags;
+
+	if (max_kb && !zpool_registered && dedup_zpool_register())
+		return;
+
+	spin_lock_irqsave(&zpool_lock, flags);
+	zpool_max_bytes = max_kb << 10;
+	dedup_zpool_shrink(0, &evicted);
+	spin_unlock_irqrestore(&zpool_lock, flags);
+
+	dedup_zpool_free(&evicted);
+}
+
+/*
+ * Prints compressed pool statistics, used by stats_show()
+ */
+void dedup_print_zpool_stats(void)
+{
+	printk(KERN_ERR "zpool blocks = %ld, %zu KB (max = %zu KB)\n",
+		   zpool_blocks, zpool_bytes >> 10, zpool_max_bytes >> 10);
+	printk(KERN_ERR "zpool stores = %ld, incompressible = %ld, evictions = %ld\n",
+		   zpool_stores, zpool_rejected, zpool_evictions);
+	printk(KERN_ERR "zpool pages not holding their block's content = %ld\n", zpool_stale);
+	if (zpool_comp_bytes) {
+		u64 ratio = div64_u64(zpool_orig_bytes * 100, zpool_comp_bytes);
+		u32 frac;
+
+		ratio = div_u64_rem(ratio, 100, &frac);
+		printk(KERN_ERR "zpool compression ratio = %llu.%02u\n", ratio, frac);
+	}
+	printk(KERN_ERR "zpool hits (reads avoided) = %ld, misses = %ld\n",
+		   zpool_hits, zpool_misses);
+	if (zpool_hits)
+		printk(KERN_ERR "zpool decompression avg = %llu ns\n",
+			   div64_u64(zpool_decomp_ns, zpool_hits));
+}
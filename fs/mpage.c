@@ -323,33 +323,34 @@ confused:
 	goto out;
 }
 
-int dedup_alloc_and_copy_page(struct page* p1, sector_t block1, struct page* p2){
-	//struct buffer_head* p1_bh;
-	//struct buffer_head *p2_bh = page_buffers(p2);
-	// Copy p2 into p1
-	//if (page_has_buffers(p1))
-	//		printk(KERN_ERR "not good, page has buffers...\n");
-	//else
-	//	create_empty_buffers(p1, dedup_get_block_size(), 0);
-	//page_cache_get(p1);
-	//memset(page_address(p1), 0, 10);//page_address(p2), PAGE_SIZE);
-	//page_cache_release(p1);
-	/*SetPageUptodate(p1);
-	// Create buffers to be mapped to p1
-	if (page_has_buffers(p1))
-		printk(KERN_ERR " not good, page has buffers...\n");
-	else
-		create_empty_buffers(p1, dedup_get_block_size(), 0);
-	// Update buffer's block
-	p1_bh = page_buffers(p1);
-
-	p1_bh->b_bdev = p2_bh->b_bdev;
-	p1_bh->b_blocknr = block1;
-	set_buffer_uptodate(p1_bh);
-	set_buffer_mapped(p1_bh);
-	SetPageMappedToDisk(p1);
-	// Update block's page inside dedup structure
-	dedup_update_block_page(p1);*/
+/*
+ * Fills page, locked and not read yet, with a copy of src's data at offset.
+ * src is only used if it's still a clean page of the page cache holding it.
+ * return 1 if the page was filled and unlocked
+ */
+static int dedup_copy_page(struct page *page, struct page *src, unsigned int offset)
+{
+	char *from, *to;
+
+	// Never wait on another page while holding ours locked
+	if (!trylock_page(src))
+		return 0;
+
+	if (!src->mapping || !PageUptodate(src) || PageDirty(src) || PageWriteback(src)) {
+		unlock_page(src);
+		return 0;
+	}
+
+	from = kmap_atomic(src);
+	to = kmap_atomic(page);
+	memcpy(to, from + offset, PAGE_CACHE_SIZE);
+	kunmap_atomic(to);
+	kunmap_atomic(from);
+	unlock_page(src);
+
+	flush_dcache_page(page);
+	SetPageUptodate(page);
+	unlock_page(page);
 
 	return 1;
 }
@@ -357,17 +358,18 @@ int dedup_alloc_and_copy_page(struct page* p1, sector_t block1, struct page* p2)
 /**
  * This function will try to spare read operation from block device
  * by looking for a cached page contains equal data.
- * Each page may contain several blocks, so we need to go over all requested
- * blocks and check if there is an equal block inside a cached page.
- * If and equal block found and the associated page is cached right now,
- * we will copy the relevant data.
+ * If an equal block is found and the associated page is cached right now,
+ * its data is copied into the page, which is then up to date and unlocked.
+ * Only pages of one block are served, a page of several blocks would need
+ * all of them to be found.
+ * return 1 if the page was filled
  */
 int dedup_get_duplicated_page(struct page *page)
 {
 	int ret = 0;
 	struct page *duplicated_page;
-	sector_t block_offset_in_page, next_equal_block;
 	sector_t *blocks = NULL;
+	unsigned int offset;
 	int nr_blocks;
 
 	// Check if the page is associated with our block device
@@ -376,15 +378,10 @@ int dedup_get_duplicated_page(struct page *page)
 	}
 
 	// Get requested blocks
-	// Todo: for now, we assume block size equals page size
 	blocks = dedup_get_page_physical_blocks(page, &nr_blocks);
-	if (!blocks)
+	if (!blocks || nr_blocks != 1)
 		goto done_dedup;
 
-	if (nr_blocks > 1)
-		printk("nr_blocks is more than 1 8-O !\n");
-
-	// Todo: add support if there is more than 1 block in page - check them all
 	// Check if the requested blocks are inside our dedup range
 	if (dedup_is_in_range(blocks[0]))
 		// Used for statistics - counts total reads
@@ -392,48 +389,21 @@ int dedup_get_duplicated_page(struct page *page)
 	else
 		goto done_dedup;
 
-	// Get next equal block of first requested block
-	block_offset_in_page = 0;
-	next_equal_block = dedup_get_next_equal_block(blocks[block_offset_in_page]);
-	if (next_equal_block == blocks[block_offset_in_page])
+	if (!dedup_block_has_duplicates(blocks[0]))
 		// No equal block...
 		goto done_dedup;
 
-	// Lets get all blocks from cache (if exist)
-	do {
-		// try to get block's page in cache, need to call put_page before leaving
-		duplicated_page = dedup_get_block_page(next_equal_block);
-
-		// Check if we found the page should contain the duplicated block
-		if (duplicated_page) {
-			// TODO: we need to copy page content to avoid read from bdev
-			dedup_alloc_and_copy_page(page, blocks[block_offset_in_page], duplicated_page);
-
-			// block was copied, continue to the next one (if there is...)
-			block_offset_in_page++;
-			if (block_offset_in_page < nr_blocks) {
-				// Todo: add support for more than 1 block in page
-				BUG_ON(1);
-				next_equal_block = dedup_get_next_equal_block(blocks[block_offset_in_page]);
-			}
+	// Get a cached page of an equal block (if exists), one lookup no matter
+	// how many equal blocks there are. Need to call put_page before leaving.
+	duplicated_page = dedup_class_get_page(blocks[0], &offset, 1);
+	if (duplicated_page) {
+		ret = dedup_copy_page(page, duplicated_page, offset);
+		page_cache_release(duplicated_page);
+		if (ret) {
+			// The page now holds its block's content
+			dedup_update_block_page(page);
+			dedup_add_equal_read();
 		}
-		else {
-			// Try next duplicated block
-			next_equal_block = dedup_get_next_equal_block(next_equal_block);
-		}
-
-		// Check if the page was cached
-		if  (duplicated_page) {
-			// We must call page_put because we used page_get inside dedup_get_block_page
-			page_cache_release(duplicated_page);
-		}
-	// Loop until we got all blocks
-	} while ((next_equal_block != blocks[block_offset_in_page]) &&
-			block_offset_in_page < nr_blocks);
-
-	// did we get all blocks
-	if (block_offset_in_page == nr_blocks) {
-		dedup_add_equal_read();
 	}
 done_dedup:
 	if (blocks)
@@ -512,11 +482,6 @@ mpage_readpages(struct address_space *mapping, struct list_head *pages,
 				if (!dedup_wait_for_init())
 					dedup_update_block_page(page);
 			}
-			else
-			{
-				// TODO: remove...
-				printk(KERN_ERR "kululu duplicated found! :))))\n");
-			}
 		}
 		page_cache_release(page);
 	}
@@ -5,6 +5,8 @@
 
 #include <crypto/sha.h>
 
+struct bio;
+
 // Definitions
 #define DEDUP_ON 	1
 #define DEDUP_OFF 	0
@@ -13,13 +15,54 @@
 
 #define DEDUP_BDEV_NAME "/dev/sda1"
 
+// Read redirection modes
+#define DEDUP_REDIRECT_OFF	0
+#define DEDUP_REDIRECT_SEEK	1
+#define DEDUP_REDIRECT_LOAD	2
+
+// Max equal blocks counted when weighting a class
+#define DEDUP_CLASS_SIZE_MAX_WALK 256
+
+// Dedup domain: our block device and the devices enrolled with it.
+// A domain block number holds the device index in its high bits, device 0
+// being our block device, so its block numbers are unchanged.
+// Needs a 64 bit sector_t (CONFIG_LBDAF on 32 bit).
+#define DEDUP_MAX_DEVS 8
+#define DEDUP_DEV_BLOCK_BITS 40
+#define DEDUP_BLOCK_DEV(block) ((int)((block) >> DEDUP_DEV_BLOCK_BITS))
+#define DEDUP_DEV_BLOCK(block) ((block) & ((1ULL << DEDUP_DEV_BLOCK_BITS) - 1))
+#define DEDUP_DEV_TO_BLOCK(dev, block) (((sector_t)(dev) << DEDUP_DEV_BLOCK_BITS) + (block))
+
 // Variables
 
+// Page cache position of a block's page, ino 0 means no page,
+// DEDUP_BDEV_INO means a page of the block device's own page cache
+// and DEDUP_SWAP_INO a page of the swap cache (index is the swap offset)
+#define DEDUP_BDEV_INO	U32_MAX
+#define DEDUP_SWAP_INO	(U32_MAX - 1)
+
+struct dedup_page_ref {
+	u32 ino;					// inode of the file holding the block
+	u32 index;					// page index inside the file
+};
+
+// Block write state: 0 when the block's hash is its content, otherwise the
+// number of writes in flight or waiting to be hashed, DEDUP_BLOCK_FREE once
+// discarded, DEDUP_BLOCK_REHASH while its data is read back to be hashed,
+// or DEDUP_BLOCK_UNKNOWN. A block that reaches DEDUP_BLOCK_MAX_PENDING
+// writes stays pending, its count is lost.
+#define DEDUP_BLOCK_MAX_PENDING	65532
+#define DEDUP_BLOCK_FREE		65533
+#define DEDUP_BLOCK_REHASH		65534
+#define DEDUP_BLOCK_UNKNOWN		65535
+
 struct dedup_blk_info{
 	u8 **hashes;				// sha256 of block data
-	struct page **pages;		// reference to block's page
+	struct dedup_page_ref *page_refs;	// where block's page was read to
 	u32 *hash_crc;				// crc value of block sha256
 	sector_t *equal_blocks;		// circular vector of equal blocks
+	u16 *write_state;			// writes pending on block
+	u8 *pattern;				// block is one word repeated, not hashed
 };
 
 // Functions
@@ -32,17 +75,100 @@ void dedup_remove_block_duplication(sector_t block);
 void dedup_calc_block_hash_crc(sector_t block);
 sector_t dedup_get_next_equal_block(sector_t block);
 int dedup_update_page_changed(sector_t block, char* block_data);
+int dedup_update_block_hash(sector_t block, const u8 *hash);
+void dedup_invalidate_block(sector_t block);
+int calc_hash(char* data, size_t size, u8* hash_out);
 sector_t *dedup_get_page_physical_blocks(struct page *page, int *nr_blocks);
 // Help
 int dedup_wait_for_init(void);
 size_t dedup_get_block_size(void);
 struct page* dedup_get_block_page(sector_t nBlock);
+struct page *dedup_get_block_data(sector_t block, unsigned int *offset, int may_sleep);
+int dedup_block_data_stable(struct page *page, unsigned int offset);
 int dedup_is_in_range(sector_t block);
 int dedup_is_our_bdev(struct block_device *bdev);
+int dedup_map_bio(struct bio *bio);
+void dedup_unmap_bio(struct bio *bio);
+struct block_device* get_our_bdev(void);
 void dedup_update_block_page(struct page *page);
+void dedup_set_block_page_ref(sector_t block, struct page *page);
+int dedup_is_bdev_page(struct page *page);
+void dedup_set_page_block(struct page *page, sector_t block);
+int dedup_get_page_block(struct page *page, sector_t *block);
+void dedup_clear_page_block(struct page *page);
+sector_t dedup_sector_to_block(sector_t sector);
+int dedup_get_block_hash(sector_t block, u8 *hash_out, u32 *crc_out);
+int dedup_block_has_duplicates(sector_t block);
+int dedup_block_is_known(sector_t block);
+void dedup_block_write_start(sector_t block);
+int dedup_block_write_pending(sector_t block);
+void dedup_block_write_end(sector_t block, int known);
+int dedup_block_rehash_start(sector_t block);
+int dedup_block_is_rehashing(sector_t block);
+int dedup_block_rehash_end(sector_t block, int known);
+void dedup_blocks_write_start(sector_t block, long nr);
+long dedup_blocks_discard_end(sector_t block, long nr);
+long dedup_get_free_linked_blocks(void);
+long dedup_unlink_free_blocks(long start, long nr);
+long dedup_unlink_free_rings(long start, long nr);
+int dedup_set_block_hash_equal(sector_t block, const u8 *hash, sector_t equal_block);
+void dedup_set_block_pattern(sector_t block, unsigned long word);
+int dedup_get_block_pattern(sector_t block, unsigned long *word);
+int dedup_data_pattern(const void *data, size_t size, unsigned long *word);
+int dedup_read_block(sector_t block, struct page *page);
+dev_t dedup_get_block_dev(sector_t block);
+int dedup_get_class_size(sector_t block, int max);
+long dedup_get_blocks_count(void);
+long dedup_get_block_index(sector_t block);
+sector_t dedup_get_index_block(long index);
+void dedup_dev_add_memory_read(sector_t block);
+void dedup_dev_add_remote_block(sector_t block);
+// Read path (block layer)
+int dedup_make_read_request(struct bio *bio);
+void dedup_track_head(struct bio *bio);
+void dedup_set_redirect_mode(int mode);
+void dedup_set_direct_reads(int on);
+void dedup_set_swap_reads(int on);
+// Write path (block layer)
+int dedup_write_init(void);
+void dedup_make_write_request(struct bio *bio);
+int dedup_suppress_same_write(struct bio *bio);
+void dedup_set_same_writes(int on);
+void dedup_churn_add_read(sector_t block);
+void dedup_set_churn(int max_writes);
+// Content cache
+int dedup_cache_enabled(void);
+struct page *dedup_cache_get_page(u32 crc, const u8 *hash);
+void dedup_cache_insert(u32 crc, const u8 *hash, struct page *page,
+						unsigned int offset, int weight);
+void dedup_cache_pin(u32 crc, const u8 *hash, struct page *page, unsigned int offset);
+void dedup_cache_set_size(long max_blocks);
+// Compressed pool
+int dedup_zpool_load(u32 crc, const u8 *hash, u8 *dst);
+void dedup_zpool_set_size(size_t max_kb);
+// Read heat and prewarm
+void dedup_heat_add_read(sector_t block);
+ssize_t dedup_heat_show(char *buf);
+ssize_t dedup_heat_store(const char *buf, size_t count);
+void dedup_set_prewarm(long budget_kb, int pin);
+// Reclaim hints
+void dedup_set_reclaim_hints(int on);
+// Resident representatives of duplicated content
+void dedup_class_add_block(sector_t block);
+void dedup_class_remove_block(sector_t block);
+void dedup_class_remove_block_hash(sector_t block, u32 crc, const u8 *hash);
+struct page *dedup_class_get_page(sector_t block, unsigned int *offset, int may_sleep);
+void dedup_class_bench(sector_t block, long iterations);
 
 // Count statistics
 void dedup_add_total_read(void);
 void dedup_add_equal_read(void);
+void dedup_print_read_stats(void);
+void dedup_print_write_stats(void);
+void dedup_print_cache_stats(void);
+void dedup_print_zpool_stats(void);
+void dedup_print_reclaim_stats(void);
+void dedup_print_heat_stats(void);
+void dedup_print_class_stats(void);
 
 #endif
@@ -0,0 +1,19 @@
+#!/bin/bash
+# must run as SU
+# Measures the hit rate of reads through the block device's own page cache
+# (buffer heads, raw images), that mpage_readpages never sees.
+# Files are read first so their pages can serve equal blocks of the raw reads.
+# usage: bdev_read_bench.sh <dedup bdev> <dir on it> <first block> <blocks count>
+BDEV=${1:-/dev/sda1}
+DIR=${2:-/}
+FIRST=${3:-0}
+COUNT=${4:-262144}
+
+. drop_pages.sh > /dev/null
+echo "---------- files ----------"
+find $DIR -type f -exec cat {} + > /dev/null
+. cat_dedup.sh
+
+echo "---------- raw device ----------"
+dd if=$BDEV of=/dev/null bs=4k skip=$FIRST count=$COUNT 2>&1 | tail -1
+. cat_dedup.sh
@@ -0,0 +1,36 @@
+#!/bin/bash
+# must run as SU, right after init_dedup.sh
+# Measures the first boot storm after a restart: time until both VMs
+# stop reading from the disk, and how much they read.
+# usage: boot_storm.sh <disk name>
+DISK=${1:-sda}
+
+READS_BEFORE=$(awk '{print $1}' /sys/block/$DISK/stat)
+SECTORS_BEFORE=$(awk '{print $3}' /sys/block/$DISK/stat)
+START=$(date +%s)
+
+qemu-system-i386 -hda /media/dedup/debian1.img -m 256 &
+qemu-system-i386 -hda /media/dedup/debian2.img -m 256 &
+
+# Boot storm is over when the disk was idle for 5 seconds
+LAST=$READS_BEFORE
+IDLE=0
+while [ $IDLE -lt 5 ]
+do
+	sleep 1
+	NOW=$(awk '{print $1}' /sys/block/$DISK/stat)
+	if [ $NOW -eq $LAST ]; then
+		IDLE=$((IDLE + 1))
+	else
+		IDLE=0
+	fi
+	LAST=$NOW
+done
+
+END=$(($(date +%s) - 5))
+READS_AFTER=$(awk '{print $1}' /sys/block/$DISK/stat)
+SECTORS_AFTER=$(awk '{print $3}' /sys/block/$DISK/stat)
+pkill qemu
+
+echo "boot storm: $((END - START)) sec, $((READS_AFTER - READS_BEFORE)) disk reads, $(( (SECTORS_AFTER - SECTORS_BEFORE) / 2048 )) MB"
+. cat_dedup.sh
@@ -0,0 +1,31 @@
+#!/bin/bash
+# must run as SU
+# Rewrites a small region of a loop device as fast as possible (like a
+# journal) next to random reads of the rest, with and without churn tracking.
+# usage: churn_bench.sh <image> <first block> <blocks count>
+IMG=${1:-/media/dedup/debian1.img}
+FIRST=${2:-0}
+COUNT=${3:-262144}
+
+LOOP=$(losetup -f --show $IMG)
+
+echo "setbd $LOOP" > /sys/kernel/dedup/stats
+echo "range $FIRST $((FIRST + COUNT - 1))" > /sys/kernel/dedup/stats
+echo "block $FIRST" > /sys/kernel/dedup/stats
+echo "dedup $COUNT" > /sys/kernel/dedup/stats
+
+for max in 0 32
+do
+	echo "churn $max" > /sys/kernel/dedup/stats
+	echo "---------- churn $max ----------"
+	fio --name=journal_$max --filename=$LOOP --rw=write --bs=4k --direct=1 \
+		--fsync=1 --runtime=30 --time_based \
+		--offset=$((FIRST * 4096)) --size=1M \
+		--name=reads_$max --filename=$LOOP --rw=randread --bs=4k --direct=0 \
+		--runtime=30 --time_based \
+		--offset=$(((FIRST + 256) * 4096)) --size=$(((COUNT - 256) * 4096)) | grep -E "iops|lat"
+	. cat_dedup.sh
+done
+
+echo "churn 32" > /sys/kernel/dedup/stats
+losetup -d $LOOP
@@ -0,0 +1,20 @@
+#!/bin/bash
+# must run as SU
+# Times lookups of a cached page equal to a block of a large class,
+# walking the equal blocks vs. using the class representatives.
+# usage: class_bench.sh <block> <iterations> <file holding an equal block>
+BLOCK=${1:-0}
+ITERATIONS=${2:-100000}
+FILE=$3
+
+# Cold: no page of the class is cached, the walk goes over the whole class
+. drop_pages.sh > /dev/null
+echo "---------- cold ----------"
+echo "bench $BLOCK $ITERATIONS" > /sys/kernel/dedup/stats
+dmesg | tail -2
+
+# Warm: read a file with an equal block through the page cache first
+cat $FILE > /dev/null
+echo "---------- warm ----------"
+echo "bench $BLOCK $ITERATIONS" > /sys/kernel/dedup/stats
+dmesg | tail -2
@@ -0,0 +1,33 @@
+#!/bin/bash
+# must run as SU
+# Compares O_DIRECT random reads with and without serving them from memory,
+# on a loop device. Files of the image are read first through the page cache
+# so their pages can serve equal blocks.
+# usage: direct_bench.sh <image> <first block> <blocks count>
+IMG=${1:-/media/dedup/debian1.img}
+FIRST=${2:-0}
+COUNT=${3:-262144}
+
+LOOP=$(losetup -f --show $IMG)
+
+echo "setbd $LOOP" > /sys/kernel/dedup/stats
+echo "range $FIRST $((FIRST + COUNT - 1))" > /sys/kernel/dedup/stats
+echo "block $FIRST" > /sys/kernel/dedup/stats
+echo "dedup $COUNT" > /sys/kernel/dedup/stats
+echo "cache 16384" > /sys/kernel/dedup/stats
+
+for mode in off on
+do
+	echo "odir $mode" > /sys/kernel/dedup/stats
+	. drop_pages.sh > /dev/null
+	dd if=$LOOP of=/dev/null bs=4k skip=$FIRST count=$COUNT 2> /dev/null
+	echo "---------- odir $mode ----------"
+	fio --name=direct_$mode --filename=$LOOP --rw=randread --bs=4k \
+		--direct=1 --iodepth=16 --ioengine=libaio --runtime=60 --time_based \
+		--offset=$((FIRST * 4096)) --size=$((COUNT * 4096)) | grep -E "iops|lat"
+	. cat_dedup.sh
+done
+
+echo "odir off" > /sys/kernel/dedup/stats
+echo "cache 0" > /sys/kernel/dedup/stats
+losetup -d $LOOP
@@ -0,0 +1,32 @@
+#!/bin/bash
+# must run as SU
+# Discards and zeroes parts of a loop device and prints how many blocks were
+# freed and unlinked, and how long the discards took.
+# usage: discard_bench.sh <image> <first block> <blocks count>
+IMG=${1:-/media/dedup/debian1.img}
+FIRST=${2:-0}
+COUNT=${3:-262144}
+
+LOOP=$(losetup -f --show $IMG)
+
+echo "setbd $LOOP" > /sys/kernel/dedup/stats
+echo "range $FIRST $((FIRST + COUNT - 1))" > /sys/kernel/dedup/stats
+echo "block $FIRST" > /sys/kernel/dedup/stats
+echo "dedup $COUNT" > /sys/kernel/dedup/stats
+
+echo "---------- small discards ----------"
+time for i in $(seq 0 255)
+do
+	blkdiscard -o $(((FIRST + i * 64) * 4096)) -l $((16 * 4096)) $LOOP
+done
+. cat_dedup.sh
+
+echo "---------- bulk discard ----------"
+time blkdiscard -o $(((FIRST + COUNT / 2) * 4096)) -l $((COUNT / 2 * 4096)) $LOOP
+. cat_dedup.sh
+
+echo "---------- zeroing ----------"
+time blkdiscard -z -o $((FIRST * 4096)) -l $((COUNT / 4 * 4096)) $LOOP
+. cat_dedup.sh
+
+losetup -d $LOOP
@@ -0,0 +1,43 @@
+#!/bin/bash
+# must run as SU
+# Writes data with the given duplicate percentage to a plain loop device and
+# to a dedup target on loop devices, and prints the space the target used.
+# usage: dm_dedup_bench.sh <size MB> <dedupe percentage> [block sectors]
+SIZE=${1:-1024}
+DUP=${2:-50}
+BLOCK_SECTORS=${3:-8}
+DIR=/tmp/dm_dedup
+
+mkdir -p $DIR
+truncate -s ${SIZE}M $DIR/plain.img $DIR/data.img
+# Map and hashes take 40 bytes per block
+truncate -s $((SIZE * 40 / (BLOCK_SECTORS * 512) + 1))M $DIR/meta.img
+dd if=/dev/zero of=$DIR/meta.img bs=1M count=1 conv=notrunc 2>/dev/null
+
+PLAIN=$(losetup -f --show $DIR/plain.img)
+DATA=$(losetup -f --show $DIR/data.img)
+META=$(losetup -f --show $DIR/meta.img)
+dmsetup create dedup_bench --table "0 $((SIZE * 2048)) dedup $META $DATA $BLOCK_SECTORS"
+
+for DEV in $PLAIN /dev/mapper/dedup_bench
+do
+	echo "---------- $DEV ----------"
+	fio --name=dedup --filename=$DEV --rw=write --bs=$((BLOCK_SECTORS * 512)) \
+		--size=$((SIZE * 3 / 4))M --direct=1 --ioengine=libaio --iodepth=32 \
+		--dedupe_percentage=$DUP --refill_buffers --group_reporting | grep -E "WRITE|bw="
+done
+
+echo "---------- dedup status ----------"
+echo "mapped stored/physical reads zero_reads writes dedup zero_writes discarded freed commits"
+dmsetup status dedup_bench
+
+echo "---------- rewrite and gc ----------"
+fio --name=dedup --filename=/dev/mapper/dedup_bench --rw=randwrite --bs=$((BLOCK_SECTORS * 512)) \
+	--size=$((SIZE / 4))M --direct=1 --ioengine=libaio --iodepth=32 \
+	--dedupe_percentage=$DUP --refill_buffers --group_reporting | grep -E "WRITE|bw="
+dmsetup message dedup_bench 0 gc
+dmsetup status dedup_bench
+
+dmsetup remove dedup_bench
+losetup -d $PLAIN $DATA $META
+rm -rf $DIR
@@ -0,0 +1,35 @@
+#!/bin/bash
+# must run as SU, before the dedup structure is built
+# Puts two loop devices holding the same VM image in one dedup domain, then
+# reads all of the second one: its duplicated blocks are served from the
+# pages of the first one, and the per device stats show it.
+# usage: domain_bench.sh <image> [block size]
+IMG=${1:-/media/dedup/debian1.img}
+BS=${2:-4096}
+BLOCKS=$(( $(stat -c %s $IMG) / BS ))
+
+cp $IMG /tmp/domain1.img
+cp $IMG /tmp/domain2.img
+DEV1=$(losetup -f --show /tmp/domain1.img)
+DEV2=$(losetup -f --show /tmp/domain2.img)
+
+echo "setbd $DEV1" > /sys/kernel/dedup/stats
+echo "range 0 $((BLOCKS - 1))" > /sys/kernel/dedup/stats
+echo 'block 0' > /sys/kernel/dedup/stats
+echo "enrol $DEV2 $BLOCKS" > /sys/kernel/dedup/stats
+echo "dedup $BLOCKS" > /sys/kernel/dedup/stats
+
+# Read the first device into the page cache, then the second one
+echo 3 > /proc/sys/vm/drop_caches
+dd if=$DEV1 of=/dev/null bs=$BS 2>/dev/null
+READS_BEFORE=$(awk '{print $1}' /sys/block/$(basename $DEV2)/stat)
+START=$(date +%s%N)
+dd if=$DEV2 of=/dev/null bs=$BS 2>/dev/null
+END=$(date +%s%N)
+READS_AFTER=$(awk '{print $1}' /sys/block/$(basename $DEV2)/stat)
+
+echo "second device: $(( (END - START) / 1000000 )) ms, $((READS_AFTER - READS_BEFORE)) disk reads"
+. cat_dedup.sh
+
+losetup -d $DEV2
+losetup -d $DEV1
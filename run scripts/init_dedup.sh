@@ -6,3 +6,8 @@ echo 'setbd /dev/sda7' > /sys/kernel/dedup/stats
 echo 'block 34816' > /sys/kernel/dedup/stats
 # Set the number of block between first and last blocks
 echo 'dedup 954384' > /sys/kernel/dedup/stats
+# Prewarm the hottest duplicated blocks saved by save_hot.sh
+if [ -f /var/lib/dedup/hot ]; then
+	echo 'warm 65536 pin' > /sys/kernel/dedup/stats
+	cat /var/lib/dedup/hot > /sys/kernel/dedup/hot
+fi
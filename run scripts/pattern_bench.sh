@@ -0,0 +1,30 @@
+#!/bin/bash
+# must run as SU
+# Zeroes half of a range of a loop device, times the scan of the range and
+# reads of the zeroed half, and prints the pattern blocks statistics.
+# usage: pattern_bench.sh <image> <first block> <blocks count>
+IMG=${1:-/media/dedup/debian1.img}
+FIRST=${2:-0}
+COUNT=${3:-262144}
+
+dd if=/dev/zero of=$IMG bs=4k seek=$FIRST count=$((COUNT / 2)) conv=notrunc
+LOOP=$(losetup -f --show $IMG)
+
+echo "setbd $LOOP" > /sys/kernel/dedup/stats
+echo "range $FIRST $((FIRST + COUNT - 1))" > /sys/kernel/dedup/stats
+echo "block $FIRST" > /sys/kernel/dedup/stats
+echo "---------- scan ----------"
+time echo "dedup $COUNT" > /sys/kernel/dedup/stats
+
+for i in 1 2
+do
+	. drop_pages.sh
+	echo "---------- zero reads $i ----------"
+	dd if=$LOOP of=/dev/null bs=128k skip=$((FIRST / 32)) count=$((COUNT / 64)) 2>&1 | tail -1
+done
+
+echo "---------- zero writes ----------"
+dd if=/dev/zero of=$LOOP bs=4k seek=$((FIRST + COUNT / 2)) count=4096 oflag=direct 2>&1 | tail -1
+. cat_dedup.sh
+
+losetup -d $LOOP
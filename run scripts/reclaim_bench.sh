@@ -0,0 +1,31 @@
+#!/bin/bash
+# must run as SU
+# Boots both VMs under memory pressure with and without reclaim hints
+# and compares the reads that reached the disk.
+# usage: reclaim_bench.sh <disk name> <MB to leave free>
+DISK=${1:-sda}
+FREE_MB=${2:-512}
+
+for mode in off on
+do
+	echo "rclm $mode" > /sys/kernel/dedup/stats
+	. drop_pages.sh > /dev/null
+
+	# Lock all memory but FREE_MB in a tmpfs file, 3.10 has no MemAvailable
+	mkdir -p /tmp/hog
+	mount -t tmpfs -o size=100% none /tmp/hog
+	HOG_MB=$(( $(awk '/^(MemFree|Cached|Buffers):/ {kb += $2} END {print kb}' /proc/meminfo) / 1024 - FREE_MB ))
+	dd if=/dev/zero of=/tmp/hog/fill bs=1M count=$HOG_MB 2> /dev/null
+
+	READS_BEFORE=$(awk '{print $1}' /sys/block/$DISK/stat)
+	qemu-system-i386 -hda /media/dedup/debian1.img -m 256 &
+	qemu-system-i386 -hda /media/dedup/debian2.img -m 256 &
+	sleep 60
+	pkill qemu
+	READS_AFTER=$(awk '{print $1}' /sys/block/$DISK/stat)
+
+	umount /tmp/hog
+	echo "---------- rclm $mode: $((READS_AFTER - READS_BEFORE)) disk reads ----------"
+	. cat_dedup.sh
+	sleep 3
+done
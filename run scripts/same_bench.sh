@@ -0,0 +1,34 @@
+#!/bin/bash
+# must run as SU
+# Rewrites blocks of a loop device with the content they already have, with
+# and without identical writes suppression. The blocks are read first through
+# the content cache so there is a copy to verify against (only content with
+# equal blocks is kept in memory, other writes are sent).
+# usage: same_bench.sh <image> <first block> <blocks count>
+IMG=${1:-/media/dedup/debian1.img}
+FIRST=${2:-0}
+COUNT=${3:-16384}
+
+LOOP=$(losetup -f --show $IMG)
+DATA=/tmp/same_bench.data
+
+echo "setbd $LOOP" > /sys/kernel/dedup/stats
+echo "range $FIRST $((FIRST + COUNT - 1))" > /sys/kernel/dedup/stats
+echo "block $FIRST" > /sys/kernel/dedup/stats
+echo "dedup $COUNT" > /sys/kernel/dedup/stats
+echo "cache $COUNT" > /sys/kernel/dedup/stats
+
+dd if=$LOOP of=$DATA bs=4k skip=$FIRST count=$COUNT 2> /dev/null
+
+for mode in off on
+do
+	echo "same $mode" > /sys/kernel/dedup/stats
+	echo "---------- same $mode ----------"
+	time dd if=$DATA of=$LOOP bs=4k seek=$FIRST count=$COUNT oflag=direct conv=notrunc 2>&1 | tail -1
+	. cat_dedup.sh
+done
+
+echo "same off" > /sys/kernel/dedup/stats
+echo "cache 0" > /sys/kernel/dedup/stats
+rm -f $DATA
+losetup -d $LOOP
@@ -0,0 +1,6 @@
+#!/bin/bash
+# must run as SU, before shutdown
+# Saves the hottest duplicated blocks to be prewarmed by init_dedup.sh
+mkdir -p /var/lib/dedup
+cat /sys/kernel/dedup/hot > /var/lib/dedup/hot
+wc -l /var/lib/dedup/hot
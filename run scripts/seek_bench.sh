@@ -0,0 +1,30 @@
+#!/bin/bash
+# must run as SU
+# Compares random reads with and without seek aware read redirection
+# on a loop device marked as rotational.
+# usage: seek_bench.sh <image> <first block> <blocks count>
+IMG=${1:-/media/dedup/debian1.img}
+FIRST=${2:-0}
+COUNT=${3:-262144}
+
+LOOP=$(losetup -f --show $IMG)
+echo 1 > /sys/block/$(basename $LOOP)/queue/rotational
+
+echo "setbd $LOOP" > /sys/kernel/dedup/stats
+echo "range $FIRST $((FIRST + COUNT - 1))" > /sys/kernel/dedup/stats
+echo "block $FIRST" > /sys/kernel/dedup/stats
+echo "dedup $COUNT" > /sys/kernel/dedup/stats
+
+for mode in off seek
+do
+	echo "redir $mode" > /sys/kernel/dedup/stats
+	. drop_pages.sh > /dev/null
+	echo "---------- redir $mode ----------"
+	fio --name=seek_$mode --filename=$LOOP --rw=randread --bs=4k \
+		--direct=1 --iodepth=16 --ioengine=libaio --runtime=60 --time_based \
+		--offset=$((FIRST * 4096)) --size=$((COUNT * 4096)) | grep -E "iops|lat"
+	. cat_dedup.sh
+done
+
+echo "redir off" > /sys/kernel/dedup/stats
+losetup -d $LOOP
@@ -0,0 +1,50 @@
+#!/bin/bash
+# must run as SU
+# Memory overcommit benchmark: several processes holding the same data
+# (like identical guests) in a memory cgroup smaller than their total size,
+# so they swap. Compares swap-in reads with and without serving them from
+# memory. The dedup domain is the swap partition.
+# usage: swap_bench.sh <swap partition> <processes> <MB per process> <cgroup limit MB>
+SWAP=${1:-/dev/sda2}
+PROCS=${2:-4}
+MB=${3:-256}
+LIMIT=${4:-512}
+BLOCKS=$(( $(blockdev --getsize64 $SWAP) / 4096 ))
+CG=/sys/fs/cgroup/memory/dedup_swap
+
+swapoff -a
+mkswap $SWAP > /dev/null
+swapon $SWAP
+
+echo "setbd $SWAP" > /sys/kernel/dedup/stats
+echo "range 0 $((BLOCKS - 1))" > /sys/kernel/dedup/stats
+echo "block 0" > /sys/kernel/dedup/stats
+echo "dedup $BLOCKS" > /sys/kernel/dedup/stats
+
+mkdir -p $CG
+echo $((LIMIT << 20)) > $CG/memory.limit_in_bytes
+
+for mode in off on
+do
+	echo "swap $mode" > /sys/kernel/dedup/stats
+	echo "---------- swap $mode ----------"
+	start=$(date +%s.%N)
+	for i in $(seq $PROCS)
+	do
+		# Same pseudo random content in every process, touched twice
+		sh -c "echo \$\$ > $CG/tasks; exec python -c \"
+import random
+random.seed(1)
+buf = bytearray(random.getrandbits(8) for _ in range(1 << 20)) * $MB
+for r in range(2):
+	for off in range(0, len(buf), 4096):
+		buf[off] ^= 0
+\"" &
+	done
+	wait
+	echo "time: $(echo "$(date +%s.%N) - $start" | bc) s"
+	. cat_dedup.sh
+done
+
+echo "swap off" > /sys/kernel/dedup/stats
+rmdir $CG
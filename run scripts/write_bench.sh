@@ -0,0 +1,40 @@
+#!/bin/bash
+# must run as SU
+# Sequential and random writes to a loop device in the dedup range, with the
+# throughput and latency seen by fio and the statistics of the write workers.
+# Run it on a kernel without the write workers to compare submit latency.
+# usage: write_bench.sh <image> <first block> <blocks count>
+IMG=${1:-/media/dedup/debian1.img}
+FIRST=${2:-0}
+COUNT=${3:-262144}
+
+LOOP=$(losetup -f --show $IMG)
+
+echo "setbd $LOOP" > /sys/kernel/dedup/stats
+echo "range $FIRST $((FIRST + COUNT - 1))" > /sys/kernel/dedup/stats
+echo "block $FIRST" > /sys/kernel/dedup/stats
+echo "dedup $COUNT" > /sys/kernel/dedup/stats
+
+echo "---------- sequential write ----------"
+fio --name=seqwrite --filename=$LOOP --rw=write --bs=4M \
+	--direct=1 --iodepth=4 --ioengine=libaio --runtime=60 --time_based \
+	--offset=$((FIRST * 4096)) --size=$((COUNT * 4096)) | grep -E "bw=|lat"
+. cat_dedup.sh
+
+for depth in 1 16
+do
+	echo "---------- random write, iodepth $depth ----------"
+	fio --name=write_$depth --filename=$LOOP --rw=randwrite --bs=4k \
+		--direct=1 --iodepth=$depth --ioengine=libaio --runtime=60 --time_based \
+		--offset=$((FIRST * 4096)) --size=$((COUNT * 4096)) | grep -E "iops|lat"
+	. cat_dedup.sh
+done
+
+# Partial block writes leave blocks unknown until they are read back
+echo "---------- random 2k write ----------"
+fio --name=write_2k --filename=$LOOP --rw=randwrite --bs=2k \
+	--direct=1 --iodepth=16 --ioengine=libaio --runtime=60 --time_based \
+	--offset=$((FIRST * 4096)) --size=$((COUNT * 4096)) | grep -E "iops|lat"
+. cat_dedup.sh
+
+losetup -d $LOOP